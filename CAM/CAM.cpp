@@ -1,9 +1,12 @@
 #include <iostream>
+#include <fstream>
 
 #include "code.h"
 #include "term.h"
 #include "CAM.h"
 #include "history.h"
+#include "parser.h"
+#include "translator.h"
 
 namespace CAM
 {
@@ -15,333 +18,210 @@ namespace CAM
 		msg = ossteam.str();
 	}
 
+	InvalidCodeException::InvalidCodeException(const std::string& what_arg, size_t offset, size_t line, size_t column) :
+		CAMException("Invalid code: " + what_arg + " at line " + std::to_string(line) + ", column " + std::to_string(column) +
+			" (offset " + std::to_string(offset) + ")"),
+		_offset(offset), _line(line), _column(column) {}
 
-	CAM::CAM() : _is_verbose(false) {
-		init_transitions();
-		init_parsers();
+	LimitException::LimitException(Machine::limit_t limit, const Stats &stats) :
+		CAMException(message(limit, stats)), _limit(limit), _stats(stats) {}
+
+	const char* LimitException::limit_name(Machine::limit_t limit) {
+		switch (limit) {
+		case Machine::limit_steps: return "steps";
+		case Machine::limit_memory: return "memory";
+		case Machine::limit_depth: return "depth";
+		case Machine::limit_time: return "time";
+		}
+		return "";
 	}
 
-	void CAM::run(const std::string &s) {
-		size_t i = 0;
+	std::string LimitException::message(Machine::limit_t limit, const Stats &stats) {
+		std::ostringstream ossteam;
+		ossteam << "Limit reached: " << limit_name(limit) << " (steps: " << stats.steps << ", max frames: " << stats.max_depth
+			<< ", memory: " << stats.memory << ", time: " << stats.seconds << ")";
+		return ossteam.str();
+	}
 
+
+	CAM::CAM() : _is_verbose(false), _is_print_result(false), _is_print_stats(false), _is_optimize(true), _is_trim(false), _is_dump(false), _is_typecheck(false), _history(nullptr), _fork_cost(0) {}
+
+	void CAM::run(const std::string &s, source_t from) {
 		History history;
-		_term = Term::make();
+		std::string source = s;
 
 		time_point_t begin = std::chrono::steady_clock::now();
+		time_point_t executed = begin;
+		double cpu_time = Pool::cpu_time();
 
 		try {
-			CodeTerm::code_t code = parse_code(s);
-
-			while (!code.empty())
-			{
-				if (_is_verbose)
-					history.add(_term->to_string(), CodeTerm::to_string(code), to_string(_stack));
-
-				char op = code.front()->op();
-
-				auto tr = _transitions[op];
-
-				tr(_term, code, _stack);
-				++i;
+			if (from == source_code)
+				load(s);
+			else {
+				_machine.clear();
+				_program.reset();
+
+				if (from == source_image) {
+					_program = Program::load(s, &source);
+					check(*_program);
+					_machine.load(_program);
+				}
+				else {
+					_program = Snapshot::load(s, _machine, &source);
+					check(*_program);
+				}
 			}
 
+			if (_is_dump)
+				_program->dump(std::cout);
+			if (_trace)
+				_trace->begin(source, _program->optimized());
+			_machine.set_heap_observer(_trace.get());
+			if (_profile)
+				_profile->begin(*_program);
+
+			if (_pool)
+				_pool->reset_stats();
+			if (_snapshot)
+				_snapshot->begin(*_program, source);
+
+			_history = &history;
+			_machine.set_observer(is_observed() ? this : nullptr);
+			_machine.set_pool(is_observed() ? nullptr : _pool.get());
+			executed = std::chrono::steady_clock::now();
+			cpu_time = Pool::cpu_time();
+			_machine.execute();
+			_history = nullptr;
+
 			if (_is_verbose)
-				history.add(_term->to_string(), CodeTerm::to_string(code), to_string(_stack));
+				record(history);
+		}
+		catch (CAMException &e) {
+			_history = nullptr;
+			std::cerr << e.what() << std::endl;
+		}
+
+		try {
+			if (_snapshot)
+				_snapshot->wait();
 		}
 		catch (CAMException &e) {
-			const char *s = e.what();
 			std::cerr << e.what() << std::endl;
 		}
 
 		time_point_t end = std::chrono::steady_clock::now();
+		cpu_time = Pool::cpu_time() - cpu_time;
+
+		if (_trace)
+			_trace->end();
+		if (_profile && _program)
+			_profile->end(heap_stats(), _machine.steps());
 		
 		history.print();
 		
-		std::cout << "time: " << std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count() / 1000000.0 << std::endl;
+		double time = std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count() / 1000000.0;
+		std::cout << "time: " << time << std::endl;
+
+		if (_is_print_stats) {
+			std::cout << "steps: " << steps() << std::endl;
+			if (time > 0)
+				std::cout << "steps/s: " << static_cast<size_t>(steps() / time) << std::endl;
+			std::cout << "max frames: " << max_depth() << std::endl;
+			std::cout << "checked: " << (_machine.checked() ? "yes" : "no") << std::endl;
+			std::cout << "heap size: " << heap_size() << std::endl;
+			std::cout << "heap bytes allocated: " << heap_stats().bytes_allocated() << std::endl;
+			std::cout << "gc collections: " << heap_stats().collections << std::endl;
+			std::cout << "gc bytes copied: " << heap_stats().bytes_copied << std::endl;
+			std::cout << "gc pause: " << heap_stats().pause << std::endl;
+			if (_snapshot)
+				std::cout << "snapshots: " << _snapshot->count() << std::endl;
+
+			if (_machine.pool() && _program && _program->forks()) {
+				// CPU time of all threads to the time of the run: the threads
+				// busy on average. It counts the work of the forks themselves,
+				// so it is no speedup over a sequential run.
+				Pool::Stats stats = _pool->stats();
+				double run = std::chrono::duration<double>(end - executed).count();
+				std::cout << "forks: " << stats.tasks << std::endl;
+				std::cout << "forks stolen: " << stats.stolen << std::endl;
+				if (run > 0)
+					std::cout << "parallelism: " << (cpu_time + stats.work) / run << std::endl;
+			}
 
-		if (_is_verbose || _is_print_result)
-			std::cout << "term: " << *_term << std::endl;
-	}
+			if (_memo) {
+				std::cout << "memo hits: " << _memo->stats().hits << std::endl;
+				std::cout << "memo misses: " << _memo->stats().misses << std::endl;
+				std::cout << "memo entries: " << _memo->size() << std::endl;
+				std::cout << "memo evictions: " << _memo->stats().evictions << std::endl;
+			}
+		}
 
-	CodeTerm::code_t CAM::parse_code(const std::string &s) {
-		std::string c = s;
-		CodeTerm::code_t code;
-		while (!c.empty())
-		{
-			auto p = _op_parsers[c[0]];
-			c = p(c, code);
+		if (_profile && _program) {
+			_profile->print(std::cout);
+
+			if (!_collapsed.empty()) {
+				std::ofstream os(_collapsed.c_str());
+				if (os)
+					_profile->write_collapsed(os);
+				else
+					std::cerr << "Cannot write profile: " << _collapsed << std::endl;
+			}
 		}
 
-		return code;
+		if (_is_verbose || _is_print_result) {
+			std::cout << "term: ";
+			_printer.print(std::cout, _machine.term(), _machine.program().get());
+			std::cout << std::endl;
+		}
 	}
 
-	void CAM::init_parsers() {
-		auto undef = [](const std::string& s, CodeTerm::code_t &code) -> std::string {
-			throw InvalidCodeException(s);
-		};
-
-		auto default_parser = [](const std::string& s, CodeTerm::code_t &code) -> std::string {
-			auto t = CodeTerm::make(s[0]);
-			code.push_back(t);
-			return s.substr(1);
-		};
-
-		auto un_op_parser = [this](const std::string &s, CodeTerm::code_t &code) -> std::string {
-			auto res = get_op_arg(s);
-			auto args = CodeTermWithArgs::args_t();
-			args.push_back(parse_code(res.first));
-			auto t = CodeTermWithArgs::make(s[0], args);
-			code.push_back(t);
-			return res.second;
-		};
-
-		auto quote_op_parser = [this](const std::string &s, CodeTerm::code_t &code) -> std::string {
-			auto res = get_op_arg(s);
-			auto t = QuoteCodeTerm::make(res.first);
-			code.push_back(t);
-			return res.second;
-		};
-
-		auto bin_op_parser = [this](const std::string &s, CodeTerm::code_t &code) -> std::string {
-			auto res = get_op_arg(s);
-			std::string rest = res.second;
-			auto args = CodeTermWithArgs::args_t();
-
-			res = get_op_arg(res.first, false);
-			args.push_back(parse_code(res.first));
-			res = get_op_arg(res.second);
-			args.push_back(parse_code(res.first));
-
-			auto t = CodeTermWithArgs::make(s[0], args);
-
-			code.push_back(t);
-			return rest;
-		};
-
-		for (size_t i = 0; i < sizeof(_op_parsers) / sizeof(*_op_parsers); i++)
-			_op_parsers[i] = undef;
-
-		_op_parsers['F'] = default_parser;
-		_op_parsers['S'] = default_parser;
-		_op_parsers['<'] = default_parser;
-		_op_parsers[','] = default_parser;
-		_op_parsers['>'] = default_parser;
-		_op_parsers['e'] = default_parser;
-
-		_op_parsers['+'] = default_parser;
-		_op_parsers['-'] = default_parser;
-		_op_parsers['='] = default_parser;
-		_op_parsers['*'] = default_parser;
-
-		_op_parsers['\\'] = un_op_parser;
-		_op_parsers['\''] = quote_op_parser;
-		_op_parsers['Y'] = un_op_parser;
-
-		_op_parsers['b'] = bin_op_parser;
+	std::shared_ptr<const Program> CAM::compile(const std::string &s) const {
+		std::shared_ptr<const Program> program = std::make_shared<const Program>(Parser(s).parse(), _is_optimize, _is_trim,
+			_pool && !is_observed() ? _fork_cost : 0, _memo != nullptr);
+		check(*program);
+		return program;
 	}
 
-	void CAM::init_transitions() {
-		auto undef = [](Term::term_ptr &term, CodeTerm::code_t &code, stack_t &stack) {
-			throw InvalidCodeException(code.front()->to_string());
-		};
-
-		for (size_t i = 0; i < sizeof(_transitions) / sizeof(*_transitions); i++)
-			_transitions[i] = undef;
-
-		_transitions['F'] = [](Term::term_ptr &term, CodeTerm::code_t &code, stack_t &stack) {
-			auto pair = std::dynamic_pointer_cast<TermPair>(term);
-			if (!pair.get())
-				throw InvalidTermException(term->to_string(), "(s, t)");
-
-			term = pair->first();
-			code.pop_front();
-		};
-
-		_transitions['S'] = [](Term::term_ptr &term, CodeTerm::code_t &code, stack_t &stack) {
-			auto pair = std::dynamic_pointer_cast<TermPair>(term);
-			if (!pair.get())
-				throw InvalidTermException(term->to_string(), "(s, t)");
-
-			term = pair->second();
-			code.pop_front();
-		};
-
-		_transitions['<'] = [](Term::term_ptr &term, CodeTerm::code_t &code, stack_t &stack) {
-			stack.push_front(term);
-			code.pop_front();
-		};
-
-		_transitions[','] = [](Term::term_ptr &term, CodeTerm::code_t &code, stack_t &stack) {
-			if (stack.empty())
-				throw InvalidStackException("Empty stack");
-
-			auto top = stack.front();
-			stack.pop_front();
-			stack.push_front(term);
-			term = top;
-			code.pop_front();
-		};
-
-		_transitions['>'] = [](Term::term_ptr &term, CodeTerm::code_t &code, stack_t &stack) {
-			if (stack.empty())
-				throw InvalidStackException("Empty stack");
-
-			auto top = stack.front();
-			stack.pop_front();
-			term = TermPair::make(top, term);
-			code.pop_front();
-		};
-
-		_transitions['e'] = [](Term::term_ptr &term, CodeTerm::code_t &code, stack_t &stack) {
-			auto pair = std::dynamic_pointer_cast<TermPair>(term);
-			if (!pair.get())
-				throw InvalidTermException(term->to_string(), "(C: s, t)");
-
-			auto app_term = std::dynamic_pointer_cast<AppTerm>(pair->first());
-			if (!app_term.get())
-				throw InvalidTermException(term->to_string(), "(C: s, t)");
-
-			auto c = app_term->code();
-			term = TermPair::make(app_term->term(), pair->second());
-			code.pop_front();
-			code.insert(code.begin(), c.begin(), c.end());
-		};
-
-		_transitions['\\'] = [](Term::term_ptr &term, CodeTerm::code_t &code, stack_t &stack) {
-			auto c = std::dynamic_pointer_cast<CodeTermWithArgs>(code.front());
-			if (!c.get())
-				throw InvalidCodeException(code.front()->to_string());
-
-			if (c->args_count() != 1)
-				throw InvalidCodeException(c->to_string());
-
-			term = AppTerm::make(c->get_arg(0), term);
-			code.pop_front();
-		};
-
-		_transitions['\''] = [](Term::term_ptr &term, CodeTerm::code_t &code, stack_t &stack) {
-			auto c = std::dynamic_pointer_cast<QuoteCodeTerm>(code.front());
-			if (!c.get())
-				throw InvalidCodeException(code.front()->to_string());
-
-			term = QuoteTerm::make(c->get_arg());
-			code.pop_front();
-		};
-
-		_transitions['b'] = [](Term::term_ptr &term, CodeTerm::code_t &code, stack_t &stack) {
-			auto t = std::dynamic_pointer_cast<QuoteTerm>(term);
-			if (!t.get())
-				throw InvalidTermException(term->to_string(), "numeric constant");
-
-			if (stack.empty())
-				throw InvalidStackException("Empty stack");
-
-			auto top = stack.front();
-			stack.pop_front();
-			term = top;
-
-			auto c = std::dynamic_pointer_cast<CodeTermWithArgs>(code.front());
-			if (!c.get())
-				throw InvalidCodeException(code.front()->to_string());
-
-			if (c->args_count() != 2)
-				throw InvalidCodeException(c->to_string());
-
-			CodeTerm::code_t next;
-
-			if (t->value() != 0)
-				next = c->get_arg(0);
-			else
-				next = c->get_arg(1);
-				
-			code.pop_front();
-			code.insert(code.begin(), next.begin(), next.end());
-		};
-
-		_transitions['Y'] = [this](Term::term_ptr &term, CodeTerm::code_t &code, stack_t &stack) {
-			auto c = std::dynamic_pointer_cast<CodeTermWithArgs>(code.front());
-			if (!c.get())
-				throw InvalidCodeException(code.front()->to_string());
-
-			if (c->args_count() != 1)
-				throw InvalidCodeException(c->to_string());
-
-			term = RecTerm::make(c->get_arg(0), term);
-			code.pop_front();
-		};
-
-		_transitions['+'] = [](Term::term_ptr &term, CodeTerm::code_t &code, stack_t &stack) {
-			apply_operation(term, [](const mpz_class &a, const mpz_class &b) {
-				return a + b;
-			});
-			code.pop_front();
-		};
-
-		_transitions['-'] = [](Term::term_ptr &term, CodeTerm::code_t &code, stack_t &stack) {
-			apply_operation(term, [](const mpz_class &a, const mpz_class &b) {
-				return a - b;
-			});
-			code.pop_front();
-		};
-
-		_transitions['*'] = [](Term::term_ptr &term, CodeTerm::code_t &code, stack_t &stack) {
-			apply_operation(term, [](const mpz_class &a, const mpz_class &b) {
-				return a * b;
-			});
-			code.pop_front();
-		};
-
-		_transitions['='] = [](Term::term_ptr &term, CodeTerm::code_t &code, stack_t &stack) {
-			apply_operation(term, [](const mpz_class &a, const mpz_class &b) {
-				return a == b;
-			});
-			code.pop_front();
-		};
+	void CAM::check(const Program &program) const {
+		if (_is_typecheck && !program.typed())
+			throw TypeException(program.type_error());
 	}
 
-	void CAM::apply_operation(Term::term_ptr &term, binary_operation_t op) {
-		auto pair = std::dynamic_pointer_cast<TermPair>(term);
-		if (!pair.get())
-			throw InvalidTermException(term->to_string(), "(s,t)");
+	void CAM::translate(const std::string &s, const std::string &path) const {
+		CodeTerm::code_t code = Parser(s).parse();
+		std::ostringstream os;
+		Translator(code).write(os);
 
-		auto first = std::dynamic_pointer_cast<QuoteTerm>(pair->first());
-		if (!first.get())
-			throw InvalidTermException(term->to_string(), "(s,t) where s and t - numeric constants");
+		std::ofstream file(path.c_str(), std::ios::trunc);
+		if (!(file << os.str()))
+			throw CAMException("Cannot write translation: " + path);
+	}
 
-		auto second = std::dynamic_pointer_cast<QuoteTerm>(pair->second());
-		if (!second.get())
-			throw InvalidTermException(term->to_string(), "(s,t) where s and t - numeric constants");
+	void CAM::load(const std::string &s) {
+		_machine.clear();
+		_program.reset();
 
-		term = QuoteTerm::make(op(first->value(), second->value()));
+		_program = compile(s);
+		_machine.load(_program);
 	}
 
-	std::pair<std::string, std::string> CAM::get_op_arg(const std::string &c, bool with_op) {
-		int br_sum = 1;
-		size_t start_idx = with_op ? 2 : 1;
-		size_t i = start_idx;
-		for (; i < c.length() && br_sum; i++) {
-			if (c[i] == '(')
-				++br_sum;
-			else if (c[i] == ')')
-				--br_sum;
-		}
+	void CAM::evaluate() {
+		_machine.set_observer(nullptr);
+		_machine.execute();
+	}
 
-		if (c.length() <= start_idx)
-			throw InvalidCodeException(c);
+	void CAM::step(const Machine &machine) {
+		const Continuation &code = *machine.code();
 
-		return std::make_pair<>(c.substr(start_idx, i - start_idx - 1), c.substr(i));
+		if (_is_verbose && _history)
+			record(*_history);
+		if (_trace)
+			_trace->add(machine.steps(), static_cast<uint32_t>(code.pc()), code.current().op, machine.term(), machine.stack().size(), code.depth());
+		if (_profile)
+			_profile->step(code.pc(), machine.term(), code.depth(), machine.steps(), machine.heap_stats());
 	}
 
-	std::string CAM::to_string(stack_t &stack) {
-		std::ostringstream ossteam;
-		ossteam << '[';
-		for (size_t i = 0; i < stack.size(); i++) {
-			ossteam << stack[i]->to_string();
-			if (i != stack.size() - 1)
-				ossteam << ", ";
-		}
-		ossteam << ']';
-
-		return ossteam.str();
+	void CAM::record(History &history) {
+		history.add(_machine.term_string(_printer), _machine.code()->to_string(), _machine.stack_string(_printer));
 	}
 }
@@ -3,18 +3,21 @@
 #include <string>
 #include <deque>
 #include <map>
-#include <functional>
 #include <chrono>
+#include <memory>
 
 #include "code.h"
+#include "program.h"
 #include "term.h"
+#include "value.h"
+#include "heap.h"
+#include "machine.h"
+#include "trace.h"
+#include "profile.h"
+#include "snapshot.h"
 
 namespace CAM
 {
-	typedef std::deque<Term::term_ptr> stack_t;
-	typedef std::function<void(Term::term_ptr&, CodeTerm::code_t&, stack_t&)> transition_t;
-	typedef std::function<mpz_class(const mpz_class&, const mpz_class&)> binary_operation_t;
-	typedef std::function<std::string(const std::string&, CodeTerm::code_t&)> op_parser_t;
 	typedef std::chrono::steady_clock::time_point time_point_t;
 
 	class CAMException : public std::runtime_error
@@ -43,23 +46,131 @@ namespace CAM
 
 	class InvalidCodeException : public CAMException
 	{
+		size_t _offset;
+		size_t _line;
+		size_t _column;
 	public:
-		InvalidCodeException(const std::string& what_arg) : CAMException("Invalid code: " + what_arg) {}
+		InvalidCodeException(const std::string& what_arg) :
+			CAMException("Invalid code: " + what_arg), _offset(std::string::npos), _line(0), _column(0) {}
+
+		// Position in the source: byte offset, line and column counted from 1
+		InvalidCodeException(const std::string& what_arg, size_t offset, size_t line, size_t column);
+
+		size_t offset() const { return _offset; }
+		size_t line() const { return _line; }
+		size_t column() const { return _column; }
 	};
 
-	class CAM
+	// A program the checker cannot prove typed, see Program::typed
+	class TypeException : public CAMException
 	{
-		stack_t _stack;
-		Term::term_ptr _term;
-		transition_t _transitions[256];
-		op_parser_t _op_parsers[256];
+	public:
+		TypeException(const std::string& what_arg) : CAMException("Type error: " + what_arg) {}
+	};
+
+	// A run stopped by a bound of Machine::Limits, with its statistics up to
+	// the stop
+	class LimitException : public CAMException
+	{
+	public:
+		struct Stats
+		{
+			size_t steps;
+			size_t max_depth;
+			size_t memory;	// bytes held by the heap, the stack and the frames
+			double seconds;
+		};
+
+	private:
+		Machine::limit_t _limit;
+		Stats _stats;
+
+	public:
+		LimitException(Machine::limit_t limit, const Stats &stats);
+
+		Machine::limit_t limit() const { return _limit; }
+		const Stats& stats() const { return _stats; }
+
+		static const char* limit_name(Machine::limit_t limit);
+
+	private:
+		static std::string message(Machine::limit_t limit, const Stats &stats);
+	};
+
+	class History;
+
+	// Front end of the machine: compiles the code with the options, runs it
+	// and prints the result, the history, the statistics, the trace and the
+	// profile of the run
+	class CAM : public Machine::Observer
+	{
+	public:
+		typedef Machine::dispatch_t dispatch_t;
+
+	private:
+		Machine _machine;
+		std::shared_ptr<const Program> _program;
 		bool _is_verbose;
 		bool _is_print_result;
+		bool _is_print_stats;
+		bool _is_optimize;
+		bool _is_trim;
+		bool _is_dump;
+		bool _is_typecheck;
+		std::unique_ptr<Trace> _trace;
+		std::unique_ptr<Profile> _profile;
+		std::string _collapsed;
+		// history of the run in progress, if it is verbose
+		History *_history;
+		std::unique_ptr<Pool> _pool;
+		size_t _fork_cost;
+		std::unique_ptr<Memo> _memo;
+		std::unique_ptr<Snapshot> _snapshot;
+		Printer _printer;
+
+		enum source_t
+		{
+			source_code,
+			source_image,
+			source_snapshot
+		};
 
 	public:
 		CAM();
 
-		void run(const std::string &s);
+		// Parses, executes and prints the result and statistics
+		void run(const std::string &s) { run(s, source_code); }
+
+		// Same for the program of the image file, nothing is parsed
+		void run_image(const std::string &path) { run(path, source_image); }
+
+		// Continues the run of the snapshot file
+		void resume(const std::string &path) { run(path, source_snapshot); }
+
+		// Parses and compiles the code with the options of the machine, the
+		// program may be shared by machines of other threads
+		std::shared_ptr<const Program> compile(const std::string &s) const;
+
+		// Compiles the code with the options of the machine to the image file
+		void compile(const std::string &s, const std::string &path) const { compile(s)->save(path, s); }
+
+		// Translates the code to a C++ translation unit in the file, see
+		// Translator
+		void translate(const std::string &s, const std::string &path) const;
+
+		// Parses and compiles the code, the machine is reset
+		void load(const std::string &s);
+
+		// Executes the loaded code without printing
+		void evaluate();
+
+		Machine& machine() { return _machine; }
+
+		size_t steps() const { return _machine.steps(); }
+		size_t max_depth() const { return _machine.max_depth(); }
+		const Heap::Stats& heap_stats() const { return _machine.heap_stats(); }
+		// Bytes held by the heap, the stack and the return frames
+		size_t peak_memory() const { return _machine.peak_memory(); }
 
 		void set_verbose(bool is_verbose) { _is_verbose = is_verbose; }
 		bool verbose() const { return _is_verbose; }
@@ -67,17 +178,87 @@ namespace CAM
 		void set_is_print_result(bool is_print_result) { _is_print_result = is_print_result; }
 		bool print_result() const { return _is_print_result; }
 
-	private:
-		CodeTerm::code_t parse_code(const std::string &s);
+		// Printing of the terms of the result and of the history, also of the
+		// results of the batch and of the server
+		void set_printer(const Printer &printer) { _printer = printer; }
+		const Printer& printer() const { return _printer; }
+
+		void set_is_print_stats(bool is_print_stats) { _is_print_stats = is_print_stats; }
+		bool print_stats() const { return _is_print_stats; }
+
+		void set_flat_env(bool is_flat_env) { _machine.set_flat_env(is_flat_env); }
+		bool flat_env() const { return _machine.flat_env(); }
+
+		void set_heap_size(size_t size) { _machine.set_heap_size(size); }
+		size_t heap_size() const { return _machine.heap_size(); }
+
+		void set_dispatch(dispatch_t dispatch) { _machine.set_dispatch(dispatch); }
+		dispatch_t dispatch() const { return _machine.dispatch(); }
 
-		void init_parsers();
+		// Bounds of the runs, see Machine::Limits
+		void set_limits(const Machine::Limits &limits) { _machine.set_limits(limits); }
+		const Machine::Limits& limits() const { return _machine.limits(); }
 
-		void init_transitions();
+		// Superinstructions, see Program::optimize
+		void set_optimize(bool is_optimize) { _is_optimize = is_optimize; }
+		bool optimize() const { return _is_optimize; }
 
-		static void apply_operation(Term::term_ptr &term, binary_operation_t op);
+		// Closures keep only the parts of the environment their bodies read,
+		// see Program::analyze; off by default, the environments of closures
+		// in the result are printed as they were built
+		void set_trim(bool is_trim) { _is_trim = is_trim; }
+		bool trim() const { return _is_trim; }
+
+		// Programs proved typed run without the checks of their terms, see
+		// Machine::set_unchecked
+		void set_unchecked(bool is_unchecked) { _machine.set_unchecked(is_unchecked); }
+		bool unchecked() const { return _machine.unchecked(); }
+
+		// Programs which are not proved typed are rejected before they run
+		void set_typecheck(bool is_typecheck) { _is_typecheck = is_typecheck; }
+		bool typecheck() const { return _is_typecheck; }
+
+		// Throws TypeException if the typecheck rejects the program
+		void check(const Program &program) const;
+
+		// Prints the listing of the compiled program before the run
+		void set_dump(bool is_dump) { _is_dump = is_dump; }
+		bool dump() const { return _is_dump; }
+
+		// Writes the binary trace of the next runs to path: the last steps only
+		// (0 - all of them) and every Kth step
+		void set_trace(const std::string &path, size_t last, size_t every) { _trace.reset(new Trace(path, last, every)); }
+
+		// Prints the profile of the next runs, collapsed stacks are written to
+		// the file if it is not empty
+		void set_profile(const std::string &collapsed) { _profile.reset(new Profile()); _collapsed = collapsed; }
+
+		// Runs the sides of the costly <A,B> in parallel on a pool of threads
+		// (0 - one per hardware thread), see Program::fork. Observed runs are
+		// sequential.
+		void set_parallel(size_t threads, size_t fork_cost = Program::call_cost) { _pool.reset(new Pool(threads)); _fork_cost = fork_cost; }
+		bool parallel() const { return _pool != nullptr; }
+
+		// Caches the results of the applications of recursive functions, at
+		// most capacity of them, see Memo
+		void set_memo(size_t capacity = Memo::default_capacity) { _memo.reset(new Memo(capacity)); _machine.set_memo(_memo.get()); }
+		bool memo() const { return _memo != nullptr; }
+
+		// Takes snapshots of the next runs to the file every some steps (0 -
+		// only when Snapshot::request is called), see Snapshot. Runs with
+		// forks in progress or with a memo are not saved.
+		void set_snapshot(const std::string &path, size_t every) { _snapshot.reset(new Snapshot(path, every)); _machine.set_snapshot(_snapshot.get()); }
+		bool snapshot() const { return _snapshot != nullptr; }
+
+		// Observation of the machine before a step: history, trace, profile
+		virtual void step(const Machine &machine);
+
+	private:
+		// The code, or the path of the image or of the snapshot
+		void run(const std::string &s, source_t source);
 
-		static std::pair<std::string, std::string> get_op_arg(const std::string &c, bool with_op=true);
+		bool is_observed() const { return _is_verbose || _trace || _profile; }
 
-		static std::string to_string(stack_t &stack);
+		void record(History &history);
 	};
-};
\ No newline at end of file
+}
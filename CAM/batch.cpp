@@ -0,0 +1,176 @@
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <chrono>
+
+#include "batch.h"
+#include "mapped.h"
+
+namespace CAM
+{
+	Batch::Batch(CAM &cam, size_t threads) : _cam(cam), _threads(threads), _text(nullptr) {
+		if (_threads == 0)
+			_threads = std::thread::hardware_concurrency();
+		if (_threads == 0)
+			_threads = 1;
+	}
+
+	bool Batch::run(const std::string &path, std::ostream &os) {
+		if (path == "-") {
+			std::ostringstream ss;
+			ss << std::cin.rdbuf();
+			std::string text = ss.str();
+			return run(text.data(), text.size(), os);
+		}
+
+		MappedFile file(path);
+		return run(file.data(), file.size(), os);
+	}
+
+	bool Batch::run(const char *text, size_t size, std::ostream &os) {
+		time_point_t begin = std::chrono::steady_clock::now();
+
+		split(text, size);
+		_results.assign(_programs.size(), Result());
+
+		// Contiguous ranges of the programs, so the stolen ones are far from
+		// those the owner takes next
+		size_t threads = std::min(_threads, std::max<size_t>(_programs.size(), 1));
+		_queues.clear();
+		for (size_t i = 0; i < threads; i++) {
+			_queues.push_back(std::unique_ptr<Queue>(new Queue()));
+			for (size_t p = _programs.size() * i / threads; p < _programs.size() * (i + 1) / threads; p++)
+				_queues[i]->programs.push_back(p);
+		}
+
+		std::vector<std::thread> workers;
+		for (size_t i = 0; i < threads; i++)
+			workers.push_back(std::thread(&Batch::work, this, i));
+
+		size_t errors = 0;
+		size_t steps = 0;
+		for (size_t i = 0; i < _results.size(); i++) {
+			Result result;
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				_done.wait(lock, [this, i] { return _results[i].is_done; });
+				std::swap(result, _results[i]);
+			}
+
+			os << i << '\t' << (result.is_error ? "error" : "ok") << '\t' << result.steps << '\t' << result.text << '\n';
+			if (result.is_error)
+				++errors;
+			steps += result.steps;
+		}
+		os.flush();
+
+		for (auto it = workers.begin(); it != workers.end(); ++it)
+			it->join();
+
+		time_point_t end = std::chrono::steady_clock::now();
+		double time = std::chrono::duration<double>(end - begin).count();
+
+		std::cerr << "programs: " << _results.size() << std::endl;
+		std::cerr << "errors: " << errors << std::endl;
+		std::cerr << "threads: " << threads << std::endl;
+		std::cerr << "steps: " << steps << std::endl;
+		std::cerr << "time: " << time << std::endl;
+		if (time > 0) {
+			std::cerr << "programs/s: " << static_cast<size_t>(_results.size() / time) << std::endl;
+			std::cerr << "steps/s: " << static_cast<size_t>(steps / time) << std::endl;
+		}
+
+		_text = nullptr;
+		_programs.clear();
+		_results.clear();
+		_queues.clear();
+
+		return errors == 0;
+	}
+
+	void Batch::split(const char *text, size_t size) {
+		_text = text;
+		_programs.clear();
+
+		size_t pos = 0;
+		while (pos < size) {
+			size_t end = pos;
+			while (end < size && text[end] != '\n')
+				++end;
+
+			size_t begin = pos;
+			while (begin < end && (text[begin] == ' ' || text[begin] == '\t'))
+				++begin;
+			size_t last = end;
+			while (last > begin && (text[last - 1] == ' ' || text[last - 1] == '\t' || text[last - 1] == '\r'))
+				--last;
+
+			if (begin < last && text[begin] != '#')
+				_programs.push_back(std::make_pair(begin, last - begin));
+
+			pos = end + 1;
+		}
+	}
+
+	void Batch::work(size_t worker) {
+		// The machine and its heap are reused by all programs of the worker
+		Machine machine;
+		machine.set_heap_size(_cam.heap_size());
+		machine.set_flat_env(_cam.flat_env());
+		machine.set_dispatch(_cam.dispatch());
+		machine.set_unchecked(_cam.unchecked());
+		machine.set_limits(_cam.limits());
+
+		size_t program;
+		while (next(worker, program)) {
+			Result result;
+			execute(machine, program, result);
+
+			std::lock_guard<std::mutex> lock(_mutex);
+			std::swap(_results[program], result);
+			_results[program].is_done = true;
+			_done.notify_all();
+		}
+
+		machine.clear();
+	}
+
+	bool Batch::next(size_t worker, size_t &program) {
+		{
+			Queue &own = *_queues[worker];
+			std::lock_guard<std::mutex> lock(own.mutex);
+			if (!own.programs.empty()) {
+				program = own.programs.front();
+				own.programs.pop_front();
+				return true;
+			}
+		}
+
+		// No program is added after the start, so empty queues stay empty
+		for (size_t i = 1; i < _queues.size(); i++) {
+			Queue &other = *_queues[(worker + i) % _queues.size()];
+			std::lock_guard<std::mutex> lock(other.mutex);
+			if (!other.programs.empty()) {
+				program = other.programs.back();
+				other.programs.pop_back();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void Batch::execute(Machine &machine, size_t program, Result &result) {
+		machine.clear();
+
+		try {
+			machine.load(_cam.compile(std::string(_text + _programs[program].first, _programs[program].second)));
+			machine.execute();
+			result.text = machine.term_string(_cam.printer());
+		}
+		catch (CAMException &e) {
+			result.is_error = true;
+			result.text = e.what();
+		}
+		result.steps = machine.steps();
+	}
+}
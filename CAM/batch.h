@@ -0,0 +1,76 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <ostream>
+
+#include "CAM.h"
+
+namespace CAM
+{
+	// Runs many programs, one per line, on a pool of worker threads. Every
+	// worker has its own machine and takes the programs from its own queue,
+	// an idle worker steals from the other queues. Results are written in the
+	// order of the input as they are done:
+	//   index<TAB>ok<TAB>steps<TAB>term
+	//   index<TAB>error<TAB>steps<TAB>message
+	// where index counts the programs from 0. Empty lines and lines starting
+	// with '#' are skipped. The totals are printed to the error stream.
+	class Batch
+	{
+	public:
+		// 0 threads: one per hardware thread
+		Batch(CAM &cam, size_t threads = 0);
+
+		// Programs of the file, mapped into memory, or of the standard input
+		// if path is "-". Returns false if some program failed.
+		bool run(const std::string &path, std::ostream &os);
+
+		// Programs of the text
+		bool run(const char *text, size_t size, std::ostream &os);
+
+	private:
+		struct Result
+		{
+			bool is_done;
+			bool is_error;
+			size_t steps;
+			// term or message of the error
+			std::string text;
+
+			Result() : is_done(false), is_error(false), steps(0) {}
+		};
+
+		struct Queue
+		{
+			std::mutex mutex;
+			std::deque<size_t> programs;
+		};
+
+		CAM &_cam;
+		size_t _threads;
+
+		// programs as offset and length in the text
+		const char *_text;
+		std::vector<std::pair<size_t, size_t> > _programs;
+		std::vector<Result> _results;
+		std::vector<std::unique_ptr<Queue> > _queues;
+
+		std::mutex _mutex;
+		std::condition_variable _done;
+
+		void split(const char *text, size_t size);
+
+		void work(size_t worker);
+
+		// Next program of the worker: the front of its queue or the back of
+		// another one
+		bool next(size_t worker, size_t &program);
+
+		void execute(Machine &machine, size_t program, Result &result);
+	};
+}
@@ -0,0 +1,123 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+
+#include "bench.h"
+
+namespace CAM
+{
+	Bench::Bench(CAM &cam, size_t iterations, format_t format) :
+		_cam(cam), _iterations(iterations ? iterations : 1), _format(format), _heap_size(cam.heap_size()) {}
+
+	bool Bench::run(const std::string &corpus, std::ostream &os) {
+		std::ifstream is(corpus.c_str());
+		if (!is)
+			throw CAMException("Cannot read corpus: " + corpus);
+
+		std::vector<Result> results;
+		bool is_ok = true;
+
+		std::string line;
+		while (std::getline(is, line)) {
+			size_t begin = line.find_first_not_of(" \t\r");
+			if (begin == std::string::npos || line[begin] == '#')
+				continue;
+
+			size_t end = line.find_first_of(" \t", begin);
+			size_t code = line.find_first_not_of(" \t", end);
+			if (end == std::string::npos || code == std::string::npos) {
+				std::cerr << "Invalid corpus line: " << line << std::endl;
+				is_ok = false;
+				continue;
+			}
+
+			std::string name = line.substr(begin, end - begin);
+			try {
+				results.push_back(measure(name, line.substr(code, line.find_last_not_of(" \t\r") + 1 - code)));
+			}
+			catch (CAMException &e) {
+				std::cerr << name << ": " << e.what() << std::endl;
+				is_ok = false;
+			}
+		}
+
+		if (_format == format_json)
+			write_json(os, results);
+		else
+			write_csv(os, results);
+
+		return is_ok;
+	}
+
+	Bench::Result Bench::measure(const std::string &name, const std::string &code) {
+		Result r;
+		r.name = name;
+		r.iterations = _iterations;
+		r.parse = 0;
+		r.run = 0;
+		r.peak_memory = 0;
+
+		// Every program starts from the same heap, the growth is its own
+		_cam.set_heap_size(_heap_size);
+
+		for (size_t i = 0; i < _iterations; i++) {
+			time_point_t begin = std::chrono::steady_clock::now();
+			_cam.load(code);
+			time_point_t loaded = std::chrono::steady_clock::now();
+			_cam.evaluate();
+			time_point_t end = std::chrono::steady_clock::now();
+
+			r.parse += std::chrono::duration<double>(loaded - begin).count();
+			r.run += std::chrono::duration<double>(end - loaded).count();
+			if (_cam.peak_memory() > r.peak_memory)
+				r.peak_memory = _cam.peak_memory();
+		}
+
+		r.steps = _cam.steps();
+		r.parse /= _iterations;
+		r.run /= _iterations;
+		return r;
+	}
+
+	void Bench::write_csv(std::ostream &os, const std::vector<Result> &results) const {
+		os << "name,iterations,steps,parse_s,run_s,steps_per_s,ns_per_step,peak_memory" << std::endl;
+		for (auto it = results.begin(); it != results.end(); ++it) {
+			os << it->name << ',' << it->iterations << ',' << it->steps << ','
+				<< it->parse << ',' << it->run << ','
+				<< (it->run > 0 ? it->steps / it->run : 0) << ','
+				<< (it->steps ? it->run * 1e9 / it->steps : 0) << ','
+				<< it->peak_memory << std::endl;
+		}
+	}
+
+	void Bench::write_json(std::ostream &os, const std::vector<Result> &results) const {
+		os << '[' << std::endl;
+		for (auto it = results.begin(); it != results.end(); ++it) {
+			os << "\t{\"name\": \"" << escape(it->name) << "\", \"iterations\": " << it->iterations
+				<< ", \"steps\": " << it->steps
+				<< ", \"parse_s\": " << it->parse << ", \"run_s\": " << it->run
+				<< ", \"steps_per_s\": " << (it->run > 0 ? it->steps / it->run : 0)
+				<< ", \"ns_per_step\": " << (it->steps ? it->run * 1e9 / it->steps : 0)
+				<< ", \"peak_memory\": " << it->peak_memory << '}'
+				<< (it + 1 != results.end() ? "," : "") << std::endl;
+		}
+		os << ']' << std::endl;
+	}
+
+	std::string Bench::escape(const std::string &s) {
+		std::ostringstream ossteam;
+		for (auto it = s.begin(); it != s.end(); ++it) {
+			unsigned char c = static_cast<unsigned char>(*it);
+			if (c == '\\' || c == '"')
+				ossteam << '\\' << c;
+			else if (c < ' ') {
+				const char digits[] = "0123456789abcdef";
+				ossteam << "\\u00" << digits[c >> 4] << digits[c & 15];
+			}
+			else
+				ossteam << c;
+		}
+		return ossteam.str();
+	}
+}
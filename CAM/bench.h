@@ -0,0 +1,53 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <ostream>
+
+#include "CAM.h"
+
+namespace CAM
+{
+	// Runs the programs of a corpus file several times and reports the mean
+	// parse and run time of every program as CSV or JSON. A corpus line is
+	// "name code"; empty lines and lines starting with '#' are skipped.
+	class Bench
+	{
+	public:
+		enum format_t
+		{
+			format_csv,
+			format_json
+		};
+
+		struct Result
+		{
+			std::string name;
+			size_t iterations;
+			size_t steps;
+			double parse;	// seconds per iteration
+			double run;		// seconds per iteration
+			size_t peak_memory;
+		};
+
+		Bench(CAM &cam, size_t iterations = 10, format_t format = format_csv);
+
+		// Returns false if some program failed
+		bool run(const std::string &corpus, std::ostream &os);
+
+	private:
+		CAM &_cam;
+		size_t _iterations;
+		format_t _format;
+		size_t _heap_size;
+
+		Result measure(const std::string &name, const std::string &code);
+
+		void write_csv(std::ostream &os, const std::vector<Result> &results) const;
+
+		void write_json(std::ostream &os, const std::vector<Result> &results) const;
+
+		// s as the contents of a JSON string
+		static std::string escape(const std::string &s);
+	};
+}
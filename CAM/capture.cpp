@@ -0,0 +1,306 @@
+#include <map>
+#include <memory>
+#include <algorithm>
+
+#include "program.h"
+
+namespace CAM
+{
+	const int Program::Capture::Node::none;
+
+	namespace
+	{
+		typedef Program::Capture Capture;
+		typedef Program::Capture::Node Node;
+
+		// Abstract term of a body: a path into the environment of the body, a
+		// pair of shapes or anything else (a constant, a closure, a result)
+		struct Shape
+		{
+			enum kind_t
+			{
+				shape_path,
+				shape_pair,
+				shape_other
+			};
+
+			typedef std::shared_ptr<const Shape> shape_ptr;
+
+			kind_t kind;
+			int node;
+			shape_ptr first;
+			shape_ptr second;
+
+			Shape(kind_t kind, int node = Node::none, const shape_ptr &first = shape_ptr(), const shape_ptr &second = shape_ptr()) :
+				kind(kind), node(node), first(first), second(second) {}
+		};
+
+		typedef Shape::shape_ptr shape_ptr;
+
+		// Node of the env of a closure in the tree of its body: F of the env of
+		// the body, F F for 'Y'
+		int env_node(const Capture &tree, bool is_rec) {
+			int node = tree.root;
+			for (size_t depth = is_rec ? 2 : 1; depth && node != Node::none && !tree.nodes[node].is_whole; depth--)
+				node = tree.nodes[node].first;
+			return node;
+		}
+
+		// Follows the code of one body and collects the paths it reads from its
+		// environment (env, arg). A path is marked whole when its value may
+		// escape: it is returned, left on the stack, applied, computed on or
+		// captured whole by a closure.
+		class Analyzer
+		{
+			struct State
+			{
+				shape_ptr term;
+				std::vector<shape_ptr> stack;
+			};
+
+			const Program::code_t &_code;
+			// trees of the bodies analyzed before, by entry
+			const std::map<size_t, Capture> &_bodies;
+			std::vector<Node> _nodes;
+			shape_ptr _other;
+
+		public:
+			Analyzer(const Program::code_t &code, const std::map<size_t, Capture> &bodies) :
+				_code(code), _bodies(bodies), _other(std::make_shared<Shape>(Shape::shape_other)) {}
+
+			Capture run(size_t entry) {
+				_nodes.assign(1, make_node());
+
+				State state;
+				state.term = std::make_shared<Shape>(Shape::shape_path, 0);
+				block(entry, _code.size(), state);
+
+				Capture tree;
+				tree.root = copy(tree, 0);
+				return tree;
+			}
+
+		private:
+			static Node make_node() {
+				Node n = { Node::none, Node::none, false };
+				return n;
+			}
+
+			void block(size_t pc, size_t end, State &state) {
+				while (pc < end) {
+					const Program::Instruction &i = _code[pc];
+					switch (i.op) {
+					case Program::op_fst:
+					case Program::op_snd:
+						state.term = project(state.term, i.op == Program::op_snd);
+						break;
+					case Program::op_push:
+						state.stack.push_back(state.term);
+						break;
+					case Program::op_swap:
+						if (state.stack.empty()) {
+							need(state.term);
+							state.term = _other;
+						}
+						else
+							std::swap(state.term, state.stack.back());
+						break;
+					case Program::op_cons:
+						state.term = std::make_shared<Shape>(Shape::shape_pair, Node::none, pop(state), state.term);
+						break;
+					case Program::op_cur:
+					case Program::op_rec: {
+						// the closure keeps what its body reads from its own env
+						auto body = _bodies.find(i.arg);
+						if (body == _bodies.end())
+							need(state.term);
+						else
+							capture(state.term, body->second, env_node(body->second, i.op == Program::op_rec));
+						state.term = _other;
+						break;
+					}
+					case Program::op_branch: {
+						need(state.term);
+						state.term = pop(state);
+
+						size_t join = _code[i.arg - 1].arg;
+						State other = state;
+						block(pc + 1, i.arg - 1, state);
+						block(i.arg, join, other);
+						merge(state, other);
+
+						pc = join;
+						continue;
+					}
+					case Program::op_ret:
+						need(state.term);
+						for (auto it = state.stack.begin(); it != state.stack.end(); ++it)
+							need(*it);
+						return;
+					case Program::op_quote:
+						state.term = _other;
+						break;
+					default:
+						// 'e', operations: the term is used by code which is not known
+						need(state.term);
+						state.term = _other;
+						break;
+					}
+					++pc;
+				}
+			}
+
+			shape_ptr pop(State &state) {
+				if (state.stack.empty())
+					return _other;
+
+				shape_ptr s = state.stack.back();
+				state.stack.pop_back();
+				return s;
+			}
+
+			shape_ptr project(const shape_ptr &s, bool is_second) {
+				switch (s->kind) {
+				case Shape::shape_path: {
+					int &child = is_second ? _nodes[s->node].second : _nodes[s->node].first;
+					if (child == Node::none) {
+						int n = static_cast<int>(_nodes.size());
+						_nodes.push_back(make_node());
+						// push_back may move the nodes
+						(is_second ? _nodes[s->node].second : _nodes[s->node].first) = n;
+						return std::make_shared<Shape>(Shape::shape_path, n);
+					}
+					return std::make_shared<Shape>(Shape::shape_path, child);
+				}
+				case Shape::shape_pair:
+					return is_second ? s->second : s->first;
+				default:
+					return _other;
+				}
+			}
+
+			void need(const shape_ptr &s) {
+				if (s->kind == Shape::shape_path)
+					_nodes[s->node].is_whole = true;
+				else if (s->kind == Shape::shape_pair) {
+					need(s->first);
+					need(s->second);
+				}
+			}
+
+			// What the body of a closure reads from the env at node of its tree
+			void capture(const shape_ptr &s, const Capture &tree, int node) {
+				if (node == Node::none)
+					return;
+
+				const Node &n = tree.nodes[node];
+				if (n.is_whole) {
+					need(s);
+					return;
+				}
+
+				capture(project(s, false), tree, n.first);
+				capture(project(s, true), tree, n.second);
+			}
+
+			static bool is_same(const shape_ptr &a, const shape_ptr &b) {
+				if (a == b)
+					return true;
+				if (a->kind != b->kind)
+					return false;
+				if (a->kind == Shape::shape_path)
+					return a->node == b->node;
+				if (a->kind == Shape::shape_pair)
+					return is_same(a->first, b->first) && is_same(a->second, b->second);
+				return true;
+			}
+
+			// State after 'b' is one of the states of its blocks
+			void merge(State &a, const State &b) {
+				if (!is_same(a.term, b.term)) {
+					need(a.term);
+					need(b.term);
+					a.term = _other;
+				}
+
+				// blocks which leave different stacks keep everything on them
+				bool is_aligned = a.stack.size() == b.stack.size();
+				for (size_t i = 0; i < a.stack.size() || i < b.stack.size(); i++) {
+					if (is_aligned && is_same(a.stack[i], b.stack[i]))
+						continue;
+					if (i < a.stack.size())
+						need(a.stack[i]);
+					if (i < b.stack.size())
+						need(b.stack[i]);
+					if (is_aligned)
+						a.stack[i] = _other;
+				}
+				if (!is_aligned)
+					a.stack.assign(std::min(a.stack.size(), b.stack.size()), _other);
+			}
+
+			// Copies the nodes of the tree which lead to a whole node
+			int copy(Capture &tree, int node) const {
+				if (node == Node::none)
+					return Node::none;
+
+				Node n = make_node();
+				if (!_nodes[node].is_whole) {
+					n.first = copy(tree, _nodes[node].first);
+					n.second = copy(tree, _nodes[node].second);
+					if (n.first == Node::none && n.second == Node::none)
+						return Node::none;
+					++tree.pairs;
+				}
+				else
+					n.is_whole = true;
+
+				tree.nodes.push_back(n);
+				return static_cast<int>(tree.nodes.size() - 1);
+			}
+		};
+
+		// Subtree of the tree at node
+		int subtree(const Capture &tree, int node, Capture &capture) {
+			if (node == Node::none)
+				return Node::none;
+
+			Node n = tree.nodes[node];
+			if (!n.is_whole) {
+				n.first = subtree(tree, n.first, capture);
+				n.second = subtree(tree, n.second, capture);
+				++capture.pairs;
+			}
+
+			capture.nodes.push_back(n);
+			return static_cast<int>(capture.nodes.size() - 1);
+		}
+	}
+
+	// Bodies are compiled after the code which creates their closures, so the
+	// nested bodies are analyzed first going from the last entry.
+	void Program::analyze() {
+		std::vector<size_t> entries;
+		for (auto it = _code.begin(); it != _code.end(); ++it) {
+			if (it->op == op_cur || it->op == op_rec)
+				entries.push_back(it->arg);
+		}
+		std::sort(entries.begin(), entries.end());
+
+		std::map<size_t, Capture> bodies;
+		Analyzer analyzer(_code, bodies);
+		for (auto it = entries.rbegin(); it != entries.rend(); ++it)
+			bodies[*it] = analyzer.run(*it);
+
+		for (auto it = _code.begin(); it != _code.end(); ++it) {
+			if (it->op != op_cur && it->op != op_rec)
+				continue;
+
+			const Capture &tree = bodies[it->arg];
+			Capture capture;
+			capture.root = subtree(tree, env_node(tree, it->op == op_rec), capture);
+			it->arg2 = _captures.size();
+			_captures.push_back(capture);
+		}
+	}
+}
@@ -0,0 +1,440 @@
+#include <vector>
+#include <utility>
+
+#include "program.h"
+
+namespace CAM
+{
+	namespace
+	{
+		typedef Program::Instruction Instruction;
+		typedef Program::Capture Capture;
+		typedef Program::Capture::Node Node;
+
+		// Simple types of the terms with unification. A type is a variable
+		// until it is bound, pairs and closures refer to their parts by index.
+		// Types may be cyclic, e.g. of a function which returns a pair of a
+		// number and of itself, so unification binds a type before it looks
+		// at its parts and needs no occurs check.
+		class Types
+		{
+		public:
+			enum kind_t
+			{
+				type_var,
+				type_unit,
+				type_number,
+				type_pair,		// (first, second)
+				type_closure	// argument first, result second
+			};
+
+		private:
+			struct Type
+			{
+				kind_t kind;
+				size_t parent;
+				size_t first;
+				size_t second;
+			};
+
+			std::vector<Type> _types;
+
+		public:
+			size_t make(kind_t kind, size_t first = 0, size_t second = 0) {
+				Type t = { kind, _types.size(), first, second };
+				_types.push_back(t);
+				return t.parent;
+			}
+
+			size_t var() { return make(type_var); }
+
+			size_t find(size_t t) {
+				while (_types[t].parent != t) {
+					_types[t].parent = _types[_types[t].parent].parent;
+					t = _types[t].parent;
+				}
+				return t;
+			}
+
+			kind_t kind(size_t t) { return _types[find(t)].kind; }
+			size_t first(size_t t) { return _types[find(t)].first; }
+			size_t second(size_t t) { return _types[find(t)].second; }
+
+			// Makes a the same type as b. Returns false and the kinds which do
+			// not match if there is no such type.
+			bool unify(size_t a, size_t b, kind_t &found, kind_t &expected) {
+				std::vector<std::pair<size_t, size_t> > todo(1, std::make_pair(a, b));
+				while (!todo.empty()) {
+					size_t x = find(todo.back().first);
+					size_t y = find(todo.back().second);
+					todo.pop_back();
+					if (x == y)
+						continue;
+
+					if (_types[x].kind == type_var || _types[y].kind == type_var) {
+						if (_types[x].kind == type_var)
+							_types[x].parent = y;
+						else
+							_types[y].parent = x;
+						continue;
+					}
+
+					if (_types[x].kind != _types[y].kind) {
+						found = _types[x].kind;
+						expected = _types[y].kind;
+						return false;
+					}
+
+					_types[x].parent = y;
+					if (_types[y].kind == type_pair || _types[y].kind == type_closure) {
+						todo.push_back(std::make_pair(_types[x].first, _types[y].first));
+						todo.push_back(std::make_pair(_types[x].second, _types[y].second));
+					}
+				}
+				return true;
+			}
+
+			static const char* name(kind_t kind) {
+				switch (kind) {
+				case type_unit:
+					return "()";
+				case type_number:
+					return "numeric constant";
+				case type_pair:
+					return "(s, t)";
+				case type_closure:
+					return "closure";
+				default:
+					return "term";
+				}
+			}
+		};
+
+		// Follows the blocks of the program from the main code into the bodies
+		// of the closures where they are made: '\' and 'Y' check their bodies
+		// on the environment they capture, the call of a direct application
+		// on the environment saved on the stack. A body starts with an empty
+		// stack of its own and must leave it empty, the arms of 'b' must leave
+		// stacks of the same depth and types.
+		class Checker
+		{
+			struct State
+			{
+				size_t term;
+				std::vector<size_t> stack;
+			};
+
+			const Program &_program;
+			Types _types;
+			// bodies being checked, a body which makes its own closure is not
+			// code the compiler writes
+			std::vector<bool> _bodies;
+			// instructions left to check, a program of the compiler checks every
+			// instruction once
+			size_t _budget;
+			size_t _pc;
+			std::string _error;
+
+		public:
+			Checker(const Program &program) :
+				_program(program), _bodies(program.size(), false), _budget(2 * program.size()), _pc(0) {}
+
+			// Returns the error, empty if the program is typed
+			std::string run() {
+				State state;
+				state.term = _types.make(Types::type_unit);
+				size_t pc = 0;
+				if (block(pc, _program.size(), state) && _program.at(pc).op != Program::op_ret)
+					fail(pc, "the code does not end with a return");
+				return _error;
+			}
+
+		private:
+			// Checks the code from pc up to end or up to the first jump or
+			// return, pc is left at where it stops
+			bool block(size_t &pc, size_t end, State &state) {
+				for (; pc < end; pc++) {
+					_pc = pc;
+					if (_budget-- == 0)
+						return fail(pc, "the blocks of the code are not nested");
+
+					const Instruction &i = _program.at(pc);
+					switch (i.op) {
+					case Program::op_fst:
+					case Program::op_snd:
+						if (!project(state.term, i.op == Program::op_snd, state.term))
+							return false;
+						break;
+					case Program::op_push:
+					case Program::op_fork:
+						state.stack.push_back(state.term);
+						break;
+					case Program::op_swap:
+					case Program::op_join:
+						if (state.stack.empty())
+							return fail(pc, "empty stack");
+						std::swap(state.term, state.stack.back());
+						break;
+					case Program::op_cons:
+						if (state.stack.empty())
+							return fail(pc, "empty stack");
+						state.term = _types.make(Types::type_pair, state.stack.back(), state.term);
+						state.stack.pop_back();
+						break;
+					case Program::op_app: {
+						size_t argument = _types.var();
+						size_t result = _types.var();
+						size_t closure = _types.make(Types::type_closure, argument, result);
+						if (!returns(pc) || !unify(state.term, _types.make(Types::type_pair, closure, argument)))
+							return false;
+						state.term = result;
+						break;
+					}
+					case Program::op_cur: {
+						size_t env;
+						size_t argument = _types.var();
+						size_t result;
+						if (!capture(state.term, i.arg2, env) || !body(i.arg, _types.make(Types::type_pair, env, argument), result))
+							return false;
+						state.term = _types.make(Types::type_closure, argument, result);
+						break;
+					}
+					case Program::op_rec: {
+						// the environment of the body is ((env, closure), argument)
+						size_t env;
+						size_t argument = _types.var();
+						size_t result = _types.var();
+						size_t closure = _types.make(Types::type_closure, argument, result);
+						size_t returned;
+						if (!capture(state.term, i.arg2, env) ||
+							!body(i.arg, _types.make(Types::type_pair, _types.make(Types::type_pair, env, closure), argument), returned) ||
+							!unify(returned, result))
+							return false;
+						state.term = closure;
+						break;
+					}
+					case Program::op_quote:
+						state.term = _types.make(Types::type_number);
+						break;
+					case Program::op_branch: {
+						if (!unify(state.term, _types.make(Types::type_number)))
+							return false;
+						if (state.stack.empty())
+							return fail(pc, "empty stack");
+						state.term = state.stack.back();
+						state.stack.pop_back();
+
+						// then: pc + 1 to the jump before else, else: up to the
+						// target of the jump
+						if (i.arg < pc + 2 || _program.at(i.arg - 1).op != Program::op_jump)
+							return fail(pc, "the blocks of the code are not nested");
+						size_t jump = i.arg - 1;
+						size_t join = _program.at(jump).arg;
+
+						State other = state;
+						size_t then_end = pc + 1;
+						size_t else_end = i.arg;
+						if (!block(then_end, jump, state))
+							return false;
+						if (then_end != jump || join < i.arg)
+							return fail(pc, "the blocks of the code are not nested");
+						if (!block(else_end, join, other))
+							return false;
+						if (else_end != join)
+							return fail(pc, "the blocks of the code are not nested");
+
+						_pc = pc;
+						if (state.stack.size() != other.stack.size())
+							return fail(pc, "the arms leave stacks of different depths");
+						if (!unify(other.term, state.term))
+							return false;
+						for (size_t n = 0; n < state.stack.size(); n++) {
+							if (!unify(other.stack[n], state.stack[n]))
+								return false;
+						}
+
+						pc = join - 1;
+						break;
+					}
+					case Program::op_add:
+					case Program::op_sub:
+					case Program::op_mul:
+					case Program::op_eq: {
+						size_t first, second;
+						if (!project(state.term, false, first) || !project(state.term, true, second) || !operation(first, second, state.term))
+							return false;
+						break;
+					}
+					case Program::op_path:
+						if (!walk(state.term, i.arg, state.term))
+							return false;
+						break;
+					case Program::op_acc:
+						if (i.arg >= Program::max_path)
+							return fail(pc, "the variable is out of range");
+						if (!walk(state.term, Program::variable_path(i.arg), state.term))
+							return false;
+						break;
+					case Program::op_pair:
+					case Program::op_add_pair:
+					case Program::op_sub_pair:
+					case Program::op_mul_pair:
+					case Program::op_eq_pair: {
+						size_t first, second;
+						if (!walk(state.term, i.arg, first) || !walk(state.term, i.arg2, second))
+							return false;
+						if (i.op == Program::op_pair)
+							state.term = _types.make(Types::type_pair, first, second);
+						else if (!operation(first, second, state.term))
+							return false;
+						break;
+					}
+					case Program::op_pair_quote:
+					case Program::op_add_quote:
+					case Program::op_sub_quote:
+					case Program::op_mul_quote:
+					case Program::op_eq_quote: {
+						size_t first;
+						if (!walk(state.term, i.arg, first))
+							return false;
+						if (i.op == Program::op_pair_quote)
+							state.term = _types.make(Types::type_pair, first, _types.make(Types::type_number));
+						else if (!operation(first, _types.make(Types::type_number), state.term))
+							return false;
+						break;
+					}
+					case Program::op_save:
+						state.stack.push_back(state.term);
+						break;
+					case Program::op_call: {
+						if (state.stack.empty())
+							return fail(pc, "empty stack");
+						size_t env = state.stack.back();
+						state.stack.pop_back();
+						if (!returns(pc) || !body(i.arg2, _types.make(Types::type_pair, env, state.term), state.term))
+							return false;
+						break;
+					}
+					default:
+						// jump, return and the memo block end the block
+						return true;
+					}
+				}
+				return true;
+			}
+
+			// Result of the body at entry on the environment
+			bool body(size_t entry, size_t env, size_t &result) {
+				if (_bodies[entry])
+					return fail(_pc, "a body makes its own closure");
+
+				size_t pc = _pc;
+				_bodies[entry] = true;
+				State state;
+				state.term = env;
+				size_t end = entry;
+				if (!block(end, _program.size(), state))
+					return false;
+				_bodies[entry] = false;
+
+				if (_program.at(end).op != Program::op_ret)
+					return fail(end, "the body does not end with a return");
+				if (!state.stack.empty())
+					return fail(end, "the body leaves values on the stack");
+
+				_pc = pc;
+				result = state.term;
+				return true;
+			}
+
+			// An application returns to the code after it, past the jumps
+			bool returns(size_t pc) {
+				size_t next = pc + 1;
+				for (size_t n = 0; n < _program.size() && _program.at(next).op == Program::op_jump; n++)
+					next = _program.at(next).arg;
+				if (_program.at(pc).arg != next)
+					return fail(pc, "the application does not return to the next instruction");
+				return true;
+			}
+
+			bool project(size_t term, bool is_second, size_t &part) {
+				if (_types.kind(term) != Types::type_pair && !unify(term, _types.make(Types::type_pair, _types.var(), _types.var())))
+					return false;
+				part = is_second ? _types.second(term) : _types.first(term);
+				return true;
+			}
+
+			bool walk(size_t term, size_t path, size_t &part) {
+				for (; path != Program::empty_path; path >>= 1) {
+					if (!project(term, (path & 1) != 0, term))
+						return false;
+				}
+				part = term;
+				return true;
+			}
+
+			bool operation(size_t first, size_t second, size_t &result) {
+				size_t number = _types.make(Types::type_number);
+				if (!unify(first, number) || !unify(second, number))
+					return false;
+				result = number;
+				return true;
+			}
+
+			// Type of the environment a closure keeps of the term, see
+			// Machine::capture
+			bool capture(size_t term, size_t index, size_t &env) {
+				if (index == Program::no_capture) {
+					env = term;
+					return true;
+				}
+
+				const Capture &c = _program.capture(index);
+				return trim(term, c, c.root, c.nodes.size(), env);
+			}
+
+			bool trim(size_t term, const Capture &c, int node, size_t depth, size_t &env) {
+				if (node == Node::none) {
+					env = _types.make(Types::type_unit);
+					return true;
+				}
+				if (depth == 0)
+					return fail(_pc, "the capture is not a tree");
+
+				const Node &n = c.nodes[node];
+				Types::kind_t kind = _types.kind(term);
+				// a term which is not a pair is kept whole; a variable could be
+				// either, it is taken for a pair
+				if (n.is_whole || (kind != Types::type_var && kind != Types::type_pair)) {
+					env = term;
+					return true;
+				}
+
+				size_t first, second;
+				if (!project(term, false, first) || !trim(first, c, n.first, depth - 1, first) ||
+					!project(term, true, second) || !trim(second, c, n.second, depth - 1, second))
+					return false;
+				env = _types.make(Types::type_pair, first, second);
+				return true;
+			}
+
+			bool unify(size_t found, size_t expected) {
+				Types::kind_t a, b;
+				if (_types.unify(found, expected, a, b))
+					return true;
+				return fail(_pc, std::string(Types::name(a)) + " where " + Types::name(b) + " is expected");
+			}
+
+			bool fail(size_t pc, const std::string &error) {
+				if (_error.empty())
+					_error = std::string(Program::op_name(_program.at(pc).op)) + " at " + std::to_string(pc) + ": " + error;
+				return false;
+			}
+		};
+	}
+
+	void Program::check() {
+		_type_error = Checker(*this).run();
+		_is_typed = _type_error.empty();
+	}
+}
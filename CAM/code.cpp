@@ -2,27 +2,34 @@
 
 namespace CAM
 {
-	std::string CodeTerm::to_string(const code_t &t) {
+	std::string CodeTerm::to_string() const {
 		std::ostringstream ossteam;
-		std::for_each(t.begin(), t.end(), [&ossteam](const CodeTerm::term_ptr &c) {
-			ossteam << *c;
-		});
+		write(ossteam);
 		return ossteam.str();
 	}
 
-	std::string CodeTermWithArgs::to_string() const {
+	void CodeTerm::write(std::ostream &os, const code_t &t) {
+		std::for_each(t.begin(), t.end(), [&os](const CodeTerm::term_ptr &c) {
+			c->write(os);
+		});
+	}
+
+	std::string CodeTerm::to_string(const code_t &t) {
 		std::ostringstream ossteam;
-		ossteam << _op;
+		write(ossteam, t);
+		return ossteam.str();
+	}
+
+	void CodeTermWithArgs::write(std::ostream &os) const {
+		os << _op;
 		if (_args.size() != 0) {
-			ossteam << '(';
+			os << '(';
 			for (size_t i = 0; i < _args.size(); i++) {
-				ossteam << CodeTerm::to_string(_args[i]);
+				CodeTerm::write(os, _args[i]);
 				if (i != _args.size() - 1)
-					ossteam << ", ";
+					os << ", ";
 			}
-			ossteam << ')';
+			os << ')';
 		}
-
-		return ossteam.str();
 	}
 }
\ No newline at end of file
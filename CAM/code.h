@@ -20,7 +20,8 @@ namespace CAM
 
 		char op() const { return _op; }
 
-		virtual std::string to_string() const { return std::string(1, _op); };
+		virtual void write(std::ostream &os) const { os << _op; }
+		std::string to_string() const;
 		virtual size_t args_count() const { return 0; }
 		virtual ~CodeTerm() {}
 
@@ -28,14 +29,17 @@ namespace CAM
 			return std::make_shared<CodeTerm>(op);
 		}
 
+		static void write(std::ostream &os, const code_t &t);
 		static std::string to_string(const code_t &t);
 
 		friend std::ostream& operator<<(std::ostream& os, const CodeTerm& t) {
-			return os << t.to_string();
+			t.write(os);
+			return os;
 		}
 
 		friend std::ostream& operator<<(std::ostream& os, const code_t& c) {
-			return os << CodeTerm::to_string(c);
+			CodeTerm::write(os, c);
+			return os;
 		}
 	};
 
@@ -54,7 +58,7 @@ namespace CAM
 
 		virtual size_t args_count() const { return _args.size(); }
 
-		virtual std::string to_string() const;
+		virtual void write(std::ostream &os) const;
 
 		static CodeTerm::term_ptr make(char op, args_t &args) {
 			return std::dynamic_pointer_cast<CodeTerm>(std::make_shared<CodeTermWithArgs>(op, args));
@@ -73,7 +77,7 @@ namespace CAM
 
 		virtual size_t args_count() const { return 1; }
 
-		virtual std::string to_string() const { return _op + _arg; }
+		virtual void write(std::ostream &os) const { os << _op << _arg; }
 
 		static CodeTerm::term_ptr make(const std::string &s) {
 			return std::dynamic_pointer_cast<CodeTerm>(std::make_shared<QuoteCodeTerm>(s));
@@ -0,0 +1,361 @@
+#include <cassert>
+#include <cstring>
+#include <chrono>
+
+#include "heap.h"
+
+namespace CAM
+{
+	Heap::Heap(size_t size) : _space(nullptr), _top(nullptr), _limit(nullptr), _spare(nullptr), _size(0), _max_footprint(0), _bignums(0), _is_flat_env(true), _observer(nullptr) {
+		set_size(size);
+	}
+
+	Heap::~Heap() {
+		clear();
+		delete[] _space;
+		delete[] _spare;
+	}
+
+	Value Heap::make_pair(const Value &first, const Value &second) {
+		PairCell *c = static_cast<PairCell*>(allocate(pair_size, Value::kind_pair));
+		c->first = first;
+		c->second = second;
+		return Value(Value::kind_pair, c);
+	}
+
+	Value Heap::make_number(const mpz_class &number) {
+		int64_t fixnum;
+		if (Number::to_int64(number, fixnum))
+			return Value::make_fixnum(fixnum);
+
+		NumberCell *c = static_cast<NumberCell*>(allocate(number_size, Value::kind_bignum));
+		mpz_init_set(c->number, number.get_mpz_t());
+		++_bignums;
+		return Value(Value::kind_bignum, c);
+	}
+
+	Value Heap::make_closure(size_t entry, const Value &env) {
+		size_t length = flat_length(env);
+		Value e = env;
+		if (length) {
+			EnvCell *f = static_cast<EnvCell*>(allocate(sizeof(EnvCell) + length * sizeof(Value), Value::kind_env));
+			f->length = static_cast<uint32_t>(length);
+			copy_env(f->values(), length, env);
+			e = Value(Value::kind_env, f);
+		}
+
+		ClosureCell *c = static_cast<ClosureCell*>(allocate(closure_size, Value::kind_closure));
+		c->entry = entry;
+		c->env = e;
+		return Value(Value::kind_closure, c);
+	}
+
+	Value Heap::make_rec(size_t entry, const Value &env) {
+		ClosureCell *c = static_cast<ClosureCell*>(allocate(closure_size, Value::kind_rec));
+		Value rec(Value::kind_rec, c);
+		c->entry = entry;
+		c->env = make_env(env, rec);
+		return rec;
+	}
+
+	size_t Heap::closure_env_size(const Value &env, bool is_rec) const {
+		if (is_rec)
+			return env_size(env);
+		size_t length = flat_length(env);
+		return length ? sizeof(EnvCell) + length * sizeof(Value) : 0;
+	}
+
+	Value Heap::make_env(const Value &env, const Value &arg) {
+		if (!_is_flat_env)
+			return make_pair(env, arg);
+
+		size_t length = env_length(env);
+		EnvCell *c = static_cast<EnvCell*>(allocate(sizeof(EnvCell) + length * sizeof(Value), Value::kind_env));
+		c->length = static_cast<uint32_t>(length);
+		c->values()[0] = arg;
+		copy_env(c->values() + 1, length - 1, env);
+		return Value(Value::kind_env, c);
+	}
+
+	size_t Heap::env_size(const Value &env) const {
+		if (!_is_flat_env)
+			return pair_size;
+		return sizeof(EnvCell) + env_length(env) * sizeof(Value);
+	}
+
+	Value Heap::make_apply(const Value &env, const Value &arg) {
+		if (!_is_flat_env)
+			return make_pair(env, arg);
+
+		EnvCell *c = static_cast<EnvCell*>(allocate(sizeof(EnvCell) + 2 * sizeof(Value), Value::kind_env));
+		c->length = 2;
+		c->values()[0] = arg;
+		c->values()[1] = env;
+		return Value(Value::kind_env, c);
+	}
+
+	size_t Heap::env_length(const Value &env) {
+		size_t length = 2;
+		// pairs built by the code, as the cycle of 'Y', are not copied
+		for (Value e = env; e.kind() == Value::kind_env && length < max_env; e = e.first())
+			++length;
+		return length;
+	}
+
+	size_t Heap::flat_length(const Value &env) const {
+		if (!_is_flat_env || env.kind() != Value::kind_env)
+			return 0;
+
+		// kept if it spans at most two cells, as the environment of a body
+		// which is the argument in front of the environment of its closure
+		Value next = static_cast<EnvCell*>(env._cell)->values()[env._cell->length - 1];
+		if (next.kind() == Value::kind_env)
+			next = static_cast<EnvCell*>(next._cell)->values()[next._cell->length - 1];
+		if (next.kind() != Value::kind_env)
+			return 0;
+		return env_length(env) - 1;
+	}
+
+	void Heap::copy_env(Value *values, size_t length, Value e) {
+		for (size_t i = 0; i + 1 < length; i++) {
+			values[i] = e.second();
+			e = e.first();
+		}
+		values[length - 1] = e;
+	}
+
+	// The cells are found first to reserve the room for all of them, then
+	// copied and their values redirected to the copies
+	Value Heap::import(const Value &v) {
+		if (!v.is_boxed())
+			return v;
+
+		std::unordered_map<const Cell*, Cell*> copies;
+		std::vector<Cell*> cells(1, v._cell);
+		copies[v._cell] = nullptr;
+
+		size_t size = 0;
+		for (size_t i = 0; i < cells.size(); i++) {
+			size += size_of(cells[i]);
+
+			size_t count;
+			Value *values = values_of(cells[i], count);
+			for (size_t j = 0; j < count; j++) {
+				if (values[j].is_boxed() && copies.insert(std::make_pair(values[j]._cell, nullptr)).second)
+					cells.push_back(values[j]._cell);
+			}
+		}
+
+		reserve(size);
+
+		for (auto it = cells.begin(); it != cells.end(); ++it) {
+			size_t s = size_of(*it);
+			Cell *c = allocate(s, (*it)->kind);
+			std::memcpy(c, *it, s);
+			if (c->kind == Value::kind_bignum) {
+				mpz_init_set(static_cast<NumberCell*>(c)->number, static_cast<NumberCell*>(*it)->number);
+				++_bignums;
+			}
+			copies[*it] = c;
+		}
+
+		for (auto it = cells.begin(); it != cells.end(); ++it) {
+			size_t count;
+			Value *values = values_of(copies[*it], count);
+			for (size_t j = 0; j < count; j++) {
+				if (values[j].is_boxed())
+					values[j]._cell = copies[values[j]._cell];
+			}
+		}
+
+		Value copy = v;
+		copy._cell = copies[v._cell];
+		return copy;
+	}
+
+	void Heap::clear() {
+		if (_bignums)
+			free_bignums(_space, _top);
+
+		_top = _space;
+		_bignums = 0;
+		_stats = Stats();
+	}
+
+	void Heap::set_size(size_t size) {
+		clear();
+		delete[] _space;
+		delete[] _spare;
+
+		_size = size;
+		_space = new char[_size];
+		_spare = nullptr;
+		_top = _space;
+		_limit = _space + _size;
+	}
+
+	Cell* Heap::allocate(size_t size, Value::kind_t kind) {
+		assert(static_cast<size_t>(_limit - _top) >= size && "allocation without reserve");
+
+		Cell *c = reinterpret_cast<Cell*>(_top);
+		_top += size;
+		++_stats.cells[kind];
+		_stats.bytes[kind] += size;
+		c->kind = kind;
+		c->is_forwarded = false;
+		return c;
+	}
+
+	void Heap::collect(size_t need) {
+		auto begin = std::chrono::steady_clock::now();
+
+		evacuate(_size);
+
+		// Keep at least half of the space free, otherwise the collections
+		// become too frequent
+		size_t size = _size;
+		while (used() + need > size / 2)
+			size *= 2;
+		// past the limit the space stays as it is while the cells fit
+		bool is_full = false;
+		if (size != _size) {
+			if (!_max_footprint || 2 * size <= _max_footprint)
+				evacuate(size);
+			else
+				is_full = used() + need > _size;
+		}
+
+		auto end = std::chrono::steady_clock::now();
+
+		++_stats.collections;
+		_stats.bytes_copied += used();
+		_stats.pause += std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count() / 1000000.0;
+
+		if (is_full)
+			throw LimitReached();
+	}
+
+	void Heap::evacuate(size_t size) {
+		char *space = (size == _size && _spare) ? _spare : new char[size];
+		char *top = space;
+		size_t bignums = 0;
+
+		for (auto it = _roots.begin(); it != _roots.end(); ++it)
+			forward(**it, top, bignums);
+
+		for (auto it = _root_vectors.begin(); it != _root_vectors.end(); ++it) {
+			for (auto v = (*it)->begin(); v != (*it)->end(); ++v)
+				forward(*v, top, bignums);
+		}
+
+		for (char *scan = space; scan < top; ) {
+			Cell *c = reinterpret_cast<Cell*>(scan);
+			switch (c->kind) {
+			case Value::kind_pair:
+				forward(static_cast<PairCell*>(c)->first, top, bignums);
+				forward(static_cast<PairCell*>(c)->second, top, bignums);
+				break;
+			case Value::kind_closure:
+			case Value::kind_rec:
+				forward(static_cast<ClosureCell*>(c)->env, top, bignums);
+				break;
+			case Value::kind_env: {
+				Value *values = static_cast<EnvCell*>(c)->values();
+				for (uint32_t i = 0; i < c->length; i++)
+					forward(values[i], top, bignums);
+				break;
+			}
+			default:
+				break;
+			}
+			scan += size_of(c);
+		}
+
+		if (_observer)
+			_observer->evacuated();
+
+		if (_bignums)
+			free_bignums(_space, _top);
+
+		if (size == _size)
+			_spare = _space;
+		else {
+			delete[] _space;
+			delete[] _spare;
+			_spare = nullptr;
+		}
+
+		_space = space;
+		_top = top;
+		_limit = space + size;
+		_size = size;
+		_bignums = bignums;
+	}
+
+	void Heap::forward(Value &v, char *&top, size_t &bignums) {
+		if (!v.is_boxed())
+			return;
+
+		Cell *c = v._cell;
+		Cell *copy;
+		if (c->is_forwarded)
+			std::memcpy(&copy, c + 1, sizeof(copy));
+		else {
+			size_t size = size_of(c);
+			copy = reinterpret_cast<Cell*>(top);
+			std::memcpy(copy, c, size);
+			top += size;
+
+			if (c->kind == Value::kind_bignum)
+				++bignums;
+
+			if (_observer)
+				_observer->moved(c, copy);
+
+			c->is_forwarded = true;
+			std::memcpy(c + 1, &copy, sizeof(copy));
+		}
+
+		v._cell = copy;
+	}
+
+	void Heap::free_bignums(char *begin, char *end) {
+		for (char *scan = begin; scan < end; ) {
+			Cell *c = reinterpret_cast<Cell*>(scan);
+			if (c->kind == Value::kind_bignum && !c->is_forwarded)
+				mpz_clear(static_cast<NumberCell*>(c)->number);
+			scan += size_of(c);
+		}
+	}
+
+	Value* Heap::values_of(Cell *c, size_t &count) {
+		switch (c->kind) {
+		case Value::kind_pair:
+			count = 2;
+			return &static_cast<PairCell*>(c)->first;
+		case Value::kind_closure:
+		case Value::kind_rec:
+			count = 1;
+			return &static_cast<ClosureCell*>(c)->env;
+		case Value::kind_env:
+			count = c->length;
+			return static_cast<EnvCell*>(c)->values();
+		default:
+			count = 0;
+			return nullptr;
+		}
+	}
+
+	size_t Heap::size_of(const Cell *c) {
+		switch (c->kind) {
+		case Value::kind_pair:
+			return pair_size;
+		case Value::kind_bignum:
+			return number_size;
+		case Value::kind_env:
+			return sizeof(EnvCell) + c->length * sizeof(Value);
+		default:
+			return closure_size;
+		}
+	}
+}
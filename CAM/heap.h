@@ -0,0 +1,186 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+
+#include "value.h"
+
+namespace CAM
+{
+	// Heap of the cells of one machine. Allocation bumps a pointer in the
+	// current semispace. When it is full, the cells reachable from the roots
+	// are copied to the other semispace (Cheney's algorithm) and the old one
+	// is reused as a whole, so no cell is freed individually.
+	class Heap
+	{
+	public:
+		static const size_t default_size = 4 << 20;
+
+		static const size_t pair_size = sizeof(PairCell);
+		static const size_t number_size = sizeof(NumberCell);
+		static const size_t closure_size = sizeof(ClosureCell);
+		static const size_t rec_size = closure_size + pair_size;
+		// values of a flat environment, longer chains continue in the last one
+		static const size_t max_env = 16;
+
+		struct Stats
+		{
+			size_t collections;
+			size_t bytes_copied;
+			double pause;	// seconds
+			// cells and their bytes allocated by kind
+			size_t cells[Value::kind_env + 1];
+			size_t bytes[Value::kind_env + 1];
+
+			Stats() : collections(0), bytes_copied(0), pause(0) {
+				std::fill(cells, cells + Value::kind_env + 1, 0);
+				std::fill(bytes, bytes + Value::kind_env + 1, 0);
+			}
+
+			size_t bytes_allocated() const {
+				size_t total = 0;
+				for (size_t kind = 0; kind <= Value::kind_env; kind++)
+					total += bytes[kind];
+				return total;
+			}
+		};
+
+		// Thrown by an allocation which would grow the heap past its limit
+		struct LimitReached {};
+
+		// Told of the cells the collector moves. The cells an evacuation does
+		// not move are dead.
+		class Observer
+		{
+		public:
+			virtual void moved(const Cell *from, const Cell *to) = 0;
+			// End of one evacuation of the live cells
+			virtual void evacuated() = 0;
+
+			virtual ~Observer() {}
+		};
+
+		Heap(size_t size = default_size);
+		~Heap();
+
+		void add_root(Value *v) { _roots.push_back(v); }
+		void add_roots(std::vector<Value> *v) { _root_vectors.push_back(v); }
+
+		// Makes room for the next allocations of bytes in total, so they do not
+		// collect. The cells may move: values which are not roots are invalid
+		// after the call.
+		void reserve(size_t bytes) {
+			if (static_cast<size_t>(_limit - _top) < bytes)
+				collect(bytes);
+		}
+
+		Value make_pair(const Value &first, const Value &second);
+		// Numbers which fit into int64_t become fixnums
+		Value make_number(const mpz_class &number);
+		// An environment spanning more than two cells is flattened here once,
+		// applications of the closure only put the argument in front of it
+		Value make_closure(size_t entry, const Value &env);
+		// The environment of the body, (env, closure), is built once here and
+		// points back to the closure
+		Value make_rec(size_t entry, const Value &env);
+		// Room for the environment of a closure over env besides the cell
+		size_t closure_env_size(const Value &env, bool is_rec) const;
+
+		// Environment of a body applied to arg, (env, arg). It is flat unless
+		// flat environments are off, env_size is the room it needs.
+		Value make_env(const Value &env, const Value &arg);
+		size_t env_size(const Value &env) const;
+		// Environment of a closure applied to arg, env is kept as the closure
+		// holds it; apply_size is the room it needs, a pair or two values
+		Value make_apply(const Value &env, const Value &arg);
+		static const size_t apply_size = pair_size;
+
+		// Copy of a value of another heap and of the cells reachable from it,
+		// sharing and cycles are kept. The cells of this heap may move.
+		Value import(const Value &v);
+
+		void set_flat_env(bool is_flat_env) { _is_flat_env = is_flat_env; }
+		bool flat_env() const { return _is_flat_env; }
+
+		// nullptr: the moves are not observed
+		void set_observer(Observer *observer) { _observer = observer; }
+
+		// Collects and appends the cells and the roots to out, the cells are
+		// written in the order of the space, see snapshot.cpp
+		void save(std::string &out);
+
+		// Replaces the cells and the roots by those of the bytes written by
+		// save. Returns false if they are not valid, the closures must enter
+		// below entries; the heap is empty then.
+		bool restore(const char *data, size_t size, size_t entries);
+
+		// Drops all cells at once
+		void clear();
+
+		// Size of one semispace, drops all cells
+		void set_size(size_t size);
+		size_t size() const { return _size; }
+		// Most bytes of both semispaces the heap grows to, 0: no limit
+		void set_limit(size_t bytes) { _max_footprint = bytes; }
+		size_t limit() const { return _max_footprint; }
+		size_t used() const { return _top - _space; }
+		// Bytes of both semispaces
+		size_t footprint() const { return _spare ? 2 * _size : _size; }
+
+		const Stats& stats() const { return _stats; }
+
+	private:
+		char *_space;
+		char *_top;
+		char *_limit;
+		// other semispace of the same size, if allocated
+		char *_spare;
+		size_t _size;
+		size_t _max_footprint;
+		// bignums in the current space hold memory of GMP
+		size_t _bignums;
+		bool _is_flat_env;
+		Observer *_observer;
+
+		std::vector<Value*> _roots;
+		std::vector<std::vector<Value>*> _root_vectors;
+
+		Stats _stats;
+
+		Heap(const Heap&);
+		Heap& operator=(const Heap&);
+
+		Cell* allocate(size_t size, Value::kind_t kind);
+
+		void collect(size_t need);
+
+		// Copies the live cells into a new space of the given size
+		void evacuate(size_t size);
+
+		void forward(Value &v, char *&top, size_t &bignums);
+
+		void free_bignums(char *begin, char *end);
+
+		// Values in a flat environment of arg and env
+		static size_t env_length(const Value &env);
+		// Values in a flat copy of env, 0 if env is kept as it is
+		size_t flat_length(const Value &env) const;
+		// Components of the environment e, the rest in the last value
+		static void copy_env(Value *values, size_t length, Value e);
+
+		static size_t size_of(const Cell *c);
+
+		// Values stored in the cell
+		static Value* values_of(Cell *c, size_t &count);
+
+		// Value of a snapshot, the cell by its offset in the space
+		void save(const Value &v, std::string &out) const;
+		Value restore(const char *data) const;
+
+		// The value of a restored space refers to a cell of its kind, starts
+		// has the offsets of the cells in units of 8 bytes
+		bool is_valid(const Value &v, const std::vector<bool> &starts) const;
+	};
+}
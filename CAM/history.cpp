@@ -18,11 +18,16 @@ namespace CAM {
 	}
 
 	void History::add(const std::string &t, const std::string &c, const std::string &s) {
+		add(_term.size(), t, c, s);
+	}
+
+	void History::add(size_t idx, const std::string &t, const std::string &c, const std::string &s) {
+		_idx.push_back(idx);
 		_term.push_back(t);
 		_code.push_back(c);
 		_stack.push_back(s);
 
-		size_t idx_w = log10(_term.size()) + 1;
+		size_t idx_w = log10(idx + 1) + 1;
 		if (idx_w > _idx_w)
 			_idx_w = idx_w;
 		if (t.length() > _term_w)
@@ -47,7 +52,7 @@ namespace CAM {
 		print_line(line_w);
 
 		for (size_t i = 0; i < max_idx; i++) {
-			print_entry(i, _term[i], _code[i], _stack[i]);
+			print_entry(_idx[i], _term[i], _code[i], _stack[i]);
 			print_line(line_w);
 		}
 	}
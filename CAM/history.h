@@ -5,6 +5,7 @@
 namespace CAM {
 	class History
 	{
+		std::vector<size_t> _idx;
 		std::vector<std::string> _term;
 		std::vector<std::string> _code;
 		std::vector<std::string> _stack;
@@ -20,6 +21,9 @@ namespace CAM {
 
 		void add(const std::string &t, const std::string &c, const std::string &s);
 
+		// Entry of the given step, used when the steps are sampled
+		void add(size_t idx, const std::string &t, const std::string &c, const std::string &s);
+
 		void print() const;
 
 	private:
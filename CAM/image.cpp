@@ -0,0 +1,413 @@
+#include <fstream>
+#include <cstddef>
+#include <cstring>
+
+#include "program.h"
+#include "number.h"
+#include "mapped.h"
+#include "CAM.h"
+
+namespace CAM
+{
+	// Image of a compiled program in the byte order of the machine that wrote
+	// it. Every section starts at a multiple of 8 bytes:
+	//   ImageHeader
+	//   source						the code the program was compiled from
+	//   ImageInstruction[]
+	//   ImageLiteral, text, limbs	for every literal, the limbs of a bignum only
+	//   ImageCapture, ImageNode[]	for every capture
+	namespace
+	{
+		const char magic[8] = { 'C', 'A', 'M', 'I', 'M', 'A', 'G', 'E' };
+		const uint32_t version = 1;
+		// reads differently if the image comes from the other byte order
+		const uint32_t byte_order = 0x01020304;
+		const uint32_t flag_optimized = 1;
+
+		struct ImageHeader
+		{
+			char magic[8];
+			uint32_t version;
+			uint32_t byte_order;
+			uint32_t flags;
+			uint32_t reserved;
+			uint64_t source;
+			uint64_t instructions;
+			uint64_t literals;
+			uint64_t captures;
+			uint64_t forks;
+			uint64_t memo;
+		};
+
+		struct ImageInstruction
+		{
+			uint32_t op;
+			uint32_t reserved;
+			uint64_t arg;
+			uint64_t arg2;
+		};
+
+		struct ImageLiteral
+		{
+			uint64_t text;
+			int64_t fixnum;
+			uint32_t is_fixnum;
+			// 64 bit limbs of a bignum, negative for a negative number
+			int32_t limbs;
+		};
+
+		struct ImageCapture
+		{
+			int32_t root;
+			uint32_t reserved;
+			uint64_t pairs;
+			uint64_t nodes;
+		};
+
+		struct ImageNode
+		{
+			int32_t first;
+			int32_t second;
+			uint32_t is_whole;
+			uint32_t reserved;
+		};
+
+		size_t padding(size_t size) { return (8 - size % 8) % 8; }
+
+		// Instructions of the image may be used in place
+		bool is_native() {
+			return sizeof(size_t) == sizeof(uint64_t) && sizeof(Program::op_t) == sizeof(uint32_t) &&
+				sizeof(Program::Instruction) == sizeof(ImageInstruction) &&
+				offsetof(Program::Instruction, arg) == offsetof(ImageInstruction, arg) &&
+				offsetof(Program::Instruction, arg2) == offsetof(ImageInstruction, arg2);
+		}
+
+		// Sections of the mapped image, checked against its end
+		class Reader
+		{
+			const char *_data;
+			size_t _size;
+			size_t _pos;
+			const std::string &_path;
+
+		public:
+			Reader(const char *data, size_t size, const std::string &path) : _data(data), _size(size), _pos(0), _path(path) {}
+
+			const char* read(size_t size) {
+				if (_size - _pos < size)
+					throw CAMException("Invalid image: " + _path);
+
+				const char *p = _data + _pos;
+				_pos += size + std::min(padding(size), _size - _pos - size);
+				return p;
+			}
+
+			template <class T>
+			const T* read(size_t count = 1) {
+				if (count > _size / sizeof(T))
+					throw CAMException("Invalid image: " + _path);
+				return reinterpret_cast<const T*>(read(count * sizeof(T)));
+			}
+		};
+
+		class Writer
+		{
+			std::ostream &_os;
+
+		public:
+			Writer(std::ostream &os) : _os(os) {}
+
+			void write(const void *data, size_t size) {
+				static const char zeros[8] = {};
+				_os.write(static_cast<const char*>(data), size);
+				_os.write(zeros, padding(size));
+			}
+
+			template <class T>
+			void write(const T &t) { write(&t, sizeof(T)); }
+		};
+	}
+
+	std::shared_ptr<const Program> Program::load(const std::string &path, std::string *source) {
+		std::shared_ptr<MappedFile> image = std::make_shared<MappedFile>(path);
+		return load(image, 0, image->size(), path, source);
+	}
+
+	std::shared_ptr<const Program> Program::load(const std::shared_ptr<MappedFile> &image, size_t offset, size_t size,
+		const std::string &path, std::string *source) {
+		if (offset % 8 || offset > image->size() || size > image->size() - offset)
+			throw CAMException("Invalid image: " + path);
+		Reader reader(image->data() + offset, size, path);
+
+		const ImageHeader &h = *reader.read<ImageHeader>();
+		if (memcmp(h.magic, magic, sizeof(magic)) || h.version != version || h.byte_order != byte_order)
+			throw CAMException("Invalid image: " + path);
+
+		std::shared_ptr<Program> program(new Program());
+		program->_forks = static_cast<size_t>(h.forks);
+		program->_memo = h.memo == static_cast<uint64_t>(-1) ? no_memo : static_cast<size_t>(h.memo);
+		program->_is_optimized = (h.flags & flag_optimized) != 0;
+
+		const char *text = reader.read(static_cast<size_t>(h.source));
+		if (source)
+			source->assign(text, static_cast<size_t>(h.source));
+
+		const ImageInstruction *instructions = reader.read<ImageInstruction>(static_cast<size_t>(h.instructions));
+		program->_size = static_cast<size_t>(h.instructions);
+		for (size_t pc = 0; pc < program->_size; pc++) {
+			if (instructions[pc].op >= op_count)
+				throw InvalidCodeException("opcode at " + std::to_string(pc) + " in image " + path);
+		}
+		if (is_native()) {
+			program->_instructions = reinterpret_cast<const Instruction*>(instructions);
+			program->_image = image;
+		}
+		else {
+			for (size_t pc = 0; pc < program->_size; pc++) {
+				const ImageInstruction &i = instructions[pc];
+				program->_code.push_back(Instruction(static_cast<op_t>(i.op), static_cast<size_t>(i.arg), static_cast<size_t>(i.arg2)));
+			}
+			program->_instructions = program->_code.data();
+		}
+
+		for (uint64_t n = 0; n < h.literals; n++) {
+			const ImageLiteral &l = *reader.read<ImageLiteral>();
+			std::string text(reader.read(static_cast<size_t>(l.text)), static_cast<size_t>(l.text));
+			program->_literals.push_back(Literal(text, l.is_fixnum != 0, l.fixnum));
+
+			mpz_class &number = program->_literals.back().number;
+			if (l.is_fixnum)
+				number = Number::to_mpz(l.fixnum);
+			else {
+				size_t limbs = static_cast<size_t>(l.limbs < 0 ? -l.limbs : l.limbs);
+				mpz_import(number.get_mpz_t(), limbs, -1, sizeof(uint64_t), 0, 0, reader.read<uint64_t>(limbs));
+				if (l.limbs < 0)
+					number = -number;
+			}
+		}
+
+		for (uint64_t n = 0; n < h.captures; n++) {
+			const ImageCapture &c = *reader.read<ImageCapture>();
+			const ImageNode *nodes = reader.read<ImageNode>(static_cast<size_t>(c.nodes));
+
+			Capture capture;
+			capture.root = c.root;
+			capture.pairs = static_cast<size_t>(c.pairs);
+			for (uint64_t i = 0; i < c.nodes; i++) {
+				Capture::Node node = { nodes[i].first, nodes[i].second, nodes[i].is_whole != 0 };
+				capture.nodes.push_back(node);
+			}
+			program->_captures.push_back(capture);
+		}
+
+		program->validate(path);
+		program->check();
+		return program;
+	}
+
+	void Program::save(const std::string &path, const std::string &source) const {
+		std::ofstream os(path.c_str(), std::ios::binary | std::ios::trunc);
+		if (!os)
+			throw CAMException("Cannot write image: " + path);
+
+		save(os, source);
+		if (!os)
+			throw CAMException("Cannot write image: " + path);
+	}
+
+	void Program::save(std::ostream &os, const std::string &source) const {
+		Writer writer(os);
+
+		ImageHeader h = {};
+		memcpy(h.magic, magic, sizeof(magic));
+		h.version = version;
+		h.byte_order = byte_order;
+		h.flags = _is_optimized ? flag_optimized : 0;
+		h.source = source.length();
+		h.instructions = _size;
+		h.literals = _literals.size();
+		h.captures = _captures.size();
+		h.forks = _forks;
+		h.memo = _memo == no_memo ? static_cast<uint64_t>(-1) : _memo;
+		writer.write(h);
+
+		writer.write(source.data(), source.length());
+
+		std::vector<ImageInstruction> instructions(_size);
+		for (size_t pc = 0; pc < _size; pc++) {
+			instructions[pc].op = at(pc).op;
+			instructions[pc].reserved = 0;
+			instructions[pc].arg = at(pc).arg;
+			instructions[pc].arg2 = at(pc).arg2;
+		}
+		writer.write(instructions.data(), instructions.size() * sizeof(ImageInstruction));
+
+		for (auto it = _literals.begin(); it != _literals.end(); ++it) {
+			std::vector<uint64_t> limbs;
+			if (!it->is_fixnum) {
+				limbs.resize((mpz_sizeinbase(it->number.get_mpz_t(), 2) + 63) / 64);
+				size_t count = 0;
+				mpz_export(limbs.data(), &count, -1, sizeof(uint64_t), 0, 0, it->number.get_mpz_t());
+				limbs.resize(count);
+			}
+
+			int32_t count = static_cast<int32_t>(limbs.size());
+			ImageLiteral l = {};
+			l.text = it->text.length();
+			l.fixnum = it->fixnum;
+			l.is_fixnum = it->is_fixnum;
+			l.limbs = sgn(it->number) < 0 ? -count : count;
+			writer.write(l);
+			writer.write(it->text.data(), it->text.length());
+			writer.write(limbs.data(), limbs.size() * sizeof(uint64_t));
+		}
+
+		for (auto it = _captures.begin(); it != _captures.end(); ++it) {
+			ImageCapture c = {};
+			c.root = it->root;
+			c.pairs = it->pairs;
+			c.nodes = it->nodes.size();
+			writer.write(c);
+
+			std::vector<ImageNode> nodes(it->nodes.size());
+			for (size_t i = 0; i < nodes.size(); i++) {
+				nodes[i].first = it->nodes[i].first;
+				nodes[i].second = it->nodes[i].second;
+				nodes[i].is_whole = it->nodes[i].is_whole;
+				nodes[i].reserved = 0;
+			}
+			writer.write(nodes.data(), nodes.size() * sizeof(ImageNode));
+		}
+	}
+
+	// The operands refer to instructions, literals and captures which exist
+	// and every transition ends, so a damaged image cannot make the machine
+	// read past them or loop in one step
+	void Program::validate(const std::string &path) const {
+		auto invalid = [&path](const std::string &what) {
+			throw InvalidCodeException(what + " in image " + path);
+		};
+
+		if (_size == 0 || at(_size - 1).op != op_ret)
+			invalid("no ret at the end");
+		if (_memo != no_memo && (_memo + 1 >= _size || at(_memo).op != op_memo))
+			invalid("memo block");
+
+		for (size_t pc = 0; pc < _size; pc++) {
+			const Instruction &i = at(pc);
+			bool is_valid = true;
+
+			switch (i.op) {
+			case op_cur:
+			case op_rec:
+				is_valid = i.arg < _size && (i.arg2 == no_capture || i.arg2 < _captures.size());
+				break;
+			case op_call:
+			case op_fork:
+				is_valid = i.arg < _size && i.arg2 < _size;
+				break;
+			case op_branch:
+				is_valid = i.arg > 0 && i.arg < _size && at(i.arg - 1).op == op_jump;
+				break;
+			case op_app:
+			case op_save:
+			case op_join:
+			case op_jump:
+				is_valid = i.arg < _size;
+				break;
+			case op_quote:
+				is_valid = i.arg < _literals.size();
+				break;
+			// a path of 0 never reaches empty_path
+			case op_path:
+				is_valid = i.arg != 0;
+				break;
+			case op_acc:
+				is_valid = i.arg < max_path;
+				break;
+			case op_pair:
+			case op_add_pair:
+			case op_sub_pair:
+			case op_mul_pair:
+			case op_eq_pair:
+				is_valid = i.arg != 0 && i.arg2 != 0;
+				break;
+			case op_pair_quote:
+			case op_add_quote:
+			case op_sub_quote:
+			case op_mul_quote:
+			case op_eq_quote:
+				is_valid = i.arg != 0 && i.arg2 < _literals.size() && _literals[i.arg2].is_fixnum;
+				break;
+			case op_memo:
+				is_valid = pc == _memo;
+				break;
+			default:
+				break;
+			}
+
+			if (!is_valid)
+				invalid(std::string(op_name(i.op)) + " at " + std::to_string(pc));
+		}
+
+		// 1: on the chain being followed, 2: leads to an instruction
+		std::vector<char> jumps(_size, 0);
+		for (size_t pc = 0; pc < _size; pc++) {
+			size_t next = pc;
+			while (at(next).op == op_jump && !jumps[next]) {
+				jumps[next] = 1;
+				next = at(next).arg;
+			}
+			if (at(next).op == op_jump && jumps[next] == 1)
+				invalid("loop of jumps at " + std::to_string(pc));
+
+			for (next = pc; jumps[next] == 1; next = at(next).arg)
+				jumps[next] = 2;
+		}
+
+		// A node has at most one parent, so the nodes below the root are a
+		// tree, and Machine::capture makes a pair for each of them which is
+		// not whole
+		for (size_t n = 0; n < _captures.size(); n++) {
+			const Capture &c = _captures[n];
+			std::string what = "capture " + std::to_string(n);
+			int nodes = static_cast<int>(c.nodes.size());
+			if (c.root < Capture::Node::none || c.root >= nodes)
+				invalid(what);
+
+			std::vector<bool> is_child(c.nodes.size(), false);
+			for (auto node = c.nodes.begin(); node != c.nodes.end(); ++node) {
+				int children[] = { node->first, node->second };
+				for (size_t k = 0; k < 2; k++) {
+					int child = children[k];
+					if (child < Capture::Node::none || child >= nodes)
+						invalid(what);
+					if (child == Capture::Node::none)
+						continue;
+					if (child == c.root || is_child[child])
+						invalid(what);
+					is_child[child] = true;
+				}
+			}
+
+			size_t pairs = 0;
+			std::vector<int> todo;
+			if (c.root != Capture::Node::none)
+				todo.push_back(c.root);
+			while (!todo.empty()) {
+				const Capture::Node &node = c.nodes[todo.back()];
+				todo.pop_back();
+				if (node.is_whole)
+					continue;
+
+				++pairs;
+				if (node.first != Capture::Node::none)
+					todo.push_back(node.first);
+				if (node.second != Capture::Node::none)
+					todo.push_back(node.second);
+			}
+			if (pairs != c.pairs)
+				invalid(what);
+		}
+	}
+}
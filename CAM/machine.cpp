@@ -0,0 +1,838 @@
+#include <sstream>
+#include <exception>
+#include <limits>
+
+#include "machine.h"
+#include "snapshot.h"
+#include "CAM.h"
+
+namespace CAM
+{
+	// Operations of '+', '-', '*' and '='. The fixnum variant returns true on
+	// overflow, the operation is then repeated on mpz_class.
+	struct Add
+	{
+		static bool apply(int64_t a, int64_t b, int64_t &r) { return Number::add_overflow(a, b, r); }
+		static mpz_class apply(const mpz_class &a, const mpz_class &b) { return a + b; }
+	};
+
+	struct Sub
+	{
+		static bool apply(int64_t a, int64_t b, int64_t &r) { return Number::sub_overflow(a, b, r); }
+		static mpz_class apply(const mpz_class &a, const mpz_class &b) { return a - b; }
+	};
+
+	struct Mul
+	{
+		static bool apply(int64_t a, int64_t b, int64_t &r) { return Number::mul_overflow(a, b, r); }
+		static mpz_class apply(const mpz_class &a, const mpz_class &b) { return a * b; }
+	};
+
+	struct Eq
+	{
+		static bool apply(int64_t a, int64_t b, int64_t &r) { r = a == b; return false; }
+		static mpz_class apply(const mpz_class &a, const mpz_class &b) { return a == b; }
+	};
+
+	// Right side of a fork on its own machine
+	class Machine::ForkTask : public Pool::Task
+	{
+	public:
+		Machine machine;
+		std::exception_ptr error;
+		std::atomic<bool> is_stopped;
+
+		ForkTask() : machine(fork_heap_size), is_stopped(false) {}
+
+	protected:
+		virtual void execute() {
+			try {
+				machine.run();
+			}
+			catch (...) {
+				error = std::current_exception();
+				machine.stop_forks();
+			}
+		}
+	};
+
+	Machine::Machine(size_t heap_size) : _heap(heap_size), _dispatch(dispatch_threaded), _steps(0), _observer(nullptr), _pool(nullptr), _memo(nullptr),
+		_snapshot(nullptr), _is_unchecked(true), _is_checked(true), _check_at(0) {
+		_heap.add_root(&_term);
+		_heap.add_roots(&_stack);
+	}
+
+	void Machine::load(const std::shared_ptr<const Program> &program, const Term::term_ptr &input) {
+		clear();
+
+		_program = program;
+		_code.reset(new Continuation(*_program));
+		_start = std::chrono::steady_clock::now();
+		try {
+			_term = make_value(input);
+		}
+		catch (Heap::LimitReached &) {
+			limit_reached(limit_memory);
+		}
+
+		// the types of a program are those of its run on ()
+		_is_checked = !_is_unchecked || !_program->typed() || !_term.is_unit();
+
+		if (_memo)
+			_memo->clear();
+	}
+
+	void Machine::clear() {
+		stop_forks();
+
+		_steps = 0;
+		_term = Value::make();
+		_stack.clear();
+		_heap.clear();
+		_code.reset();
+		_program.reset();
+	}
+
+	// The whole input is allocated at once, so no cell moves while it is built
+	Value Machine::make_value(const Term::term_ptr &term) {
+		_heap.reserve(size_of(term));
+		return make_value(term, _heap);
+	}
+
+	Value Machine::make_value(const Term::term_ptr &term, Heap &heap) {
+		if (auto pair = std::dynamic_pointer_cast<TermPair>(term)) {
+			Value first = make_value(pair->first(), heap);
+			return heap.make_pair(first, make_value(pair->second(), heap));
+		}
+		if (auto number = std::dynamic_pointer_cast<QuoteTerm>(term))
+			return heap.make_number(number->value());
+		return Value::make();
+	}
+
+	size_t Machine::size_of(const Term::term_ptr &term) {
+		if (auto pair = std::dynamic_pointer_cast<TermPair>(term))
+			return Heap::pair_size + size_of(pair->first()) + size_of(pair->second());
+		if (std::dynamic_pointer_cast<QuoteTerm>(term))
+			return Heap::number_size;
+		return 0;
+	}
+
+	size_t Machine::peak_memory() const {
+		size_t frames = _code ? _code->max_depth() : 0;
+		return _heap.footprint() + _stack.capacity() * sizeof(Value) + frames * sizeof(size_t);
+	}
+
+	void Machine::set_limits(const Limits &limits) {
+		_limits = limits;
+		_heap.set_limit(limits.memory);
+	}
+
+	void Machine::execute() {
+		_start = std::chrono::steady_clock::now();
+		_deadline = _start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(_limits.seconds));
+		_check_at = _steps;
+		try {
+			run();
+		}
+		catch (...) {
+			stop_forks();
+			throw;
+		}
+	}
+
+	void Machine::run() {
+		try {
+			// forks and memos are handled by the checked switch only
+			if ((_pool && _program->forks()) || (_memo && _program->memo() != Program::no_memo)) {
+				execute_switch<true>();
+				return;
+			}
+
+			switch (_dispatch) {
+			case dispatch_table:
+				if (_is_checked)
+					execute_table<true>();
+				else
+					execute_table<false>();
+				break;
+			case dispatch_switch:
+				if (_is_checked)
+					execute_switch<true>();
+				else
+					execute_switch<false>();
+				break;
+			case dispatch_threaded:
+				if (_is_checked)
+					execute_threaded<true>();
+				else
+					execute_threaded<false>();
+				break;
+			}
+		}
+		catch (Heap::LimitReached &) {
+			limit_reached(limit_memory);
+		}
+	}
+
+	void Machine::check_limits() {
+		for (auto it = _stops.begin(); it != _stops.end(); ++it) {
+			if (**it)
+				throw Stopped();
+		}
+		if (_limits.steps && _steps >= _limits.steps)
+			limit_reached(limit_steps);
+		if (_limits.depth && _code->depth() > _limits.depth)
+			limit_reached(limit_depth);
+		if (_limits.seconds > 0 && std::chrono::steady_clock::now() >= _deadline)
+			limit_reached(limit_time);
+		if (_snapshot && _snapshot->is_due(_steps))
+			_snapshot->take(*this);
+
+		// the steps alone need no check before their bound, a snapshot may
+		// be requested and a fork stopped at any time
+		if (!_limits.depth && _limits.seconds <= 0 && !_snapshot && _stops.empty())
+			_check_at = std::numeric_limits<size_t>::max();
+		else
+			_check_at = _steps + check_interval;
+		if (_limits.steps && _check_at > _limits.steps)
+			_check_at = _limits.steps;
+		if (_snapshot && _check_at > _snapshot->next())
+			_check_at = _snapshot->next();
+	}
+
+	void Machine::limit_reached(limit_t limit) const {
+		LimitException::Stats stats;
+		stats.steps = _steps;
+		stats.max_depth = max_depth();
+		stats.memory = peak_memory();
+		stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - _start).count();
+		throw LimitException(limit, stats);
+	}
+
+	template <bool is_checked>
+	void Machine::execute_table() {
+		Continuation &code = *_code;
+		const transition_t *transitions = Machine::transitions<is_checked>();
+
+		while (!code.empty())
+		{
+			if (_steps >= _check_at)
+				check_limits();
+			if (_observer)
+				_observer->step(*this);
+
+			const transition_t &tr = transitions[code.current().op];
+
+			tr(_term, code, _stack, _heap);
+			++_steps;
+		}
+	}
+
+	template <bool is_checked>
+	void Machine::execute_switch() {
+		Continuation &code = *_code;
+		bool is_memo = _memo && _program->memo() != Program::no_memo;
+
+		while (!code.empty())
+		{
+			if (_steps >= _check_at)
+				check_limits();
+			if (_observer)
+				_observer->step(*this);
+
+			switch (code.current().op) {
+			case Program::op_fst: first<is_checked>(_term, code, _stack, _heap); break;
+			case Program::op_snd: second<is_checked>(_term, code, _stack, _heap); break;
+			case Program::op_push: push(_term, code, _stack, _heap); break;
+			case Program::op_swap: swap<is_checked>(_term, code, _stack, _heap); break;
+			case Program::op_cons: cons<is_checked>(_term, code, _stack, _heap); break;
+			case Program::op_app:
+				if (is_memo)
+					memo_apply();
+				else
+					apply<is_checked>(_term, code, _stack, _heap);
+				break;
+			case Program::op_cur: closure(_term, code, _stack, _heap); break;
+			case Program::op_quote: quote(_term, code, _stack, _heap); break;
+			case Program::op_branch: branch<is_checked>(_term, code, _stack, _heap); break;
+			case Program::op_rec: rec(_term, code, _stack, _heap); break;
+			case Program::op_add: add<is_checked>(_term, code, _stack, _heap); break;
+			case Program::op_sub: sub<is_checked>(_term, code, _stack, _heap); break;
+			case Program::op_mul: mul<is_checked>(_term, code, _stack, _heap); break;
+			case Program::op_eq: eq<is_checked>(_term, code, _stack, _heap); break;
+			case Program::op_path: path<is_checked>(_term, code, _stack, _heap); break;
+			case Program::op_acc: access<is_checked>(_term, code, _stack, _heap); break;
+			case Program::op_pair: pair<is_checked>(_term, code, _stack, _heap); break;
+			case Program::op_pair_quote: pair_quote<is_checked>(_term, code, _stack, _heap); break;
+			case Program::op_add_quote: operation_quote<Add, is_checked>(_term, code, _stack, _heap); break;
+			case Program::op_sub_quote: operation_quote<Sub, is_checked>(_term, code, _stack, _heap); break;
+			case Program::op_mul_quote: operation_quote<Mul, is_checked>(_term, code, _stack, _heap); break;
+			case Program::op_eq_quote: operation_quote<Eq, is_checked>(_term, code, _stack, _heap); break;
+			case Program::op_add_pair: operation_pair<Add, is_checked>(_term, code, _stack, _heap); break;
+			case Program::op_sub_pair: operation_pair<Sub, is_checked>(_term, code, _stack, _heap); break;
+			case Program::op_mul_pair: operation_pair<Mul, is_checked>(_term, code, _stack, _heap); break;
+			case Program::op_eq_pair: operation_pair<Eq, is_checked>(_term, code, _stack, _heap); break;
+			case Program::op_save: save(_term, code, _stack, _heap); break;
+			case Program::op_call: call<is_checked>(_term, code, _stack, _heap); break;
+			case Program::op_fork: fork(); break;
+			case Program::op_join: join(); break;
+			case Program::op_memo:
+				if (!is_memo)
+					invalid(_term, code, _stack, _heap);
+				_memo->store(_term);
+				code.next();
+				break;
+			default:
+				invalid(_term, code, _stack, _heap);
+			}
+			++_steps;
+		}
+	}
+
+	template <bool is_checked>
+	void Machine::execute_threaded() {
+#if defined(__GNUC__)
+		// Labels in the order of Program::op_t. Jumps and returns are resolved by
+		// the continuation and never reach the dispatch. Forks run sequentially.
+		static void *labels[Program::op_count] = {
+			&&l_fst, &&l_snd, &&l_push, &&l_swap, &&l_cons, &&l_app, &&l_cur,
+			&&l_quote, &&l_branch, &&l_rec, &&l_add, &&l_sub, &&l_mul, &&l_eq,
+			&&l_path, &&l_acc, &&l_pair, &&l_pair_quote, &&l_add_quote, &&l_sub_quote, &&l_mul_quote, &&l_eq_quote,
+			&&l_add_pair, &&l_sub_pair, &&l_mul_pair, &&l_eq_pair, &&l_save, &&l_call,
+			&&l_push, &&l_swap, &&l_undef, &&l_undef, &&l_undef
+		};
+
+		Continuation &code = *_code;
+
+#define DISPATCH() \
+		do { \
+			if (code.empty()) \
+				return; \
+			if (_steps >= _check_at) \
+				check_limits(); \
+			if (_observer) \
+				_observer->step(*this); \
+			goto *labels[code.current().op]; \
+		} while (0)
+
+#define TRANSITION(label, ...) \
+		label: \
+			__VA_ARGS__(_term, code, _stack, _heap); \
+			++_steps; \
+			DISPATCH();
+
+		DISPATCH();
+
+		TRANSITION(l_fst, first<is_checked>)
+		TRANSITION(l_snd, second<is_checked>)
+		TRANSITION(l_push, push)
+		TRANSITION(l_swap, swap<is_checked>)
+		TRANSITION(l_cons, cons<is_checked>)
+		TRANSITION(l_app, apply<is_checked>)
+		TRANSITION(l_cur, closure)
+		TRANSITION(l_quote, quote)
+		TRANSITION(l_branch, branch<is_checked>)
+		TRANSITION(l_rec, rec)
+		TRANSITION(l_add, add<is_checked>)
+		TRANSITION(l_sub, sub<is_checked>)
+		TRANSITION(l_mul, mul<is_checked>)
+		TRANSITION(l_eq, eq<is_checked>)
+		TRANSITION(l_path, path<is_checked>)
+		TRANSITION(l_acc, access<is_checked>)
+		TRANSITION(l_pair, pair<is_checked>)
+		TRANSITION(l_pair_quote, pair_quote<is_checked>)
+		TRANSITION(l_add_quote, operation_quote<Add, is_checked>)
+		TRANSITION(l_sub_quote, operation_quote<Sub, is_checked>)
+		TRANSITION(l_mul_quote, operation_quote<Mul, is_checked>)
+		TRANSITION(l_eq_quote, operation_quote<Eq, is_checked>)
+		TRANSITION(l_add_pair, operation_pair<Add, is_checked>)
+		TRANSITION(l_sub_pair, operation_pair<Sub, is_checked>)
+		TRANSITION(l_mul_pair, operation_pair<Mul, is_checked>)
+		TRANSITION(l_eq_pair, operation_pair<Eq, is_checked>)
+		TRANSITION(l_save, save)
+		TRANSITION(l_call, call<is_checked>)
+
+	l_undef:
+		invalid(_term, code, _stack, _heap);
+
+#undef TRANSITION
+#undef DISPATCH
+#else
+		execute_switch<is_checked>();
+#endif
+	}
+
+	template <bool is_checked>
+	const transition_t* Machine::transitions() {
+		struct Table
+		{
+			transition_t transitions[Program::op_count];
+
+			Table() {
+				transitions[Program::op_fst] = first<is_checked>;
+				transitions[Program::op_snd] = second<is_checked>;
+				transitions[Program::op_push] = push;
+				transitions[Program::op_swap] = swap<is_checked>;
+				transitions[Program::op_cons] = cons<is_checked>;
+				transitions[Program::op_app] = apply<is_checked>;
+				transitions[Program::op_cur] = closure;
+				transitions[Program::op_quote] = quote;
+				transitions[Program::op_branch] = branch<is_checked>;
+				transitions[Program::op_rec] = rec;
+				transitions[Program::op_add] = add<is_checked>;
+				transitions[Program::op_sub] = sub<is_checked>;
+				transitions[Program::op_mul] = mul<is_checked>;
+				transitions[Program::op_eq] = eq<is_checked>;
+				transitions[Program::op_path] = path<is_checked>;
+				transitions[Program::op_acc] = access<is_checked>;
+				transitions[Program::op_pair] = pair<is_checked>;
+				transitions[Program::op_pair_quote] = pair_quote<is_checked>;
+				transitions[Program::op_add_quote] = operation_quote<Add, is_checked>;
+				transitions[Program::op_sub_quote] = operation_quote<Sub, is_checked>;
+				transitions[Program::op_mul_quote] = operation_quote<Mul, is_checked>;
+				transitions[Program::op_eq_quote] = operation_quote<Eq, is_checked>;
+				transitions[Program::op_add_pair] = operation_pair<Add, is_checked>;
+				transitions[Program::op_sub_pair] = operation_pair<Sub, is_checked>;
+				transitions[Program::op_mul_pair] = operation_pair<Mul, is_checked>;
+				transitions[Program::op_eq_pair] = operation_pair<Eq, is_checked>;
+				transitions[Program::op_save] = save;
+				transitions[Program::op_call] = call<is_checked>;
+				// forks run sequentially
+				transitions[Program::op_fork] = push;
+				transitions[Program::op_join] = swap<is_checked>;
+				// memo runs use the switch
+				transitions[Program::op_memo] = invalid;
+				transitions[Program::op_jump] = invalid;
+				transitions[Program::op_ret] = invalid;
+			}
+		};
+
+		// initialized once even if machines start in several threads
+		static const Table table;
+		return table.transitions;
+	}
+
+	template <bool is_checked>
+	void Machine::first(Value &term, Continuation &code, stack_t &stack, Heap &heap) {
+		if (is_checked && !term.is_pair())
+			throw InvalidTermException(term.to_string(&code.program()), "(s, t)");
+
+		term = term.first();
+		code.next();
+	}
+
+	template <bool is_checked>
+	void Machine::second(Value &term, Continuation &code, stack_t &stack, Heap &heap) {
+		if (is_checked && !term.is_pair())
+			throw InvalidTermException(term.to_string(&code.program()), "(s, t)");
+
+		term = term.second();
+		code.next();
+	}
+
+	void Machine::push(Value &term, Continuation &code, stack_t &stack, Heap &heap) {
+		stack.push_back(term);
+		code.next();
+	}
+
+	template <bool is_checked>
+	void Machine::swap(Value &term, Continuation &code, stack_t &stack, Heap &heap) {
+		if (is_checked && stack.empty())
+			throw InvalidStackException("Empty stack");
+
+		std::swap(term, stack.back());
+		code.next();
+	}
+
+	template <bool is_checked>
+	void Machine::cons(Value &term, Continuation &code, stack_t &stack, Heap &heap) {
+		if (is_checked && stack.empty())
+			throw InvalidStackException("Empty stack");
+
+		heap.reserve(Heap::pair_size);
+		term = heap.make_pair(stack.back(), term);
+		stack.pop_back();
+		code.next();
+	}
+
+	template <bool is_checked>
+	void Machine::apply(Value &term, Continuation &code, stack_t &stack, Heap &heap) {
+		if (is_checked && (!term.is_pair() || !term.first().is_closure()))
+			throw InvalidTermException(term.to_string(&code.program()), "(C: s, t)");
+
+		heap.reserve(Heap::apply_size);
+
+		Value c = term.first();
+		size_t entry = c.entry();
+
+		term = heap.make_apply(c.env(), term.second());
+		code.call(entry);
+	}
+
+	void Machine::closure(Value &term, Continuation &code, stack_t &stack, Heap &heap) {
+		const Program::Instruction &i = code.current();
+		if (i.arg2 == Program::no_capture) {
+			heap.reserve(Heap::closure_size + heap.closure_env_size(term, false));
+			term = heap.make_closure(i.arg, term);
+		}
+		else {
+			const Program::Capture &c = code.program().capture(i.arg2);
+			heap.reserve(Heap::closure_size + c.pairs * Heap::pair_size + heap.closure_env_size(term, false));
+			term = heap.make_closure(i.arg, c.is_all() ? term : capture(term, c, c.root, heap));
+		}
+		code.next();
+	}
+
+	void Machine::quote(Value &term, Continuation &code, stack_t &stack, Heap &heap) {
+		const Program::Literal &literal = code.program().literal(code.current().arg);
+		if (literal.is_fixnum)
+			term = Value::make_fixnum(literal.fixnum);
+		else {
+			heap.reserve(Heap::number_size);
+			term = heap.make_number(literal.number);
+		}
+		code.next();
+	}
+
+	template <bool is_checked>
+	void Machine::branch(Value &term, Continuation &code, stack_t &stack, Heap &heap) {
+		if (is_checked && !term.is_number())
+			throw InvalidTermException(term.to_string(&code.program()), "numeric constant");
+
+		if (is_checked && stack.empty())
+			throw InvalidStackException("Empty stack");
+
+		bool condition = !term.is_zero();
+		term = stack.back();
+		stack.pop_back();
+
+		if (condition)
+			code.next();
+		else
+			code.jump(code.current().arg);
+	}
+
+	void Machine::rec(Value &term, Continuation &code, stack_t &stack, Heap &heap) {
+		const Program::Instruction &i = code.current();
+		if (i.arg2 == Program::no_capture) {
+			heap.reserve(Heap::closure_size + heap.closure_env_size(term, true));
+			term = heap.make_rec(i.arg, term);
+		}
+		else {
+			const Program::Capture &c = code.program().capture(i.arg2);
+			heap.reserve(Heap::closure_size + c.pairs * Heap::pair_size + heap.closure_env_size(term, true));
+			term = heap.make_rec(i.arg, c.is_all() ? term : capture(term, c, c.root, heap));
+		}
+		code.next();
+	}
+
+	Value Machine::capture(const Value &env, const Program::Capture &capture, int node, Heap &heap) {
+		if (node == Program::Capture::Node::none)
+			return Value::make();
+
+		const Program::Capture::Node &n = capture.nodes[node];
+		if (n.is_whole || !env.is_pair())
+			return env;
+
+		Value first = Machine::capture(env.first(), capture, n.first, heap);
+		Value second = Machine::capture(env.second(), capture, n.second, heap);
+		return heap.make_pair(first, second);
+	}
+
+	template <bool is_checked>
+	void Machine::add(Value &term, Continuation &code, stack_t &stack, Heap &heap) {
+		apply_operation<Add, is_checked>(term, code, heap);
+		code.next();
+	}
+
+	template <bool is_checked>
+	void Machine::sub(Value &term, Continuation &code, stack_t &stack, Heap &heap) {
+		apply_operation<Sub, is_checked>(term, code, heap);
+		code.next();
+	}
+
+	template <bool is_checked>
+	void Machine::mul(Value &term, Continuation &code, stack_t &stack, Heap &heap) {
+		apply_operation<Mul, is_checked>(term, code, heap);
+		code.next();
+	}
+
+	template <bool is_checked>
+	void Machine::eq(Value &term, Continuation &code, stack_t &stack, Heap &heap) {
+		apply_operation<Eq, is_checked>(term, code, heap);
+		code.next();
+	}
+
+	template <bool is_checked>
+	void Machine::path(Value &term, Continuation &code, stack_t &stack, Heap &heap) {
+		if (!walk<is_checked>(term, code.current().arg))
+			not_pair(term, code);
+		code.next();
+	}
+
+	template <bool is_checked>
+	void Machine::access(Value &term, Continuation &code, stack_t &stack, Heap &heap) {
+		size_t n = code.current().arg;
+		const Value *v = term.variable(n);
+		if (v)
+			term = *v;
+		else if (!walk<is_checked>(term, Program::variable_path(n)))
+			not_pair(term, code);
+		code.next();
+	}
+
+	template <bool is_checked>
+	void Machine::pair(Value &term, Continuation &code, stack_t &stack, Heap &heap) {
+		heap.reserve(Heap::pair_size);
+		const Program::Instruction &i = code.current();
+		Value a, b;
+		walk_pair<is_checked>(term, a, b, i.arg, i.arg2, stack, code);
+		term = heap.make_pair(a, b);
+		code.next();
+	}
+
+	template <bool is_checked>
+	void Machine::pair_quote(Value &term, Continuation &code, stack_t &stack, Heap &heap) {
+		heap.reserve(Heap::pair_size);
+		const Program::Instruction &i = code.current();
+		Value a, b;
+		walk_pair<is_checked>(term, a, b, i.arg, Program::empty_path, stack, code);
+		term = heap.make_pair(a, Value::make_fixnum(code.program().literal(i.arg2).fixnum));
+		code.next();
+	}
+
+	void Machine::save(Value &term, Continuation &code, stack_t &stack, Heap &heap) {
+		stack.push_back(term);
+		code.next();
+	}
+
+	template <bool is_checked>
+	void Machine::call(Value &term, Continuation &code, stack_t &stack, Heap &heap) {
+		if (is_checked && stack.empty())
+			throw InvalidStackException("Empty stack");
+
+		heap.reserve(heap.env_size(stack.back()));
+		term = heap.make_env(stack.back(), term);
+		stack.pop_back();
+		code.call(code.current().arg2);
+	}
+
+	void Machine::invalid(Value &term, Continuation &code, stack_t &stack, Heap &heap) {
+		throw InvalidCodeException(Program::op_name(code.current().op));
+	}
+
+	template <class operation_t, bool is_checked>
+	void Machine::operation_quote(Value &term, Continuation &code, stack_t &stack, Heap &heap) {
+		const Program::Instruction &i = code.current();
+		Value a, b;
+		walk_pair<is_checked>(term, a, b, i.arg, Program::empty_path, stack, code);
+		b = Value::make_fixnum(code.program().literal(i.arg2).fixnum);
+		if (is_checked && !a.is_number())
+			not_numbers(term, a, b, stack, code, heap);
+		apply_operation<operation_t, false>(term, a, b, code, heap);
+		code.next();
+	}
+
+	template <class operation_t, bool is_checked>
+	void Machine::operation_pair(Value &term, Continuation &code, stack_t &stack, Heap &heap) {
+		const Program::Instruction &i = code.current();
+		Value a, b;
+		walk_pair<is_checked>(term, a, b, i.arg, i.arg2, stack, code);
+		if (is_checked && (!a.is_number() || !b.is_number()))
+			not_numbers(term, a, b, stack, code, heap);
+		apply_operation<operation_t, false>(term, a, b, code, heap);
+		code.next();
+	}
+
+	template <class operation_t, bool is_checked>
+	void Machine::apply_operation(Value &term, const Continuation &code, Heap &heap) {
+		if (is_checked && !term.is_pair())
+			throw InvalidTermException(term.to_string(&code.program()), "(s,t)");
+
+		apply_operation<operation_t, is_checked>(term, term.first(), term.second(), code, heap);
+	}
+
+	template <class operation_t, bool is_checked>
+	void Machine::apply_operation(Value &term, Value a, Value b, const Continuation &code, Heap &heap) {
+		if (a.is_fixnum() && b.is_fixnum()) {
+			int64_t r;
+			if (!operation_t::apply(a.fixnum(), b.fixnum(), r)) {
+				term = Value::make_fixnum(r);
+				return;
+			}
+		}
+		else if (is_checked && (!a.is_number() || !b.is_number())) {
+			const Program *program = &code.program();
+			throw InvalidTermException('(' + a.to_string(program) + ", " + b.to_string(program) + ')',
+				"(s,t) where s and t - numeric constants");
+		}
+
+		mpz_class r = operation_t::apply(a.number(), b.number());
+		heap.reserve(Heap::number_size);
+		term = heap.make_number(r);
+	}
+
+	template <bool is_checked>
+	bool Machine::walk(Value &term, size_t path) {
+		for (; path != Program::empty_path; path >>= 1) {
+			if (is_checked && !term.is_pair())
+				return false;
+			term = (path & 1) ? term.second() : term.first();
+		}
+		return true;
+	}
+
+	template <bool is_checked>
+	void Machine::walk_pair(Value &term, Value &a, Value &b, size_t path, size_t path2, stack_t &stack, const Continuation &code) {
+		a = term;
+		if (!walk<is_checked>(a, path)) {
+			stack.push_back(term);
+			term = a;
+			not_pair(term, code);
+		}
+
+		b = term;
+		if (!walk<is_checked>(b, path2)) {
+			stack.push_back(a);
+			term = b;
+			not_pair(term, code);
+		}
+	}
+
+	void Machine::not_pair(const Value &term, const Continuation &code) {
+		throw InvalidTermException(term.to_string(&code.program()), "(s, t)");
+	}
+
+	void Machine::not_numbers(Value &term, Value a, Value b, stack_t &stack, const Continuation &code, Heap &heap) {
+		// a and b are not roots, the stack keeps them while the heap collects
+		stack.push_back(a);
+		stack.push_back(b);
+		heap.reserve(Heap::pair_size);
+		term = heap.make_pair(stack[stack.size() - 2], stack.back());
+		stack.resize(stack.size() - 2);
+		throw InvalidTermException(term.to_string(&code.program()), "(s,t) where s and t - numeric constants");
+	}
+
+	// B runs as a task only if the pool has no work waiting, otherwise the
+	// fork is sequential
+	void Machine::fork() {
+		std::shared_ptr<ForkTask> task;
+		if (_pool && _pool->pending() < _pool->threads()) {
+			const Program::Instruction &i = _code->current();
+
+			task = std::make_shared<ForkTask>();
+			Machine &m = task->machine;
+			m.set_flat_env(flat_env());
+			m.set_dispatch(_dispatch);
+			m.set_pool(_pool);
+			// B may take the steps left to this machine, the join counts
+			// them and the next check bounds the sum
+			Limits limits = _limits;
+			if (limits.steps)
+				limits.steps -= _steps;
+			m.set_limits(limits);
+			m._start = _start;
+			m._deadline = _deadline;
+			m._program = _program;
+			m._code.reset(new Continuation(*_program, i.arg + 1, i.arg2));
+			m._term = m._heap.import(_term);
+			m._stops = _stops;
+			m._stops.push_back(&task->is_stopped);
+
+			_pool->push(task);
+		}
+
+		_forks.push_back(task);
+		push(_term, *_code, _stack, _heap);
+	}
+
+	// The result of A replaces the term of '<' on the stack, as ',' would
+	// leave it for '>', and the result of B becomes the term
+	void Machine::join() {
+		std::shared_ptr<ForkTask> task = _forks.back();
+		_forks.pop_back();
+
+		if (!task) {
+			swap<true>(_term, *_code, _stack, _heap);
+			return;
+		}
+
+		task->join();
+
+		// A failed B stops the run as it would have stopped the sequential
+		// one: at the term of B and with the swap counted
+		const Machine &m = task->machine;
+		if (task->error) {
+			// the exception is taken, so the worker that drops the task last
+			// does not free it under the catch of this thread
+			std::exception_ptr error;
+			std::swap(error, task->error);
+			_term = _heap.import(m._term);
+			_steps += m._steps + 1;
+			try {
+				std::rethrow_exception(error);
+			}
+			// a bound reached by B is reported with the statistics of the run
+			catch (LimitException &e) {
+				limit_reached(e.limit());
+			}
+		}
+
+		_stack.back() = _term;
+		_term = _heap.import(m._term);
+		_steps += m._steps;
+		_code->jump(_code->current().arg);
+	}
+
+	// A stopped task which did not start never runs, a running one stops at
+	// its next check of the limits
+	void Machine::stop_forks() {
+		for (auto it = _forks.begin(); it != _forks.end(); ++it) {
+			if (*it) {
+				(*it)->is_stopped = true;
+				(*it)->cancel();
+				(*it)->join();
+			}
+		}
+		_forks.clear();
+	}
+
+	// Only the recursive functions of 'Y' repeat their applications, and a
+	// tail application keeps its loop in constant space if it is not cached
+	void Machine::memo_apply() {
+		if (_term.is_pair() && _term.first().is_rec() && !_program->is_tail_call(_code->pc())) {
+			Value result;
+			switch (_memo->find(_term.first(), _term.second(), result, _heap)) {
+			case Memo::find_hit:
+				_term = result;
+				_code->jump(_code->current().arg);
+				return;
+			case Memo::find_miss: {
+				_heap.reserve(Heap::apply_size);
+
+				Value c = _term.first();
+				_term = _heap.make_apply(c.env(), _term.second());
+				_code->call(c.entry(), _program->memo());
+				return;
+			}
+			default:
+				break;
+			}
+		}
+
+		apply<true>(_term, *_code, _stack, _heap);
+	}
+
+	std::string Machine::stack_string(const Printer &printer) const {
+		std::ostringstream ossteam;
+		ossteam << '[';
+		for (auto it = _stack.rbegin(); it != _stack.rend(); ++it) {
+			if (it != _stack.rbegin())
+				ossteam << ", ";
+			printer.print(ossteam, *it, _program.get());
+		}
+		ossteam << ']';
+
+		return ossteam.str();
+	}
+}
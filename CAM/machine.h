@@ -0,0 +1,331 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <memory>
+#include <chrono>
+
+#include "program.h"
+#include "term.h"
+#include "value.h"
+#include "printer.h"
+#include "heap.h"
+#include "pool.h"
+#include "memo.h"
+
+namespace CAM
+{
+	class Snapshot;
+
+	// Top of the stack is the back of the vector
+	typedef std::vector<Value> stack_t;
+	typedef std::function<void(Value&, Continuation&, stack_t&, Heap&)> transition_t;
+
+	// Execution context of a program: the term, the stack, the return frames
+	// and the heap of one run. The program is shared and never modified, so
+	// one program may run on many machines in different threads at once; a
+	// machine itself is used by one thread at a time.
+	//
+	// With a pool, the right side B of a fork <A,B> runs as a task on its own
+	// machine while this one runs A. The term of '<' is copied to the heap of
+	// the task and the result of B is copied back at the join, so the pair
+	// and the steps are the same as in the sequential run. A task nobody took
+	// yet is run by the join itself. An error of A is reported before an error
+	// of B, as in the sequential run. A run which fails stops the forks it has
+	// in progress and waits for them.
+	//
+	// With a memo, the non-tail applications of the closures of 'Y' return
+	// the cached result of an equal application; otherwise the body returns
+	// to the memo block of the program first, which caches its result. The
+	// machines of the forks do not memoize.
+	class Machine
+	{
+	public:
+		// How the run loop selects the transition for the current instruction
+		enum dispatch_t
+		{
+			dispatch_table,		// std::function table indexed by opcode
+			dispatch_switch,	// switch over the opcode
+			dispatch_threaded	// computed goto where supported, switch otherwise
+		};
+
+		// Called before every step of the run
+		class Observer
+		{
+		public:
+			virtual void step(const Machine &machine) = 0;
+
+			virtual ~Observer() {}
+		};
+
+		// Bounds of a run, 0 is no bound. A run which reaches one stops with
+		// LimitException. The steps are exact and the heap is checked when it
+		// grows; the frames and the time are checked every check_interval
+		// steps, so the depth may pass its bound by as many frames.
+		struct Limits
+		{
+			size_t steps;
+			size_t memory;	// bytes of both semispaces of the heap
+			size_t depth;	// return frames
+			double seconds;	// wall clock from the start of execute
+
+			Limits() : steps(0), memory(0), depth(0), seconds(0) {}
+		};
+
+		enum limit_t
+		{
+			limit_steps,
+			limit_memory,
+			limit_depth,
+			limit_time
+		};
+
+		static const size_t check_interval = 4096;
+
+		// Initial semispace of the machines of the forks
+		static const size_t fork_heap_size = 64 << 10;
+
+	private:
+		class ForkTask;
+
+		// Thrown in a fork whose result is no longer needed
+		struct Stopped {};
+
+		stack_t _stack;
+		Value _term;
+		Heap _heap;
+		std::shared_ptr<const Program> _program;
+		std::unique_ptr<Continuation> _code;
+		dispatch_t _dispatch;
+		size_t _steps;
+		Observer *_observer;
+		Pool *_pool;
+		// tasks of the forks in progress, nullptr if the fork runs here
+		std::vector<std::shared_ptr<ForkTask> > _forks;
+		// set when this fork or one it is nested in is stopped, checked with
+		// the limits
+		std::vector<const std::atomic<bool>*> _stops;
+		Memo *_memo;
+
+		Snapshot *_snapshot;
+
+		bool _is_unchecked;
+		// the run of the loaded program checks its terms and its stack
+		bool _is_checked;
+
+		Limits _limits;
+		// step of the next check of the limits
+		size_t _check_at;
+		std::chrono::steady_clock::time_point _start;
+		std::chrono::steady_clock::time_point _deadline;
+
+	public:
+		Machine(size_t heap_size = Heap::default_size);
+
+		// Starts the program on the input term of pairs and numbers, the
+		// machine is reset
+		void load(const std::shared_ptr<const Program> &program, const Term::term_ptr &input = Term::make());
+
+		// Runs the loaded program to the end. Throws LimitException if it
+		// reaches a limit.
+		void execute();
+
+		// Drops the program and the cells of the last run
+		void clear();
+
+		// Appends the state of the run between two steps to out, the heap is
+		// collected first, see snapshot.cpp. Returns false if it cannot be
+		// saved now: the run is a fork, has a fork in progress or memoizes.
+		bool save_state(std::string &out);
+
+		// Continues the run of the program from the state written by save.
+		// Returns false if the state does not fit the program.
+		bool restore_state(const std::shared_ptr<const Program> &program, const char *data, size_t size);
+
+		const std::shared_ptr<const Program>& program() const { return _program; }
+		const Continuation* code() const { return _code.get(); }
+		const Value& term() const { return _term; }
+		const stack_t& stack() const { return _stack; }
+
+		size_t steps() const { return _steps; }
+		size_t max_depth() const { return _code ? _code->max_depth() : 0; }
+		const Heap::Stats& heap_stats() const { return _heap.stats(); }
+		// Bytes held by the heap, the stack and the return frames
+		size_t peak_memory() const;
+
+		void set_flat_env(bool is_flat_env) { _heap.set_flat_env(is_flat_env); }
+
+		// Observer of the moves of the cells of the heap, nullptr: none
+		void set_heap_observer(Heap::Observer *observer) { _heap.set_observer(observer); }
+		bool flat_env() const { return _heap.flat_env(); }
+
+		void set_heap_size(size_t size) { _heap.set_size(size); }
+		size_t heap_size() const { return _heap.size(); }
+
+		void set_dispatch(dispatch_t dispatch) { _dispatch = dispatch; }
+		dispatch_t dispatch() const { return _dispatch; }
+
+		// nullptr: the run is not observed
+		void set_observer(Observer *observer) { _observer = observer; }
+
+		// Pool of the forks of the program, nullptr: the run is sequential
+		void set_pool(Pool *pool) { _pool = pool; }
+		Pool* pool() const { return _pool; }
+
+		// Cache of the applications of memoized programs, nullptr: nothing
+		// is cached. It is cleared when a program is loaded.
+		void set_memo(Memo *memo) { _memo = memo; }
+		Memo* memo() const { return _memo; }
+
+		// Bounds of the next runs. The machines of the forks share the
+		// deadline and have their own heaps and frames; a fork takes at most
+		// the steps left to the run when it starts, its steps count when it
+		// joins.
+		void set_limits(const Limits &limits);
+		const Limits& limits() const { return _limits; }
+
+		// Snapshots of the next runs, nullptr: none are taken. They are
+		// taken when the limits are checked.
+		void set_snapshot(Snapshot *snapshot) { _snapshot = snapshot; }
+		Snapshot* snapshot() const { return _snapshot; }
+
+		// Programs proved typed run without the checks of the shapes of the
+		// terms and of the depth of the stack, see Program::typed; on by
+		// default. Runs restored from snapshots and runs on an input term
+		// other than () are always checked.
+		void set_unchecked(bool is_unchecked) { _is_unchecked = is_unchecked; }
+		bool unchecked() const { return _is_unchecked; }
+
+		// The run of the loaded program checks its transitions
+		bool checked() const { return _is_checked; }
+
+		std::string term_string(const Printer &printer = Printer()) const { return printer.to_string(_term, _program.get()); }
+
+		std::string stack_string(const Printer &printer = Printer()) const;
+
+	private:
+		Machine(const Machine&);
+		Machine& operator=(const Machine&);
+
+		// Value of the input term, allocated in one piece
+		Value make_value(const Term::term_ptr &term);
+
+		static Value make_value(const Term::term_ptr &term, Heap &heap);
+
+		// Bytes of the cells of the term
+		static size_t size_of(const Term::term_ptr &term);
+
+		// Runs to the end with the limits started
+		void run();
+
+		// The loops and the transitions with is_checked false trust the terms
+		// and the stack of a typed program
+		template <bool is_checked>
+		void execute_table();
+
+		template <bool is_checked>
+		void execute_switch();
+
+		template <bool is_checked>
+		void execute_threaded();
+
+		// Throws LimitException if the run reached a limit, otherwise sets
+		// the step of the next check
+		void check_limits();
+
+		// LimitException of the limit with the statistics of the run
+		void limit_reached(limit_t limit) const;
+
+		// '<' and ',' of <A,B> which may run in parallel
+		void fork();
+		void join();
+
+		// Stops the forks in progress and waits for their tasks
+		void stop_forks();
+
+		// 'e' which may return a cached result
+		void memo_apply();
+
+		// Shared by all machines, built once
+		template <bool is_checked>
+		static const transition_t* transitions();
+
+		template <bool is_checked>
+		static void first(Value &term, Continuation &code, stack_t &stack, Heap &heap);
+		template <bool is_checked>
+		static void second(Value &term, Continuation &code, stack_t &stack, Heap &heap);
+		static void push(Value &term, Continuation &code, stack_t &stack, Heap &heap);
+		template <bool is_checked>
+		static void swap(Value &term, Continuation &code, stack_t &stack, Heap &heap);
+		template <bool is_checked>
+		static void cons(Value &term, Continuation &code, stack_t &stack, Heap &heap);
+		template <bool is_checked>
+		static void apply(Value &term, Continuation &code, stack_t &stack, Heap &heap);
+		static void closure(Value &term, Continuation &code, stack_t &stack, Heap &heap);
+		static void quote(Value &term, Continuation &code, stack_t &stack, Heap &heap);
+		template <bool is_checked>
+		static void branch(Value &term, Continuation &code, stack_t &stack, Heap &heap);
+		static void rec(Value &term, Continuation &code, stack_t &stack, Heap &heap);
+		// Copy of env with the parts outside node of the capture replaced by ()
+		static Value capture(const Value &env, const Program::Capture &capture, int node, Heap &heap);
+		template <bool is_checked>
+		static void add(Value &term, Continuation &code, stack_t &stack, Heap &heap);
+		template <bool is_checked>
+		static void sub(Value &term, Continuation &code, stack_t &stack, Heap &heap);
+		template <bool is_checked>
+		static void mul(Value &term, Continuation &code, stack_t &stack, Heap &heap);
+		template <bool is_checked>
+		static void eq(Value &term, Continuation &code, stack_t &stack, Heap &heap);
+
+		// Superinstructions
+		template <bool is_checked>
+		static void path(Value &term, Continuation &code, stack_t &stack, Heap &heap);
+		template <bool is_checked>
+		static void access(Value &term, Continuation &code, stack_t &stack, Heap &heap);
+		template <bool is_checked>
+		static void pair(Value &term, Continuation &code, stack_t &stack, Heap &heap);
+		template <bool is_checked>
+		static void pair_quote(Value &term, Continuation &code, stack_t &stack, Heap &heap);
+		static void save(Value &term, Continuation &code, stack_t &stack, Heap &heap);
+		template <bool is_checked>
+		static void call(Value &term, Continuation &code, stack_t &stack, Heap &heap);
+
+		// Instructions which never reach the dispatch of a valid run: jumps and
+		// returns, and the memo block of a run which does not memoize
+		static void invalid(Value &term, Continuation &code, stack_t &stack, Heap &heap);
+
+		template <class operation_t, bool is_checked>
+		static void operation_quote(Value &term, Continuation &code, stack_t &stack, Heap &heap);
+
+		template <class operation_t, bool is_checked>
+		static void operation_pair(Value &term, Continuation &code, stack_t &stack, Heap &heap);
+
+		template <class operation_t, bool is_checked>
+		static void apply_operation(Value &term, const Continuation &code, Heap &heap);
+
+		// Result of the operation on (a, b) in term
+		template <class operation_t, bool is_checked>
+		static void apply_operation(Value &term, Value a, Value b, const Continuation &code, Heap &heap);
+
+		// The superinstructions fail with the term and the stack the unfused
+		// instructions would fail with
+
+		// Follows the path of F and S from term. Returns false if it reaches
+		// a term which is not a pair before the end, term is that term then.
+		template <bool is_checked>
+		static bool walk(Value &term, size_t path);
+
+		// Follows the paths of <P,P> from term to a and b. If one fails, the
+		// term and the stack are left as after '<', P and ',' and it throws.
+		template <bool is_checked>
+		static void walk_pair(Value &term, Value &a, Value &b, size_t path, size_t path2, stack_t &stack, const Continuation &code);
+
+		// InvalidTermException of a path stopped at term
+		static void not_pair(const Value &term, const Continuation &code);
+
+		// Operands of <P,P> which are not numbers: (a, b) becomes the term, as
+		// after '>', and it throws
+		static void not_numbers(Value &term, Value a, Value b, stack_t &stack, const Continuation &code, Heap &heap);
+	};
+}
@@ -1,6 +1,10 @@
 #include <iostream>
+#include <csignal>
 
 #include "CAM.h"
+#include "bench.h"
+#include "batch.h"
+#include "server.h"
 
 #define VSWORKAROUND
 
@@ -16,22 +20,134 @@ extern "C" FILE * __cdecl __iob_func(void)
 #endif
 
 void usage(const char *pr_name) {
-	std::cerr << "Usage: " << pr_name << " [-v] [-h] [-r] code" << std::endl << std::endl;
+	std::cerr << "Usage: " << pr_name << " [-v] [-h] [-r] [-s] [--print-depth n] [--print-width n] [--print-shared] [-d dispatch] [--heap-size size]"
+		<< " [-t file [--trace-last n] [--trace-every k]]"
+		<< " [-p [--collapsed file]] [--no-optimize] [--dump] [--pair-env] [--trim-env] [--checked] [--typecheck]"
+		<< " [--parallel [--threads n] [--fork-cost c]] [--memo [--memo-size n]]"
+		<< " [--max-steps n] [--max-memory size] [--max-depth n] [--timeout seconds]"
+		<< " [--snapshot file [--snapshot-every n]] code" << std::endl;
+	std::cerr << "       " << pr_name << " [--no-optimize] [--pair-env] [--trim-env] [--parallel [--fork-cost c]] [--memo] [--typecheck] --compile-only file code" << std::endl;
+	std::cerr << "       " << pr_name << " [-v] [-r] [-s] [-d dispatch] [--heap-size size] [-t file ...] [-p ...] [--dump] [--checked] [--typecheck] [--parallel [--threads n]] [--memo [--memo-size n]] [--max-steps n ...] [--print-depth n ...] [--snapshot file ...] --image file" << std::endl;
+	std::cerr << "       " << pr_name << " [-v] [-r] [-s] [-d dispatch] [--heap-size size] [-t file ...] [-p ...] [--checked] [--typecheck] [--max-steps n ...] [--print-depth n ...] [--snapshot file ...] --resume file" << std::endl;
+	std::cerr << "       " << pr_name << " --emit-cpp file code" << std::endl;
+	std::cerr << "       " << pr_name << " --print-trace file" << std::endl;
+	std::cerr << "       " << pr_name << " [-d dispatch] [--heap-size size] --bench corpus [--iterations n] [--format csv|json]" << std::endl;
+	std::cerr << "       " << pr_name << " [-d dispatch] [--heap-size size] [--no-optimize] [--pair-env] [--trim-env] [--checked] [--typecheck] [--max-steps n ...] [--print-depth n ...] --batch file [--threads n]" << std::endl;
+	std::cerr << "       " << pr_name << " [-d dispatch] [--heap-size size] [--no-optimize] [--pair-env] [--trim-env] [--checked] [--typecheck] [--max-steps n ...] [--print-depth n ...] --server socket [--cache-size n]" << std::endl;
+	std::cerr << "       " << pr_name << " --client socket" << std::endl << std::endl;
 	std::cerr << "optional parameters:" << std::endl;
 	std::cerr << "\t-v: verbose" << std::endl;
 	std::cerr << "\t-h: show this message" << std::endl;
 	std::cerr << "\t-r: print result (value in term after execution) if -v is not specified" << std::endl;
+	std::cerr << "\t--print-depth: print the subterms nested deeper than n, in the first or the second of a pair, as ..." << std::endl;
+	std::cerr << "\t--print-width: print the pairs of a list (s, (t, ...)) past the first n as ..." << std::endl;
+	std::cerr << "\t--print-shared: print a subterm reached more than once as #k=s the first time and as #k# later" << std::endl;
+	std::cerr << "\t-s: print statistics (steps, peak depth of the return stack, heap and garbage collection)" << std::endl;
+	std::cerr << "\t-d: dispatch of transitions: table, switch or threaded (default)" << std::endl;
+	std::cerr << "\t--heap-size: initial size of a heap semispace in bytes, k, m or g suffix allowed (default 4m)" << std::endl;
+	std::cerr << "\t-t: write the binary trace of the execution to file" << std::endl;
+	std::cerr << "\t--trace-last: keep only the last n steps in the trace" << std::endl;
+	std::cerr << "\t--trace-every: trace every kth step" << std::endl;
+	std::cerr << "\t--print-trace: print the trace file as the verbose history" << std::endl;
+	std::cerr << "\t-p: print the profile: opcodes, closures and allocations" << std::endl;
+	std::cerr << "\t--collapsed: write the collapsed stacks of the profile to file for flame graphs" << std::endl;
+	std::cerr << "\t--no-optimize: run the code without superinstructions" << std::endl;
+	std::cerr << "\t--dump: print the listing of the compiled code before the run" << std::endl;
+	std::cerr << "\t--pair-env: build the environments of bodies from nested pairs instead of flat cells" << std::endl;
+	std::cerr << "\t--trim-env: closures capture only the parts of the environment their bodies read, the other parts of a closure in the result print as (), which is why it is off by default" << std::endl;
+	std::cerr << "\t--checked: check the terms and the stack of every transition, also of the programs proved typed" << std::endl;
+	std::cerr << "\t--typecheck: reject the programs which are not proved typed before they run" << std::endl;
+	std::cerr << "\t--parallel: evaluate A and B of the costly <A,B> in parallel" << std::endl;
+	std::cerr << "\t--fork-cost: least estimated cost of both A and B, an application costs 100 (default 100)" << std::endl;
+	std::cerr << "\t--memo: cache the results of the applications of recursive functions (Y)" << std::endl;
+	std::cerr << "\t--memo-size: most results kept in the cache, the least recently used are dropped (default 64k)" << std::endl;
+	std::cerr << "\t--max-steps: stop the run after n steps" << std::endl;
+	std::cerr << "\t--max-memory: stop the run if the heap would grow past size bytes, k, m or g suffix allowed" << std::endl;
+	std::cerr << "\t--max-depth: stop the run past n return frames, checked every 4096 steps" << std::endl;
+	std::cerr << "\t--timeout: stop the run after the seconds of wall clock, checked every 4096 steps" << std::endl;
+	std::cerr << "\t--snapshot: save the run to file every n steps and on SIGUSR1, not with --parallel or --memo" << std::endl;
+	std::cerr << "\t--snapshot-every: steps between the snapshots (default: only on SIGUSR1)" << std::endl;
+	std::cerr << "\t--resume: continue the run saved to the snapshot file" << std::endl;
+	std::cerr << "\t--bench: run the programs of the corpus file and print the timings" << std::endl;
+	std::cerr << "\t--iterations: runs of every program in the benchmark (default 10)" << std::endl;
+	std::cerr << "\t--format: output of the benchmark: csv (default) or json" << std::endl;
+	std::cerr << "\t--compile-only: write the compiled code to the image file instead of running it" << std::endl;
+	std::cerr << "\t--image: run the program of the image file written by --compile-only" << std::endl;
+	std::cerr << "\t--emit-cpp: write the code translated to a C++ program to file instead of running it" << std::endl;
+	std::cerr << "\t--batch: run the programs of the file, one per line, - for the standard input" << std::endl;
+	std::cerr << "\t--threads: worker threads of the batch or of --parallel (default: one per hardware thread)" << std::endl;
+	std::cerr << "\t--server: evaluate the requests of the clients of the Unix domain socket, one per line" << std::endl;
+	std::cerr << "\t--cache-size: most compiled programs kept by the server, the least recently used are dropped (default 1024)" << std::endl;
+	std::cerr << "\t--client: send the lines of the standard input to the server of the socket and print the results" << std::endl;
+}
+
+#ifdef SIGUSR1
+void request_snapshot(int) {
+	CAM::Snapshot::request();
+}
+#endif
+
+bool parse_size(const char *s, size_t &size) {
+	char *end;
+	unsigned long long v = strtoull(s, &end, 10);
+	if (end == s)
+		return false;
+
+	switch (tolower(*end)) {
+	case 'g':
+		v <<= 10;
+		// fallthrough
+	case 'm':
+		v <<= 10;
+		// fallthrough
+	case 'k':
+		v <<= 10;
+		++end;
+		break;
+	}
+
+	if (*end || v == 0)
+		return false;
+
+	size = static_cast<size_t>(v);
+	return true;
 }
 
 int main(int argc, char **argv)
 {
-	if (argc < 2 || argc > 5) {
+	if (argc < 2) {
 		usage(*argv);
 		return -1;
 	}
 
 	std::string code;
 	bool find_code = false;
+	std::string trace;
+	size_t trace_last = 0;
+	size_t trace_every = 1;
+	bool is_profile = false;
+	std::string collapsed;
+	std::string bench;
+	size_t iterations = 10;
+	CAM::Bench::format_t format = CAM::Bench::format_csv;
+	std::string batch;
+	size_t threads = 0;
+	bool is_parallel = false;
+	size_t fork_cost = CAM::Program::call_cost;
+	bool is_memo = false;
+	std::string image;
+	std::string compiled;
+	std::string translated;
+	size_t memo_size = CAM::Memo::default_capacity;
+	std::string server;
+	size_t cache_size = CAM::Server::default_cache_size;
+	CAM::Machine::Limits limits;
+	std::string snapshot;
+	size_t snapshot_every = 0;
+	std::string resume;
+	size_t print_depth = 0;
+	size_t print_width = 0;
+	bool is_print_shared = false;
 	CAM::CAM cam;
 
 	char **args = &argv[1];
@@ -47,6 +163,265 @@ int main(int argc, char **argv)
 		else if (!strcmp(*args, "-r")) {
 			cam.set_is_print_result(true);
 		}
+		else if (!strcmp(*args, "-s")) {
+			cam.set_is_print_stats(true);
+		}
+		else if (!strcmp(*args, "--print-depth") || !strcmp(*args, "--print-width")) {
+			size_t &n = !strcmp(*args, "--print-depth") ? print_depth : print_width;
+			if (!*++args || !parse_size(*args, n)) {
+				usage(*argv);
+				return -1;
+			}
+		}
+		else if (!strcmp(*args, "--print-shared")) {
+			is_print_shared = true;
+		}
+		else if (!strcmp(*args, "-d")) {
+			if (!*++args) {
+				usage(*argv);
+				return -1;
+			}
+
+			if (!strcmp(*args, "table"))
+				cam.set_dispatch(CAM::Machine::dispatch_table);
+			else if (!strcmp(*args, "switch"))
+				cam.set_dispatch(CAM::Machine::dispatch_switch);
+			else if (!strcmp(*args, "threaded"))
+				cam.set_dispatch(CAM::Machine::dispatch_threaded);
+			else {
+				usage(*argv);
+				return -1;
+			}
+		}
+		else if (!strcmp(*args, "--heap-size")) {
+			size_t size;
+			if (!*++args || !parse_size(*args, size)) {
+				usage(*argv);
+				return -1;
+			}
+
+			cam.set_heap_size(size);
+		}
+		else if (!strcmp(*args, "--max-steps")) {
+			if (!*++args || !parse_size(*args, limits.steps)) {
+				usage(*argv);
+				return -1;
+			}
+		}
+		else if (!strcmp(*args, "--max-memory")) {
+			if (!*++args || !parse_size(*args, limits.memory)) {
+				usage(*argv);
+				return -1;
+			}
+		}
+		else if (!strcmp(*args, "--max-depth")) {
+			if (!*++args || !parse_size(*args, limits.depth)) {
+				usage(*argv);
+				return -1;
+			}
+		}
+		else if (!strcmp(*args, "--timeout")) {
+			char *end;
+			if (!*++args || (limits.seconds = strtod(*args, &end)) <= 0 || *end) {
+				usage(*argv);
+				return -1;
+			}
+		}
+		else if (!strcmp(*args, "-t")) {
+			if (!*++args) {
+				usage(*argv);
+				return -1;
+			}
+
+			trace = *args;
+		}
+		else if (!strcmp(*args, "--trace-last") || !strcmp(*args, "--trace-every")) {
+			size_t &n = !strcmp(*args, "--trace-last") ? trace_last : trace_every;
+			if (!*++args || !parse_size(*args, n)) {
+				usage(*argv);
+				return -1;
+			}
+		}
+		else if (!strcmp(*args, "--no-optimize")) {
+			cam.set_optimize(false);
+		}
+		else if (!strcmp(*args, "--dump")) {
+			cam.set_dump(true);
+		}
+		else if (!strcmp(*args, "--pair-env")) {
+			cam.set_flat_env(false);
+		}
+		else if (!strcmp(*args, "--trim-env")) {
+			cam.set_trim(true);
+		}
+		else if (!strcmp(*args, "--checked")) {
+			cam.set_unchecked(false);
+		}
+		else if (!strcmp(*args, "--typecheck")) {
+			cam.set_typecheck(true);
+		}
+		else if (!strcmp(*args, "-p")) {
+			is_profile = true;
+		}
+		else if (!strcmp(*args, "--collapsed")) {
+			if (!*++args) {
+				usage(*argv);
+				return -1;
+			}
+
+			is_profile = true;
+			collapsed = *args;
+		}
+		else if (!strcmp(*args, "--bench")) {
+			if (!*++args) {
+				usage(*argv);
+				return -1;
+			}
+
+			bench = *args;
+		}
+		else if (!strcmp(*args, "--iterations")) {
+			if (!*++args || !parse_size(*args, iterations)) {
+				usage(*argv);
+				return -1;
+			}
+		}
+		else if (!strcmp(*args, "--format")) {
+			if (!*++args) {
+				usage(*argv);
+				return -1;
+			}
+
+			if (!strcmp(*args, "csv"))
+				format = CAM::Bench::format_csv;
+			else if (!strcmp(*args, "json"))
+				format = CAM::Bench::format_json;
+			else {
+				usage(*argv);
+				return -1;
+			}
+		}
+		else if (!strcmp(*args, "--parallel")) {
+			is_parallel = true;
+		}
+		else if (!strcmp(*args, "--fork-cost")) {
+			if (!*++args || !parse_size(*args, fork_cost)) {
+				usage(*argv);
+				return -1;
+			}
+		}
+		else if (!strcmp(*args, "--memo")) {
+			is_memo = true;
+		}
+		else if (!strcmp(*args, "--memo-size")) {
+			if (!*++args || !parse_size(*args, memo_size)) {
+				usage(*argv);
+				return -1;
+			}
+		}
+		else if (!strcmp(*args, "--compile-only")) {
+			if (!*++args) {
+				usage(*argv);
+				return -1;
+			}
+
+			compiled = *args;
+		}
+		else if (!strcmp(*args, "--emit-cpp")) {
+			if (!*++args) {
+				usage(*argv);
+				return -1;
+			}
+
+			translated = *args;
+		}
+		else if (!strcmp(*args, "--image")) {
+			if (!*++args) {
+				usage(*argv);
+				return -1;
+			}
+
+			image = *args;
+		}
+		else if (!strcmp(*args, "--snapshot")) {
+			if (!*++args) {
+				usage(*argv);
+				return -1;
+			}
+
+			snapshot = *args;
+		}
+		else if (!strcmp(*args, "--snapshot-every")) {
+			if (!*++args || !parse_size(*args, snapshot_every)) {
+				usage(*argv);
+				return -1;
+			}
+		}
+		else if (!strcmp(*args, "--resume")) {
+			if (!*++args) {
+				usage(*argv);
+				return -1;
+			}
+
+			resume = *args;
+		}
+		else if (!strcmp(*args, "--batch")) {
+			if (!*++args) {
+				usage(*argv);
+				return -1;
+			}
+
+			batch = *args;
+		}
+		else if (!strcmp(*args, "--threads")) {
+			if (!*++args || !parse_size(*args, threads)) {
+				usage(*argv);
+				return -1;
+			}
+		}
+		else if (!strcmp(*args, "--server")) {
+			if (!*++args) {
+				usage(*argv);
+				return -1;
+			}
+
+			server = *args;
+		}
+		else if (!strcmp(*args, "--cache-size")) {
+			if (!*++args || !parse_size(*args, cache_size)) {
+				usage(*argv);
+				return -1;
+			}
+		}
+		else if (!strcmp(*args, "--client")) {
+			if (!*++args) {
+				usage(*argv);
+				return -1;
+			}
+
+			try {
+				return CAM::Server::client(*args, std::cin, std::cout) ? 0 : -1;
+			}
+			catch (CAM::CAMException &e) {
+				std::cerr << e.what() << std::endl;
+				return -1;
+			}
+		}
+		else if (!strcmp(*args, "--print-trace")) {
+			if (!*++args) {
+				usage(*argv);
+				return -1;
+			}
+
+			try {
+				CAM::Trace::print(*args);
+			}
+			catch (CAM::CAMException &e) {
+				std::cerr << e.what() << std::endl;
+				return -1;
+			}
+			return 0;
+		}
 		else {
 			if (find_code) {
 				usage(*argv);
@@ -59,12 +434,90 @@ int main(int argc, char **argv)
 		args++;
 	}
 
-	if (!find_code) {
+	cam.set_limits(limits);
+	cam.set_printer(CAM::Printer(print_depth, print_width, is_print_shared));
+
+	if (!bench.empty()) {
+		try {
+			return CAM::Bench(cam, iterations, format).run(bench, std::cout) ? 0 : -1;
+		}
+		catch (CAM::CAMException &e) {
+			std::cerr << e.what() << std::endl;
+			return -1;
+		}
+	}
+
+	if (!batch.empty()) {
+		try {
+			return CAM::Batch(cam, threads).run(batch, std::cout) ? 0 : -1;
+		}
+		catch (CAM::CAMException &e) {
+			std::cerr << e.what() << std::endl;
+			return -1;
+		}
+	}
+
+	if (!server.empty()) {
+		try {
+			CAM::Server(cam, server, cache_size).run();
+		}
+		catch (CAM::CAMException &e) {
+			std::cerr << e.what() << std::endl;
+			return -1;
+		}
+		return 0;
+	}
+
+	if (find_code + !image.empty() + !resume.empty() != 1 || ((!compiled.empty() || !translated.empty()) && !find_code) ||
+		(!snapshot.empty() && (is_parallel || is_memo))) {
 		usage(*argv);
 		return -1;
 	}
 
-	cam.run(code);
+	if (!translated.empty()) {
+		try {
+			cam.translate(code, translated);
+		}
+		catch (CAM::CAMException &e) {
+			std::cerr << e.what() << std::endl;
+			return -1;
+		}
+		return 0;
+	}
+
+	if (is_parallel)
+		cam.set_parallel(threads, fork_cost);
+	if (is_memo)
+		cam.set_memo(memo_size);
+
+	if (!compiled.empty()) {
+		try {
+			cam.compile(code, compiled);
+		}
+		catch (CAM::CAMException &e) {
+			std::cerr << e.what() << std::endl;
+			return -1;
+		}
+		return 0;
+	}
+
+	if (!trace.empty())
+		cam.set_trace(trace, trace_last, trace_every);
+	if (is_profile)
+		cam.set_profile(collapsed);
+	if (!snapshot.empty()) {
+		cam.set_snapshot(snapshot, snapshot_every);
+#ifdef SIGUSR1
+		signal(SIGUSR1, request_snapshot);
+#endif
+	}
+
+	if (!image.empty())
+		cam.run_image(image);
+	else if (!resume.empty())
+		cam.resume(resume);
+	else
+		cam.run(code);
 
 	return 0;
 }
\ No newline at end of file
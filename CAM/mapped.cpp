@@ -0,0 +1,82 @@
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "mapped.h"
+#include "CAM.h"
+
+namespace CAM
+{
+#ifdef _WIN32
+	MappedFile::MappedFile(const std::string &path) : _data(nullptr), _size(0), _file(INVALID_HANDLE_VALUE), _mapping(nullptr) {
+		_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (_file == INVALID_HANDLE_VALUE)
+			throw CAMException("Cannot read file: " + path);
+
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(_file, &size)) {
+			CloseHandle(_file);
+			throw CAMException("Cannot read file: " + path);
+		}
+		_size = static_cast<size_t>(size.QuadPart);
+
+		// empty files cannot be mapped
+		if (_size == 0)
+			return;
+
+		_mapping = CreateFileMappingA(_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (_mapping)
+			_data = static_cast<const char*>(MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0));
+		if (!_data) {
+			if (_mapping)
+				CloseHandle(_mapping);
+			CloseHandle(_file);
+			throw CAMException("Cannot map file: " + path);
+		}
+	}
+
+	MappedFile::~MappedFile() {
+		if (_data)
+			UnmapViewOfFile(_data);
+		if (_mapping)
+			CloseHandle(_mapping);
+		CloseHandle(_file);
+	}
+#else
+	MappedFile::MappedFile(const std::string &path) : _data(nullptr), _size(0), _fd(-1) {
+		_fd = open(path.c_str(), O_RDONLY);
+		if (_fd < 0)
+			throw CAMException("Cannot read file: " + path);
+
+		struct stat st;
+		if (fstat(_fd, &st) < 0) {
+			close(_fd);
+			throw CAMException("Cannot read file: " + path);
+		}
+		_size = static_cast<size_t>(st.st_size);
+
+		// empty files cannot be mapped
+		if (_size == 0)
+			return;
+
+		void *data = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, _fd, 0);
+		if (data == MAP_FAILED) {
+			close(_fd);
+			throw CAMException("Cannot map file: " + path);
+		}
+		_data = static_cast<const char*>(data);
+	}
+
+	MappedFile::~MappedFile() {
+		if (_data)
+			munmap(const_cast<char*>(_data), _size);
+		close(_fd);
+	}
+#endif
+}
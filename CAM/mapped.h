@@ -0,0 +1,31 @@
+#pragma once
+
+#include <string>
+
+namespace CAM
+{
+	// Read only view of a whole file mapped into memory. The pages are read
+	// on demand and shared with the page cache, nothing is copied.
+	class MappedFile
+	{
+		const char *_data;
+		size_t _size;
+#ifdef _WIN32
+		void *_file;
+		void *_mapping;
+#else
+		int _fd;
+#endif
+
+		MappedFile(const MappedFile&);
+		MappedFile& operator=(const MappedFile&);
+
+	public:
+		// Throws CAMException if the file cannot be mapped
+		MappedFile(const std::string &path);
+		~MappedFile();
+
+		const char* data() const { return _data; }
+		size_t size() const { return _size; }
+	};
+}
@@ -0,0 +1,204 @@
+#include "memo.h"
+
+namespace CAM
+{
+	size_t Memo::NodeHash::operator()(const Node &n) const {
+		size_t h = std::hash<int64_t>()(n.a);
+		h ^= std::hash<int64_t>()(n.b) + 0x9e3779b9 + (h << 6) + (h >> 2);
+		return h ^ n.kind;
+	}
+
+	Memo::Memo(size_t capacity) : _capacity(capacity) {}
+
+	Memo::find_t Memo::find(const Value &closure, const Value &arg, Value &result, Heap &heap) {
+		collect();
+
+		size_t cells = max_cells;
+		size_t c = intern(closure, cells);
+		size_t a = c == npos ? npos : intern(arg, cells);
+		if (a == npos)
+			return find_uncached;
+
+		size_t key = intern(Node(Value::kind_pair, c, a));
+		auto it = _entries.find(key);
+		if (it == _entries.end()) {
+			++_stats.misses;
+			_pending.push_back(key);
+			return find_miss;
+		}
+
+		++_stats.hits;
+		_lru.splice(_lru.begin(), _lru, it->second);
+
+		size_t id = it->second->second;
+		std::unordered_set<size_t> seen;
+		heap.reserve(size_of(id, seen));
+
+		std::unordered_map<size_t, Value> made;
+		result = make(id, heap, made);
+		return find_hit;
+	}
+
+	void Memo::store(const Value &result) {
+		size_t key = _pending.back();
+		_pending.pop_back();
+
+		size_t cells = max_cells;
+		size_t id = key == npos ? npos : intern(result, cells);
+		if (id == npos)
+			return;
+
+		// the same application may finish twice if it was pending twice
+		auto it = _entries.find(key);
+		if (it != _entries.end()) {
+			_lru.splice(_lru.begin(), _lru, it->second);
+			return;
+		}
+
+		_lru.push_front(std::make_pair(key, id));
+		_entries[key] = _lru.begin();
+
+		if (_entries.size() > _capacity) {
+			_entries.erase(_lru.back().first);
+			_lru.pop_back();
+			++_stats.evictions;
+		}
+	}
+
+	void Memo::clear() {
+		_nodes.clear();
+		_ids.clear();
+		_numbers.clear();
+		_number_ids.clear();
+		_lru.clear();
+		_entries.clear();
+		_pending.clear();
+		_stats = Stats();
+	}
+
+	size_t Memo::intern(const Value &v, size_t &cells) {
+		if (v.is_boxed()) {
+			if (cells == 0)
+				return npos;
+			--cells;
+		}
+
+		switch (v.kind()) {
+		case Value::kind_fixnum:
+			return intern(Node(Value::kind_fixnum, v.fixnum()));
+		case Value::kind_bignum: {
+			mpz_class number = v.number();
+			auto it = _number_ids.find(number);
+			if (it == _number_ids.end()) {
+				it = _number_ids.insert(std::make_pair(number, _numbers.size())).first;
+				_numbers.push_back(number);
+			}
+			return intern(Node(Value::kind_bignum, it->second));
+		}
+		// a flat environment is the same as the nested pairs it replaces
+		case Value::kind_pair:
+		case Value::kind_env: {
+			size_t first = intern(v.first(), cells);
+			size_t second = first == npos ? npos : intern(v.second(), cells);
+			if (second == npos)
+				return npos;
+			return intern(Node(Value::kind_pair, first, second));
+		}
+		case Value::kind_closure: {
+			size_t env = intern(v.env(), cells);
+			if (env == npos)
+				return npos;
+			return intern(Node(Value::kind_closure, v.entry(), env));
+		}
+		// (env, closure) points back to the closure, only env is kept
+		case Value::kind_rec: {
+			size_t env = intern(v.env().first(), cells);
+			if (env == npos)
+				return npos;
+			return intern(Node(Value::kind_rec, v.entry(), env));
+		}
+		default:
+			return intern(Node(Value::kind_unit));
+		}
+	}
+
+	size_t Memo::intern(const Node &n) {
+		auto it = _ids.find(n);
+		if (it != _ids.end())
+			return it->second;
+
+		_nodes.push_back(n);
+		_ids[n] = _nodes.size() - 1;
+		return _nodes.size() - 1;
+	}
+
+	Value Memo::make(size_t id, Heap &heap, std::unordered_map<size_t, Value> &made) const {
+		const Node &n = _nodes[id];
+		switch (n.kind) {
+		case Value::kind_unit:
+			return Value::make();
+		case Value::kind_fixnum:
+			return Value::make_fixnum(n.a);
+		default:
+			break;
+		}
+
+		auto it = made.find(id);
+		if (it != made.end())
+			return it->second;
+
+		Value v;
+		switch (n.kind) {
+		case Value::kind_bignum:
+			v = heap.make_number(_numbers[n.a]);
+			break;
+		case Value::kind_pair: {
+			Value first = make(n.a, heap, made);
+			v = heap.make_pair(first, make(n.b, heap, made));
+			break;
+		}
+		case Value::kind_closure:
+			v = heap.make_closure(n.a, make(n.b, heap, made));
+			break;
+		default:
+			v = heap.make_rec(n.a, make(n.b, heap, made));
+			break;
+		}
+
+		made[id] = v;
+		return v;
+	}
+
+	size_t Memo::size_of(size_t id, std::unordered_set<size_t> &seen) const {
+		const Node &n = _nodes[id];
+		if (n.kind == Value::kind_unit || n.kind == Value::kind_fixnum || !seen.insert(id).second)
+			return 0;
+
+		switch (n.kind) {
+		case Value::kind_bignum:
+			return Heap::number_size;
+		case Value::kind_pair:
+			return Heap::pair_size + size_of(n.a, seen) + size_of(n.b, seen);
+		case Value::kind_closure:
+			return Heap::closure_size + size_of(n.b, seen);
+		default:
+			return Heap::rec_size + size_of(n.b, seen);
+		}
+	}
+
+	void Memo::collect() {
+		if (_nodes.size() <= _capacity * max_nodes)
+			return;
+
+		_stats.evictions += _entries.size();
+		_nodes.clear();
+		_ids.clear();
+		_numbers.clear();
+		_number_ids.clear();
+		_lru.clear();
+		_entries.clear();
+		// their keys are gone, the results are not stored
+		for (auto it = _pending.begin(); it != _pending.end(); ++it)
+			*it = npos;
+	}
+}
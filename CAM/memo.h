@@ -0,0 +1,116 @@
+#pragma once
+
+#include <vector>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "value.h"
+#include "heap.h"
+
+namespace CAM
+{
+	// Cache of the results of applications. Bodies are pure, so a closure
+	// applied to an equal argument always gives an equal result.
+	//
+	// Keys and results are hash-consed: every distinct structure of numbers,
+	// pairs and closures is one node, equal values get the same id, so a key
+	// is hashed and compared in constant time once it is built. The least
+	// recently used entries are evicted beyond the capacity; the nodes are
+	// dropped together with all entries when they outgrow it.
+	class Memo
+	{
+	public:
+		static const size_t default_capacity = 1 << 16;
+		// Cells of a key or of a result, larger values are not cached
+		static const size_t max_cells = 1024;
+		// Nodes per entry of the capacity before all of them are dropped
+		static const size_t max_nodes = 64;
+
+		enum find_t
+		{
+			find_hit,		// the result is cached
+			find_miss,		// the application is pending, see store
+			find_uncached	// the closure or the argument is too large
+		};
+
+		struct Stats
+		{
+			size_t hits;
+			size_t misses;
+			size_t evictions;
+
+			Stats() : hits(0), misses(0), evictions(0) {}
+		};
+
+		Memo(size_t capacity = default_capacity);
+
+		// Result of the closure applied to arg, built in the heap on a hit.
+		// The cells of the heap may move.
+		find_t find(const Value &closure, const Value &arg, Value &result, Heap &heap);
+
+		// Caches the result of the innermost pending application
+		void store(const Value &result);
+
+		// Drops the entries, the nodes and the pending applications
+		void clear();
+
+		size_t size() const { return _entries.size(); }
+		size_t capacity() const { return _capacity; }
+
+		const Stats& stats() const { return _stats; }
+
+	private:
+		static const size_t npos = static_cast<size_t>(-1);
+
+		// pair, env: ids of the components; fixnum: the number; bignum: index
+		// of the number; closure, rec: entry and id of the environment
+		struct Node
+		{
+			Value::kind_t kind;
+			int64_t a;
+			int64_t b;
+
+			Node(Value::kind_t kind, int64_t a = 0, int64_t b = 0) : kind(kind), a(a), b(b) {}
+
+			bool operator==(const Node &n) const { return kind == n.kind && a == n.a && b == n.b; }
+		};
+
+		struct NodeHash
+		{
+			size_t operator()(const Node &n) const;
+		};
+
+		typedef std::list<std::pair<size_t, size_t> > lru_t;
+
+		size_t _capacity;
+
+		std::vector<Node> _nodes;
+		std::unordered_map<Node, size_t, NodeHash> _ids;
+		std::vector<mpz_class> _numbers;
+		std::map<mpz_class, size_t> _number_ids;
+
+		// key and result, the most recently used first
+		lru_t _lru;
+		std::unordered_map<size_t, lru_t::iterator> _entries;
+		// keys of the applications in progress, npos if the nodes were dropped
+		std::vector<size_t> _pending;
+
+		Stats _stats;
+
+		// Id of the value, npos if it has more cells than are left
+		size_t intern(const Value &v, size_t &cells);
+
+		size_t intern(const Node &n);
+
+		// Value of the node built in the heap, the nodes are built once
+		Value make(size_t id, Heap &heap, std::unordered_map<size_t, Value> &made) const;
+
+		// Bytes of the cells of the node and of those below it
+		size_t size_of(size_t id, std::unordered_set<size_t> &seen) const;
+
+		// Drops the nodes if they outgrew the capacity
+		void collect();
+	};
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstdint>
+#include <climits>
+
+#include "gmpxx.h"
+
+namespace CAM
+{
+	// Helpers for numbers which fit into int64_t (fixnums). Arithmetic reports
+	// overflow instead of wrapping, the caller then retries with mpz_class.
+	namespace Number
+	{
+		inline bool add_overflow(int64_t a, int64_t b, int64_t &r) {
+#if defined(__GNUC__)
+			return __builtin_add_overflow(a, b, &r);
+#else
+			if ((b > 0 && a > INT64_MAX - b) || (b < 0 && a < INT64_MIN - b))
+				return true;
+			r = a + b;
+			return false;
+#endif
+		}
+
+		inline bool sub_overflow(int64_t a, int64_t b, int64_t &r) {
+#if defined(__GNUC__)
+			return __builtin_sub_overflow(a, b, &r);
+#else
+			if ((b < 0 && a > INT64_MAX + b) || (b > 0 && a < INT64_MIN + b))
+				return true;
+			r = a - b;
+			return false;
+#endif
+		}
+
+		inline bool mul_overflow(int64_t a, int64_t b, int64_t &r) {
+#if defined(__GNUC__)
+			return __builtin_mul_overflow(a, b, &r);
+#else
+			if (a > 0) {
+				if ((b > 0 && a > INT64_MAX / b) || (b < 0 && b < INT64_MIN / a))
+					return true;
+			}
+			else if (a < 0) {
+				if ((b > 0 && a < INT64_MIN / b) || (b < 0 && a < INT64_MAX / b))
+					return true;
+			}
+			r = a * b;
+			return false;
+#endif
+		}
+
+		// long is 32 bits wide on Windows, so values are split into halves there
+		inline mpz_class to_mpz(int64_t v) {
+			if (v >= LONG_MIN && v <= LONG_MAX)
+				return mpz_class(static_cast<long>(v));
+
+			mpz_class r(static_cast<long>(v >> 32));
+			r <<= 32;
+			r += static_cast<unsigned long>(v & 0xffffffff);
+			return r;
+		}
+
+		inline bool to_int64(const mpz_class &v, int64_t &r) {
+			if (v.fits_slong_p()) {
+				r = v.get_si();
+				return true;
+			}
+
+			if (sizeof(long) >= sizeof(int64_t) || mpz_sizeinbase(v.get_mpz_t(), 2) > 63)
+				return false;
+
+			mpz_class a = abs(v);
+			mpz_class hi = a >> 32;
+			mpz_class lo = a - (hi << 32);
+			int64_t u = static_cast<int64_t>((static_cast<uint64_t>(hi.get_ui()) << 32) | lo.get_ui());
+			r = sgn(v) < 0 ? -u : u;
+			return true;
+		}
+	}
+}
@@ -0,0 +1,168 @@
+#include <cctype>
+
+#include "parser.h"
+#include "CAM.h"
+
+namespace CAM
+{
+	CodeTerm::code_t Parser::parse() {
+		match_parentheses();
+
+		CodeTerm::code_t code;
+		_pos = 0;
+		parse_block(_s.length(), code);
+
+		return code;
+	}
+
+	void Parser::match_parentheses() {
+		std::vector<size_t> open;
+		_match.assign(_s.length(), std::string::npos);
+
+		for (size_t i = 0; i < _s.length(); i++) {
+			if (_s[i] == '(')
+				open.push_back(i);
+			else if (_s[i] == ')') {
+				if (open.empty())
+					error("unmatched ')'", i);
+
+				_match[open.back()] = i;
+				open.pop_back();
+			}
+		}
+
+		if (!open.empty())
+			error("unclosed '('", open.back());
+	}
+
+	void Parser::parse_block(size_t end, CodeTerm::code_t &code) {
+		const op_parser_t *parsers = op_parsers();
+
+		for (;;) {
+			skip_spaces(end);
+			if (_pos >= end)
+				return;
+
+			(this->*parsers[static_cast<unsigned char>(_s[_pos])])(end, code);
+		}
+	}
+
+	void Parser::undef(size_t end, CodeTerm::code_t &code) {
+		error(std::string("unexpected '") + _s[_pos] + '\'', _pos);
+	}
+
+	void Parser::default_parser(size_t end, CodeTerm::code_t &code) {
+		code.push_back(CodeTerm::make(_s[_pos]));
+		++_pos;
+	}
+
+	void Parser::un_op_parser(size_t end, CodeTerm::code_t &code) {
+		char op = _s[_pos++];
+		size_t close = open(end);
+
+		auto args = CodeTermWithArgs::args_t(1);
+		parse_block(close, args[0]);
+		_pos = close + 1;
+
+		code.push_back(CodeTermWithArgs::make(op, args));
+	}
+
+	void Parser::quote_op_parser(size_t end, CodeTerm::code_t &code) {
+		++_pos;
+		size_t close = open(end);
+
+		std::string arg = _s.substr(_pos, close - _pos);
+		mpz_class number;
+		if (number.set_str(arg, 0) != 0)
+			error("invalid number '" + arg + '\'', _pos);
+		_pos = close + 1;
+
+		code.push_back(QuoteCodeTerm::make(arg));
+	}
+
+	void Parser::bin_op_parser(size_t end, CodeTerm::code_t &code) {
+		char op = _s[_pos++];
+		size_t close = open(end);
+		auto args = CodeTermWithArgs::args_t(2);
+
+		size_t arg_close = open(close);
+		parse_block(arg_close, args[0]);
+		_pos = arg_close + 1;
+
+		expect(',', close);
+
+		arg_close = open(close);
+		parse_block(arg_close, args[1]);
+		_pos = arg_close + 1;
+
+		skip_spaces(close);
+		if (_pos != close)
+			error("expected ')'", _pos);
+		_pos = close + 1;
+
+		code.push_back(CodeTermWithArgs::make(op, args));
+	}
+
+	size_t Parser::open(size_t end) {
+		expect('(', end);
+		return _match[_pos - 1];
+	}
+
+	void Parser::expect(char c, size_t end) {
+		skip_spaces(end);
+		if (_pos >= end || _s[_pos] != c)
+			error(std::string("expected '") + c + '\'', _pos);
+		++_pos;
+	}
+
+	void Parser::skip_spaces(size_t end) {
+		while (_pos < end && isspace(static_cast<unsigned char>(_s[_pos])))
+			++_pos;
+	}
+
+	void Parser::error(const std::string &what, size_t offset) const {
+		size_t line = 1;
+		size_t line_begin = 0;
+		for (size_t i = 0; i < offset && i < _s.length(); i++) {
+			if (_s[i] == '\n') {
+				++line;
+				line_begin = i + 1;
+			}
+		}
+
+		throw InvalidCodeException(what, offset, line, offset - line_begin + 1);
+	}
+
+	const Parser::op_parser_t* Parser::op_parsers() {
+		struct Table
+		{
+			op_parser_t parsers[256];
+
+			Table() {
+				for (size_t i = 0; i < sizeof(parsers) / sizeof(*parsers); i++)
+					parsers[i] = &Parser::undef;
+
+				parsers['F'] = &Parser::default_parser;
+				parsers['S'] = &Parser::default_parser;
+				parsers['<'] = &Parser::default_parser;
+				parsers[','] = &Parser::default_parser;
+				parsers['>'] = &Parser::default_parser;
+				parsers['e'] = &Parser::default_parser;
+
+				parsers['+'] = &Parser::default_parser;
+				parsers['-'] = &Parser::default_parser;
+				parsers['='] = &Parser::default_parser;
+				parsers['*'] = &Parser::default_parser;
+
+				parsers['\\'] = &Parser::un_op_parser;
+				parsers['\''] = &Parser::quote_op_parser;
+				parsers['Y'] = &Parser::un_op_parser;
+
+				parsers['b'] = &Parser::bin_op_parser;
+			}
+		};
+
+		static const Table table;
+		return table.parsers;
+	}
+}
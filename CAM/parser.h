@@ -0,0 +1,50 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "code.h"
+
+namespace CAM
+{
+	// Single pass parser of the CAM code. The matching parenthesis of every
+	// '(' is found once before parsing, so the arguments of '\\', 'Y', '\'' and
+	// 'b' are parsed in place without copying or rescanning the text.
+	// Whitespace is allowed between instructions.
+	class Parser
+	{
+		typedef void (Parser::*op_parser_t)(size_t end, CodeTerm::code_t &code);
+
+		const std::string &_s;
+		size_t _pos;
+		// offset of the matching ')' for every '('
+		std::vector<size_t> _match;
+
+	public:
+		Parser(const std::string &s) : _s(s), _pos(0) {}
+
+		CodeTerm::code_t parse();
+
+	private:
+		void match_parentheses();
+
+		void parse_block(size_t end, CodeTerm::code_t &code);
+
+		void undef(size_t end, CodeTerm::code_t &code);
+		void default_parser(size_t end, CodeTerm::code_t &code);
+		void un_op_parser(size_t end, CodeTerm::code_t &code);
+		void quote_op_parser(size_t end, CodeTerm::code_t &code);
+		void bin_op_parser(size_t end, CodeTerm::code_t &code);
+
+		// Skips '(' and returns the offset of the matching ')'
+		size_t open(size_t end);
+
+		void expect(char c, size_t end);
+
+		void skip_spaces(size_t end);
+
+		void error(const std::string &what, size_t offset) const;
+
+		static const op_parser_t* op_parsers();
+	};
+}
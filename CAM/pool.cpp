@@ -0,0 +1,164 @@
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "pool.h"
+
+namespace CAM
+{
+	namespace
+	{
+		// Pool and queue of the worker running in this thread
+		thread_local const Pool *current_pool = nullptr;
+		thread_local size_t current_queue = 0;
+	}
+
+	bool Pool::Task::try_run() {
+		int pending = state_pending;
+		if (!_state.compare_exchange_strong(pending, state_running))
+			return false;
+
+		execute();
+
+		std::lock_guard<std::mutex> lock(_mutex);
+		_state = state_done;
+		_done.notify_all();
+		return true;
+	}
+
+	bool Pool::Task::join() {
+		if (try_run())
+			return true;
+
+		std::unique_lock<std::mutex> lock(_mutex);
+		_done.wait(lock, [this] { return _state == state_done; });
+		return false;
+	}
+
+	void Pool::Task::cancel() {
+		int pending = state_pending;
+		_state.compare_exchange_strong(pending, state_done);
+	}
+
+	Pool::Pool(size_t threads) : _pending(0), _is_stopped(false) {
+		if (threads == 0)
+			threads = std::thread::hardware_concurrency();
+		if (threads == 0)
+			threads = 1;
+
+		for (size_t i = 0; i <= threads; i++)
+			_queues.push_back(std::unique_ptr<Queue>(new Queue()));
+		for (size_t i = 0; i < threads; i++)
+			_workers.push_back(std::thread(&Pool::work, this, i));
+	}
+
+	Pool::~Pool() {
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_is_stopped = true;
+		}
+		_wake.notify_all();
+
+		for (auto it = _workers.begin(); it != _workers.end(); ++it)
+			it->join();
+	}
+
+	void Pool::push(const task_ptr &task) {
+		{
+			Queue &q = *_queues[queue()];
+			std::lock_guard<std::mutex> lock(q.mutex);
+			q.tasks.push_back(task);
+		}
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			++_pending;
+		}
+		_wake.notify_one();
+
+		std::lock_guard<std::mutex> lock(_stats_mutex);
+		++_stats.tasks;
+	}
+
+	Pool::Stats Pool::stats() {
+		std::lock_guard<std::mutex> lock(_stats_mutex);
+		return _stats;
+	}
+
+	void Pool::reset_stats() {
+		std::lock_guard<std::mutex> lock(_stats_mutex);
+		_stats = Stats();
+	}
+
+	void Pool::work(size_t worker) {
+		current_pool = this;
+		current_queue = worker;
+
+		for (;;) {
+			task_ptr task = take(worker);
+			if (task) {
+				double begin = cpu_time();
+				if (task->try_run()) {
+					double time = cpu_time() - begin;
+
+					std::lock_guard<std::mutex> lock(_stats_mutex);
+					++_stats.stolen;
+					_stats.work += time;
+				}
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lock(_mutex);
+			_wake.wait(lock, [this] { return _is_stopped || _pending > 0; });
+			if (_is_stopped)
+				return;
+		}
+	}
+
+	Pool::task_ptr Pool::take(size_t worker) {
+		task_ptr task;
+		{
+			Queue &own = *_queues[worker];
+			std::lock_guard<std::mutex> lock(own.mutex);
+			if (!own.tasks.empty()) {
+				task = own.tasks.back();
+				own.tasks.pop_back();
+			}
+		}
+
+		for (size_t i = 1; !task && i < _queues.size(); i++) {
+			Queue &other = *_queues[(worker + i) % _queues.size()];
+			std::lock_guard<std::mutex> lock(other.mutex);
+			if (!other.tasks.empty()) {
+				task = other.tasks.front();
+				other.tasks.pop_front();
+			}
+		}
+
+		if (task)
+			--_pending;
+		return task;
+	}
+
+	double Pool::cpu_time() {
+#ifdef _WIN32
+		FILETIME creation, exit, kernel, user;
+		if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user))
+			return 0;
+		// 100 ns units
+		return ((static_cast<uint64_t>(user.dwHighDateTime) << 32 | user.dwLowDateTime) +
+			(static_cast<uint64_t>(kernel.dwHighDateTime) << 32 | kernel.dwLowDateTime)) / 1e7;
+#else
+		timespec ts;
+		if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+			return 0;
+		return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+	}
+
+	size_t Pool::queue() const {
+		return current_pool == this ? current_queue : _workers.size();
+	}
+}
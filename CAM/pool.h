@@ -0,0 +1,113 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+namespace CAM
+{
+	// Work stealing pool of the fork tasks. A task pushed by a worker goes to
+	// the back of its own queue, the worker takes its newest task first and
+	// an idle worker steals the oldest task of another queue. Tasks pushed by
+	// other threads go to a queue of their own.
+	class Pool
+	{
+	public:
+		class Task
+		{
+			enum state_t
+			{
+				state_pending,
+				state_running,
+				state_done
+			};
+
+			std::atomic<int> _state;
+			std::mutex _mutex;
+			std::condition_variable _done;
+
+		public:
+			Task() : _state(state_pending) {}
+
+			virtual ~Task() {}
+
+			// Runs the task unless it was taken already
+			bool try_run();
+
+			// Runs the task in this thread if nobody took it, waits for its
+			// end otherwise. Returns true if it ran here.
+			bool join();
+
+			// The task will not run
+			void cancel();
+
+		protected:
+			virtual void execute() = 0;
+		};
+
+		typedef std::shared_ptr<Task> task_ptr;
+
+		struct Stats
+		{
+			size_t tasks;
+			// run by the workers, not by the thread which joined them
+			size_t stolen;
+			// CPU seconds of the tasks run by the workers
+			double work;
+
+			Stats() : tasks(0), stolen(0), work(0) {}
+		};
+
+		// 0 threads: one per hardware thread
+		Pool(size_t threads = 0);
+		~Pool();
+
+		void push(const task_ptr &task);
+
+		// Tasks pushed and not taken yet
+		size_t pending() const { return _pending; }
+
+		size_t threads() const { return _workers.size(); }
+
+		Stats stats();
+
+		void reset_stats();
+
+		// CPU seconds used by the calling thread, waits are not counted
+		static double cpu_time();
+
+	private:
+		struct Queue
+		{
+			std::mutex mutex;
+			std::deque<task_ptr> tasks;
+		};
+
+		std::vector<std::thread> _workers;
+		// one per worker and the last one for the other threads
+		std::vector<std::unique_ptr<Queue> > _queues;
+		std::atomic<size_t> _pending;
+		bool _is_stopped;
+
+		std::mutex _mutex;
+		std::condition_variable _wake;
+
+		std::mutex _stats_mutex;
+		Stats _stats;
+
+		Pool(const Pool&);
+		Pool& operator=(const Pool&);
+
+		void work(size_t worker);
+
+		// Newest task of the own queue or the oldest of another one
+		task_ptr take(size_t worker);
+
+		// Queue of the calling thread
+		size_t queue() const;
+	};
+}
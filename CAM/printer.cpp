@@ -0,0 +1,249 @@
+#include <sstream>
+#include <vector>
+#include <unordered_map>
+
+#include "printer.h"
+
+namespace CAM
+{
+	namespace
+	{
+		enum shape_t
+		{
+			shape_leaf,
+			shape_pair,
+			shape_closure,
+			shape_rec
+		};
+
+		// Identity of a composite subterm: the address of its cell or node and
+		// the position of an environment view in the cell
+		struct Key
+		{
+			uintptr_t address;
+			uint32_t offset;
+
+			Key(uintptr_t address, uint32_t offset = 0) : address(address), offset(offset) {}
+
+			bool operator==(const Key &k) const { return address == k.address && offset == k.offset; }
+		};
+
+		struct KeyHash
+		{
+			size_t operator()(const Key &k) const { return std::hash<uintptr_t>()(k.address) ^ (static_cast<size_t>(k.offset) * 0x9e3779b9u); }
+		};
+
+		// References found by the first pass, then the number of the label once
+		// it is printed
+		struct Label
+		{
+			size_t references;
+			size_t number;
+
+			Label() : references(1), number(0) {}
+		};
+
+		typedef std::unordered_map<Key, Label, KeyHash> labels_t;
+
+		class ValueNode
+		{
+			Value _value;
+			const Program *_program;
+
+		public:
+			ValueNode(const Value &value, const Program *program) : _value(value), _program(program) {}
+
+			shape_t shape() const {
+				switch (_value.kind()) {
+				case Value::kind_pair:
+				case Value::kind_env:
+					return shape_pair;
+				case Value::kind_closure:
+					return shape_closure;
+				case Value::kind_rec:
+					return shape_rec;
+				default:
+					return shape_leaf;
+				}
+			}
+
+			ValueNode first() const { return ValueNode(_value.first(), _program); }
+			ValueNode second() const { return ValueNode(_value.second(), _program); }
+
+			// env() of kind_rec is the cycle (env, closure), only env is printed
+			ValueNode env() const { return ValueNode(_value.is_rec() ? _value.env().first() : _value.env(), _program); }
+
+			Key key() const { return Key(static_cast<uintptr_t>(_value.id()), _value.offset()); }
+
+			void write_leaf(std::ostream &os) const {
+				if (_value.is_fixnum())
+					os << _value.fixnum();
+				else if (_value.is_number())
+					os << _value.number().get_str();
+				else
+					os << "()";
+			}
+
+			void write_code(std::ostream &os) const { _program->write(os, _value.entry()); }
+		};
+
+		// Terms are pairs, numbers and (), so env and write_code are never used
+		class TermNode
+		{
+			const Term *_term;
+
+			const TermPair& pair() const { return *static_cast<const TermPair*>(_term); }
+
+		public:
+			TermNode(const Term *term) : _term(term) {}
+
+			shape_t shape() const { return dynamic_cast<const TermPair*>(_term) ? shape_pair : shape_leaf; }
+
+			TermNode first() const { return TermNode(pair().first().get()); }
+			TermNode second() const { return TermNode(pair().second().get()); }
+			TermNode env() const { return *this; }
+
+			Key key() const { return Key(reinterpret_cast<uintptr_t>(_term)); }
+
+			void write_leaf(std::ostream &os) const {
+				if (auto number = dynamic_cast<const QuoteTerm*>(_term))
+					os << number->value().get_str();
+				else
+					os << "()";
+			}
+
+			void write_code(std::ostream &os) const {}
+		};
+
+		// Subterm with its depth and its place in a chain of pairs, or the text
+		// to print if the text is not nullptr
+		template <class node_t>
+		struct Item
+		{
+			node_t node;
+			const char *text;
+			size_t depth;
+			size_t width;
+
+			Item(const node_t &node, size_t depth, size_t width) : node(node), text(nullptr), depth(depth), width(width) {}
+			Item(const node_t &node, const char *text) : node(node), text(text), depth(0), width(0) {}
+		};
+	}
+
+	template <class node_t>
+	void Printer::write(std::ostream &os, const node_t &root) const {
+		std::vector<Item<node_t> > todo;
+		labels_t labels;
+
+		// The first pass counts the references to every subterm. It walks the
+		// term in the order of the printing and cuts it at the same places, so
+		// the first reference it finds is the one printed with the label.
+		if (_is_shared) {
+			todo.push_back(Item<node_t>(root, 0, 0));
+			while (!todo.empty()) {
+				Item<node_t> t = todo.back();
+				todo.pop_back();
+
+				shape_t shape = t.node.shape();
+				if (shape == shape_leaf || is_cut(shape == shape_pair, t.depth, t.width))
+					continue;
+
+				auto inserted = labels.insert(std::make_pair(t.node.key(), Label()));
+				if (!inserted.second) {
+					++inserted.first->second.references;
+					continue;
+				}
+
+				if (shape == shape_pair) {
+					todo.push_back(Item<node_t>(t.node.second(), t.depth + 1, t.width + 1));
+					todo.push_back(Item<node_t>(t.node.first(), t.depth + 1, 0));
+				}
+				else
+					todo.push_back(Item<node_t>(t.node.env(), t.depth + 1, 0));
+			}
+		}
+
+		size_t label = 0;
+		todo.push_back(Item<node_t>(root, 0, 0));
+		while (!todo.empty()) {
+			Item<node_t> t = todo.back();
+			todo.pop_back();
+			if (t.text) {
+				os << t.text;
+				continue;
+			}
+
+			shape_t shape = t.node.shape();
+			if (shape == shape_leaf) {
+				t.node.write_leaf(os);
+				continue;
+			}
+			if (is_cut(shape == shape_pair, t.depth, t.width)) {
+				os << "...";
+				continue;
+			}
+
+			if (_is_shared) {
+				Label &l = labels.find(t.node.key())->second;
+				if (l.number) {
+					os << '#' << l.number << '#';
+					continue;
+				}
+				if (l.references > 1) {
+					l.number = ++label;
+					os << '#' << l.number << '=';
+				}
+			}
+
+			switch (shape) {
+			case shape_pair:
+				os << '(';
+				todo.push_back(Item<node_t>(t.node, ")"));
+				todo.push_back(Item<node_t>(t.node.second(), t.depth + 1, t.width + 1));
+				todo.push_back(Item<node_t>(t.node, ", "));
+				todo.push_back(Item<node_t>(t.node.first(), t.depth + 1, 0));
+				break;
+			case shape_closure:
+				t.node.write_code(os);
+				os << ": ";
+				todo.push_back(Item<node_t>(t.node.env(), t.depth + 1, 0));
+				break;
+			default:
+				t.node.write_code(os);
+				os << ": (";
+				todo.push_back(Item<node_t>(t.node, ", rec)"));
+				todo.push_back(Item<node_t>(t.node.env(), t.depth + 1, 0));
+				break;
+			}
+		}
+	}
+
+	void Printer::print(std::ostream &os, const Value &value, const Program *program) const {
+		write(os, ValueNode(value, program));
+	}
+
+	void Printer::print(std::ostream &os, const Term &term) const {
+		write(os, TermNode(&term));
+	}
+
+	std::string Printer::to_string(const Value &value, const Program *program) const {
+		std::ostringstream ossteam;
+		print(ossteam, value, program);
+		return ossteam.str();
+	}
+
+	std::string Printer::to_string(const Term &term) const {
+		std::ostringstream ossteam;
+		print(ossteam, term);
+		return ossteam.str();
+	}
+
+	std::string Term::to_string() const {
+		return Printer().to_string(*this);
+	}
+
+	std::ostream& operator<<(std::ostream &os, const Term &t) {
+		Printer().print(os, t);
+		return os;
+	}
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <ostream>
+#include <string>
+
+#include "value.h"
+
+namespace CAM
+{
+	// Prints values of the machine and terms as pairs (s, t), numbers and
+	// closures C: s or C: (s, rec) straight to a stream. The subterms still to
+	// print are kept on a stack of the printer instead of the native one, so
+	// a term of any depth is printed in time linear in the output.
+	//
+	// Subterms nested deeper than max_depth, on either side of their pairs,
+	// and the pairs of a chain (s, (t, ...)) past the first max_width of them
+	// are printed as "...". With is_shared, a subterm reached more than once,
+	// a cell of the heap or a node of the term, is printed the first time as
+	// #n=s and as #n# later, so a term with shared parts is not printed as
+	// the tree it unfolds to.
+	class Printer
+	{
+		size_t _max_depth;
+		size_t _max_width;
+		bool _is_shared;
+
+	public:
+		// 0: no limit
+		Printer(size_t max_depth = 0, size_t max_width = 0, bool is_shared = false) :
+			_max_depth(max_depth), _max_width(max_width), _is_shared(is_shared) {}
+
+		size_t max_depth() const { return _max_depth; }
+		size_t max_width() const { return _max_width; }
+		bool shared() const { return _is_shared; }
+
+		// Closures are printed with the code of the program they belong to
+		void print(std::ostream &os, const Value &value, const Program *program) const;
+		void print(std::ostream &os, const Term &term) const;
+
+		std::string to_string(const Value &value, const Program *program) const;
+		std::string to_string(const Term &term) const;
+
+	private:
+		template <class node_t>
+		void write(std::ostream &os, const node_t &root) const;
+
+		// Is the composite subterm printed as "..."
+		bool is_cut(bool is_pair, size_t depth, size_t width) const {
+			return (_max_depth && depth >= _max_depth) || (is_pair && _max_width && width >= _max_width);
+		}
+	};
+}
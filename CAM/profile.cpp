@@ -0,0 +1,184 @@
+#include <algorithm>
+#include <iomanip>
+
+#include "profile.h"
+
+namespace CAM
+{
+	static const char *kind_names[] = { "unit", "fixnum", "pair", "bignum", "closure", "rec", "env" };
+
+	Profile::Profile() : _program(nullptr), _op(Program::op_ret) {
+		std::fill(_allocations, _allocations + Value::kind_env + 1, 0);
+	}
+
+	void Profile::begin(const Program &program) {
+		_program = &program;
+
+		std::fill(_opcodes, _opcodes + Program::op_count, Opcode());
+		std::fill(_allocations, _allocations + Value::kind_env + 1, 0);
+		_closures.clear();
+		_children.clear();
+		_frames.clear();
+
+		Node root = { 0, 0, 0 };
+		_nodes.assign(1, root);
+
+		_op = Program::op_ret;
+		_time = clock_t::now();
+		_heap = Heap::Stats();
+	}
+
+	void Profile::step(size_t pc, const Value &term, size_t depth, size_t steps, const Heap::Stats &heap) {
+		clock_t::time_point now = clock_t::now();
+		if (_op != Program::op_ret) {
+			_opcodes[_op].time += std::chrono::duration<double>(now - _time).count();
+			allocated(heap);
+		}
+		// the input term is allocated before the first step
+		_heap = heap;
+		_time = now;
+
+		leave(depth + 1, steps);
+
+		const Program::Instruction &i = _program->at(pc);
+		_op = i.op;
+		++_opcodes[_op].count;
+		++_nodes[_frames.empty() ? 0 : _frames.back().node].steps;
+
+		// 'e' of an invalid term fails in the transition, not here
+		if (_op == Program::op_app && term.is_pair() && term.first().is_closure())
+			call(term.first().entry(), _program->is_tail_call(pc) ? depth : depth + 1, steps);
+		else if (_op == Program::op_call)
+			call(i.arg2, _program->is_tail_call(pc) ? depth : depth + 1, steps);
+	}
+
+	void Profile::end(const Heap::Stats &heap, size_t steps) {
+		if (_op != Program::op_ret) {
+			_opcodes[_op].time += std::chrono::duration<double>(clock_t::now() - _time).count();
+			// a failed step may have allocated before it failed
+			allocated(heap);
+			_op = Program::op_ret;
+		}
+
+		leave(0, steps);
+	}
+
+	void Profile::call(size_t entry, size_t depth, size_t steps) {
+		// a tail call replaces the body running at the same depth
+		leave(depth, steps);
+
+		size_t parent = _frames.empty() ? 0 : _frames.back().node;
+		size_t node = parent;
+		if (_frames.empty() || _frames.back().entry != entry) {
+			auto it = _children.find(std::make_pair(parent, entry));
+			if (it == _children.end()) {
+				Node n = { entry, parent, 0 };
+				node = _nodes.size();
+				_nodes.push_back(n);
+				_children[std::make_pair(parent, entry)] = node;
+			}
+			else
+				node = it->second;
+		}
+
+		Closure &c = _closures[entry];
+		++c.calls;
+		++c.active;
+
+		Frame f = { entry, node, depth, steps };
+		_frames.push_back(f);
+	}
+
+	void Profile::leave(size_t depth, size_t steps) {
+		while (!_frames.empty() && _frames.back().depth >= depth) {
+			Frame &f = _frames.back();
+			Closure &c = _closures[f.entry];
+			if (--c.active == 0)
+				c.inclusive += steps - f.begin;
+			_frames.pop_back();
+		}
+	}
+
+	void Profile::allocated(const Heap::Stats &heap) {
+		for (size_t kind = Value::kind_pair; kind <= Value::kind_env; kind++) {
+			_allocations[kind] += heap.cells[kind] - _heap.cells[kind];
+			_opcodes[_op].bytes += heap.bytes[kind] - _heap.bytes[kind];
+		}
+	}
+
+	std::string Profile::name(size_t entry) const {
+		for (size_t pc = 0; pc < _program->size(); pc++) {
+			const Program::Instruction &i = _program->at(pc);
+			if ((i.op == Program::op_cur || i.op == Program::op_save) && i.arg == entry)
+				return "\\@" + std::to_string(entry);
+			if (i.op == Program::op_rec && i.arg == entry)
+				return "Y@" + std::to_string(entry);
+		}
+		return '@' + std::to_string(entry);
+	}
+
+	void Profile::print(std::ostream &os) const {
+		if (!_program)
+			return;
+
+		std::vector<size_t> ops;
+		for (size_t op = 0; op < Program::op_count; op++) {
+			if (_opcodes[op].count)
+				ops.push_back(op);
+		}
+		std::sort(ops.begin(), ops.end(), [this](size_t a, size_t b) {
+			return _opcodes[a].time > _opcodes[b].time;
+		});
+
+		os << "profile:" << std::endl;
+		os << std::left << std::setw(12) << "opcode" << std::right << std::setw(14) << "count" << std::setw(14) << "time" << std::setw(14) << "bytes" << std::endl;
+		for (auto it = ops.begin(); it != ops.end(); ++it) {
+			Program::op_t op = static_cast<Program::op_t>(*it);
+			os << std::left << std::setw(12) << (Program::op_char(op) ? std::string(1, Program::op_char(op)) : Program::op_name(op))
+				<< std::right << std::setw(14) << _opcodes[*it].count << std::setw(14) << _opcodes[*it].time
+				<< std::setw(14) << _opcodes[*it].bytes << std::endl;
+		}
+
+		std::vector<std::pair<size_t, Closure> > closures(_closures.begin(), _closures.end());
+		std::sort(closures.begin(), closures.end(), [](const std::pair<size_t, Closure> &a, const std::pair<size_t, Closure> &b) {
+			return a.second.inclusive > b.second.inclusive;
+		});
+
+		if (!closures.empty()) {
+			os << std::left << std::setw(12) << "closure" << std::right << std::setw(14) << "calls" << std::setw(14) << "inclusive"
+				<< "  code" << std::endl;
+			for (auto it = closures.begin(); it != closures.end(); ++it) {
+				os << std::left << std::setw(12) << name(it->first)
+					<< std::right << std::setw(14) << it->second.calls << std::setw(14) << it->second.inclusive
+					<< "  " << _program->to_string(it->first) << std::endl;
+			}
+		}
+
+		os << "allocations:";
+		for (size_t kind = Value::kind_pair; kind <= Value::kind_env; kind++)
+			os << ' ' << kind_names[kind] << ' ' << _allocations[kind];
+		size_t bytes = 0;
+		for (size_t op = 0; op < Program::op_count; op++)
+			bytes += _opcodes[op].bytes;
+		os << " bytes " << bytes << std::endl;
+	}
+
+	void Profile::write_collapsed(std::ostream &os) const {
+		if (!_program)
+			return;
+
+		for (size_t n = 0; n < _nodes.size(); n++) {
+			if (!_nodes[n].steps)
+				continue;
+
+			std::vector<size_t> path;
+			for (size_t i = n; i != 0; i = _nodes[i].parent)
+				path.push_back(_nodes[i].entry);
+
+			os << "main";
+			for (auto it = path.rbegin(); it != path.rend(); ++it)
+				os << ';' << name(*it);
+			os << ' ' << _nodes[n].steps << std::endl;
+		}
+	}
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <ostream>
+
+#include "program.h"
+#include "value.h"
+#include "heap.h"
+
+namespace CAM
+{
+	// Profile of a run collected by observing the machine before every step:
+	// counts and time of the opcodes, calls and inclusive steps of the bodies
+	// of '\' and 'Y', and allocations by kind. The time of a step is the time
+	// until the next observation, so it includes the cost of profiling itself.
+	// The cells allocated by a step are read from the statistics of the heap,
+	// so they are the cells its transition actually made.
+	class Profile
+	{
+	public:
+		Profile();
+
+		void begin(const Program &program);
+
+		// State before the step: its pc, the term, the depth of the return
+		// frames and the heap; steps is the number of the steps done
+		void step(size_t pc, const Value &term, size_t depth, size_t steps, const Heap::Stats &heap);
+
+		void end(const Heap::Stats &heap, size_t steps);
+
+		// Report sorted by time, calls and count
+		void print(std::ostream &os) const;
+
+		// Collapsed stacks of the bodies with the steps done in them, the input
+		// of the flame graph tools
+		void write_collapsed(std::ostream &os) const;
+
+	private:
+		typedef std::chrono::steady_clock clock_t;
+
+		struct Opcode
+		{
+			size_t count;
+			double time;
+			size_t bytes;	// allocated
+
+			Opcode() : count(0), time(0), bytes(0) {}
+		};
+
+		struct Closure
+		{
+			size_t calls;
+			size_t inclusive;
+			// activations on the stack, only the outermost one adds its steps
+			size_t active;
+
+			Closure() : calls(0), inclusive(0), active(0) {}
+		};
+
+		// Node of the tree of stacks; direct recursion stays in the same node
+		struct Node
+		{
+			size_t entry;
+			size_t parent;
+			size_t steps;
+		};
+
+		struct Frame
+		{
+			size_t entry;
+			size_t node;
+			size_t depth;
+			size_t begin;
+		};
+
+		const Program *_program;
+
+		Opcode _opcodes[Program::op_count];
+		std::map<size_t, Closure> _closures;
+		size_t _allocations[Value::kind_env + 1];
+		// statistics of the heap at the last observation
+		Heap::Stats _heap;
+
+		std::vector<Node> _nodes;
+		std::map<std::pair<size_t, size_t>, size_t> _children;
+		std::vector<Frame> _frames;
+
+		Program::op_t _op;
+		clock_t::time_point _time;
+
+		void call(size_t entry, size_t depth, size_t steps);
+
+		// Pops the bodies running at depth or deeper
+		void leave(size_t depth, size_t steps);
+
+		// Counts the cells made by the previous step since the last observation
+		void allocated(const Heap::Stats &heap);
+
+		std::string name(size_t entry) const;
+	};
+}
@@ -0,0 +1,563 @@
+#include <map>
+
+#include "program.h"
+#include "number.h"
+#include "CAM.h"
+
+namespace CAM
+{
+	const char Program::_op_chars[] = {
+		'F', 'S', '<', ',', '>', 'e', '\\', '\'', 'b', 'Y', '+', '-', '*', '=',
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+		'<', ',', 0, 'j', 'r'
+	};
+
+	const char *Program::_op_names[] = {
+		"fst", "snd", "push", "swap", "cons", "app", "cur", "quote", "branch", "rec", "add", "sub", "mul", "eq",
+		"path", "acc", "pair", "pair_quote", "add_quote", "sub_quote", "mul_quote", "eq_quote",
+		"add_pair", "sub_pair", "mul_pair", "eq_pair", "save", "call",
+		"fork", "join", "memo", "jump", "ret"
+	};
+
+	Program::Literal::Literal(const std::string &text) : text(text), is_fixnum(false), fixnum(0) {
+		if (number.set_str(text, 0) != 0)
+			throw InvalidCodeException('\'' + text);
+
+		is_fixnum = Number::to_int64(number, fixnum);
+	}
+
+	Program::Program() : _instructions(nullptr), _size(0), _forks(0), _memo(no_memo), _is_optimized(false), _is_typed(false) {}
+
+	Program::Program(const CodeTerm::code_t &code, bool is_optimize, bool is_trim, size_t fork_cost, bool is_memo) :
+		_instructions(nullptr), _size(0), _forks(0), _memo(no_memo), _is_optimized(is_optimize), _is_typed(false) {
+		std::vector<std::pair<size_t, const CodeTerm::code_t*> > bodies;
+
+		compile(code, bodies);
+		_code.push_back(Instruction(op_ret));
+
+		for (size_t i = 0; i < bodies.size(); i++) {
+			_code[bodies[i].first].arg = _code.size();
+			compile(*bodies[i].second, bodies);
+			_code.push_back(Instruction(op_ret));
+		}
+
+		if (is_trim)
+			analyze();
+		if (fork_cost)
+			fork(fork_cost);
+		if (is_optimize)
+			optimize();
+
+		if (is_memo) {
+			_memo = _code.size();
+			_code.push_back(Instruction(op_memo));
+			_code.push_back(Instruction(op_ret));
+		}
+
+		for (size_t pc = 0; pc < _code.size(); pc++) {
+			if (_code[pc].op == op_app || _code[pc].op == op_call)
+				_code[pc].arg = follow(pc + 1);
+		}
+
+		_instructions = _code.data();
+		_size = _code.size();
+		check();
+	}
+
+	// Sequences (P - chain of F and S, possibly empty; n - fixnum literal):
+	//   F...FS         -> acc, the variable of a flat environment is read at once
+	//   FS...          -> path
+	//   <P,P>          -> pair, with + - * = after it -> add_pair ...
+	//   <P,'n>         -> pair_quote, with + - * = after it -> add_quote ...
+	//   <\(B),A>e      -> save A call, the closure of B is never built
+	// A sequence is fused only if no jump lands inside of it.
+	void Program::optimize() {
+		std::vector<bool> targets(_code.size(), false);
+		targets[0] = true;
+		for (auto it = _code.begin(); it != _code.end(); ++it) {
+			if (it->op == op_branch || it->op == op_jump || it->op == op_cur || it->op == op_rec)
+				targets[it->arg] = true;
+		}
+
+		auto is_free = [&targets](size_t begin, size_t end) {
+			for (size_t pc = begin + 1; pc < end; pc++) {
+				if (targets[pc])
+					return false;
+			}
+			return true;
+		};
+
+		code_t code;
+		std::vector<size_t> offsets(_code.size());
+		// '>' of the direct applications and the entries of their bodies
+		std::map<size_t, size_t> calls;
+
+		for (size_t pc = 0; pc < _code.size(); ) {
+			const Instruction &i = _code[pc];
+			Instruction fused = i;
+			size_t end = pc + 1;
+
+			auto call = calls.find(pc);
+			if (call != calls.end()) {
+				fused = Instruction(op_call, 0, call->second);
+				end = pc + 2;
+			}
+			else if (i.op == op_push) {
+				size_t first, second;
+				size_t swap = read_path(pc + 1, first);
+
+				if (_code[swap].op == op_swap) {
+					const Instruction &next = _code[swap + 1];
+					size_t cons;
+
+					if (next.op == op_quote && _literals[next.arg].is_fixnum && _code[swap + 2].op == op_cons) {
+						fused = Instruction(op_pair_quote, first, next.arg);
+						end = swap + 3;
+						if (is_operation(_code[end].op))
+							fused.op = static_cast<op_t>(op_add_quote + _code[end++].op - op_add);
+					}
+					else if (_code[cons = read_path(swap + 1, second)].op == op_cons) {
+						fused = Instruction(op_pair, first, second);
+						end = cons + 1;
+						if (is_operation(_code[end].op))
+							fused.op = static_cast<op_t>(op_add_pair + _code[end++].op - op_add);
+					}
+				}
+				else if (_code[pc + 1].op == op_cur && _code[pc + 2].op == op_swap) {
+					size_t cons = match(pc);
+					if (cons != std::string::npos && _code[cons + 1].op == op_app && is_free(cons, cons + 2)) {
+						fused = Instruction(op_save, _code[pc + 1].arg);
+						end = pc + 3;
+					}
+				}
+			}
+			else if (i.op == op_fst || i.op == op_snd) {
+				size_t path;
+				size_t next = read_path(pc, path);
+				if (next - pc > 1) {
+					fused = Instruction(op_path, path);
+					end = next;
+
+					size_t n = next - pc - 1;
+					if (path == variable_path(n))
+						fused = Instruction(op_acc, n);
+				}
+			}
+
+			if (!is_free(pc, end)) {
+				fused = i;
+				end = pc + 1;
+			}
+			else if (fused.op == op_save)
+				calls[match(pc)] = fused.arg;
+
+			offsets[pc] = code.size();
+			code.push_back(fused);
+			pc = end;
+		}
+
+		for (auto it = code.begin(); it != code.end(); ++it) {
+			switch (it->op) {
+			case op_branch:
+			case op_jump:
+			case op_cur:
+			case op_rec:
+			case op_save:
+				it->arg = offsets[it->arg];
+				break;
+			case op_call:
+				it->arg2 = offsets[it->arg2];
+				break;
+			case op_fork:
+				it->arg = offsets[it->arg];
+				it->arg2 = offsets[it->arg2];
+				break;
+			case op_join:
+				it->arg = offsets[it->arg];
+				break;
+			default:
+				break;
+			}
+		}
+
+		_code.swap(code);
+	}
+
+	// Both sides must be costly, otherwise the task costs more than it saves
+	void Program::fork(size_t cost) {
+		for (size_t pc = 0; pc < _code.size(); pc++) {
+			size_t swap;
+			size_t cons = split(pc, swap);
+			if (cons == std::string::npos || this->cost(pc + 1, swap) < cost || this->cost(swap + 1, cons) < cost)
+				continue;
+
+			_code[pc] = Instruction(op_fork, swap, cons);
+			_code[swap] = Instruction(op_join, cons);
+			++_forks;
+		}
+	}
+
+	size_t Program::cost(size_t begin, size_t end) const {
+		size_t cost = 0;
+		for (size_t pc = begin; pc < end; pc++)
+			cost += _code[pc].op == op_app ? call_cost : 1;
+		return cost;
+	}
+
+	size_t Program::read_path(size_t pc, size_t &path) const {
+		size_t length = 0;
+		std::vector<bool> steps;
+		while (length < max_path && (_code[pc].op == op_fst || _code[pc].op == op_snd)) {
+			steps.push_back(_code[pc].op == op_snd);
+			++length;
+			++pc;
+		}
+
+		path = empty_path;
+		for (auto it = steps.rbegin(); it != steps.rend(); ++it)
+			path = (path << 1) | (*it ? 1 : 0);
+		return pc;
+	}
+
+	size_t Program::match(size_t pc) const {
+		size_t depth = 0;
+		for (++pc; _code[pc].op != op_ret; pc++) {
+			if (_code[pc].op == op_push || _code[pc].op == op_fork)
+				++depth;
+			else if (_code[pc].op == op_cons) {
+				if (depth == 0)
+					return pc;
+				--depth;
+			}
+		}
+		return std::string::npos;
+	}
+
+	size_t Program::split(size_t pc, size_t &swap) const {
+		if (_code[pc].op != op_push)
+			return std::string::npos;
+
+		size_t begin = pc;
+		swap = std::string::npos;
+		size_t depth = 0;
+		for (++pc; ; ) {
+			const Instruction &i = _code[pc];
+			switch (i.op) {
+			case op_push:
+				++depth;
+				break;
+			case op_swap:
+				if (depth == 0) {
+					if (swap != std::string::npos)
+						return std::string::npos;
+					swap = pc;
+				}
+				break;
+			case op_cons:
+				if (depth > 0) {
+					--depth;
+					break;
+				}
+				if (swap == std::string::npos || !is_balanced(begin + 1, swap) || !is_balanced(swap + 1, pc))
+					return std::string::npos;
+				return pc;
+			case op_branch:
+				// takes the top of the stack, which may be the term of '<'
+				if (depth == 0)
+					return std::string::npos;
+				--depth;
+				pc = _code[i.arg - 1].arg;
+				continue;
+			case op_jump:
+			case op_ret:
+				return std::string::npos;
+			default:
+				break;
+			}
+			++pc;
+		}
+	}
+
+	bool Program::is_balanced(size_t begin, size_t end) const {
+		size_t depth = 0;
+		for (size_t pc = begin; pc < end; ) {
+			const Instruction &i = _code[pc];
+			switch (i.op) {
+			case op_push:
+				++depth;
+				break;
+			case op_swap:
+				if (depth == 0)
+					return false;
+				break;
+			case op_cons:
+				if (depth == 0)
+					return false;
+				--depth;
+				break;
+			case op_branch: {
+				if (depth == 0)
+					return false;
+				--depth;
+				size_t join = _code[i.arg - 1].arg;
+				if (!is_balanced(pc + 1, i.arg - 1) || !is_balanced(i.arg, join))
+					return false;
+				pc = join;
+				continue;
+			}
+			case op_jump:
+			case op_ret:
+				return false;
+			default:
+				break;
+			}
+			++pc;
+		}
+		return depth == 0;
+	}
+
+	size_t Program::follow(size_t pc) const {
+		while (_code[pc].op == op_jump)
+			pc = _code[pc].arg;
+		return pc;
+	}
+
+	void Program::compile(const CodeTerm::code_t &code, std::vector<std::pair<size_t, const CodeTerm::code_t*> > &bodies) {
+		for (auto it = code.begin(); it != code.end(); ++it) {
+			char op = (*it)->op();
+
+			if (op == '\\' || op == 'Y') {
+				auto c = std::dynamic_pointer_cast<CodeTermWithArgs>(*it);
+				bodies.push_back(std::make_pair(_code.size(), &c->get_arg(0)));
+				_code.push_back(Instruction(op == 'Y' ? op_rec : op_cur, 0, no_capture));
+			}
+			else if (op == 'b') {
+				auto c = std::dynamic_pointer_cast<CodeTermWithArgs>(*it);
+				size_t branch = _code.size();
+				_code.push_back(Instruction(op_branch));
+				compile(c->get_arg(0), bodies);
+
+				size_t jump = _code.size();
+				_code.push_back(Instruction(op_jump));
+				_code[branch].arg = _code.size();
+				compile(c->get_arg(1), bodies);
+				_code[jump].arg = _code.size();
+			}
+			else if (op == '\'') {
+				auto c = std::dynamic_pointer_cast<QuoteCodeTerm>(*it);
+				_code.push_back(Instruction(op_quote, _literals.size()));
+				_literals.push_back(Literal(c->get_arg()));
+			}
+			else
+				_code.push_back(Instruction(opcode(op)));
+		}
+	}
+
+	Program::op_t Program::opcode(char c) {
+		for (size_t op = 0; op < op_count; op++) {
+			if (_op_chars[op] == c)
+				return static_cast<op_t>(op);
+		}
+
+		throw std::invalid_argument(std::string(1, c));
+	}
+
+	void Program::write(std::ostream &os, size_t pc) const {
+		for (;;) {
+			const Instruction &i = at(pc);
+			if (i.op == op_ret)
+				return;
+
+			if (i.op == op_jump)
+				pc = i.arg;
+			else
+				pc = write_instruction(os, pc);
+		}
+	}
+
+	void Program::write_range(std::ostream &os, size_t begin, size_t end) const {
+		size_t pc = begin;
+		while (pc < end)
+			pc = write_instruction(os, pc);
+	}
+
+	size_t Program::write_instruction(std::ostream &os, size_t pc) const {
+		const Instruction &i = at(pc);
+		switch (i.op) {
+		case op_branch: {
+			size_t end = at(i.arg - 1).arg;
+			os << "b(";
+			write_range(os, pc + 1, i.arg - 1);
+			os << ", ";
+			write_range(os, i.arg, end);
+			os << ')';
+			return end;
+		}
+		case op_cur:
+		case op_rec:
+			os << op_char(i.op) << '(';
+			write(os, i.arg);
+			os << ')';
+			break;
+		case op_quote:
+			os << op_char(i.op) << _literals[i.arg].text;
+			break;
+		case op_path:
+			write_path(os, i.arg);
+			break;
+		case op_acc:
+			write_path(os, variable_path(i.arg));
+			break;
+		case op_pair:
+		case op_add_pair:
+		case op_sub_pair:
+		case op_mul_pair:
+		case op_eq_pair:
+			os << '<';
+			write_path(os, i.arg);
+			os << ',';
+			write_path(os, i.arg2);
+			os << '>';
+			if (i.op != op_pair)
+				os << op_char(static_cast<op_t>(op_add + i.op - op_add_pair));
+			break;
+		case op_pair_quote:
+		case op_add_quote:
+		case op_sub_quote:
+		case op_mul_quote:
+		case op_eq_quote:
+			os << '<';
+			write_path(os, i.arg);
+			os << ",'" << _literals[i.arg2].text << '>';
+			if (i.op != op_pair_quote)
+				os << op_char(static_cast<op_t>(op_add + i.op - op_add_quote));
+			break;
+		case op_save:
+			os << "<\\(";
+			write(os, i.arg);
+			os << "),";
+			break;
+		case op_call:
+			os << ">e";
+			break;
+		case op_memo:
+			// not a part of the source
+			break;
+		default:
+			os << op_char(i.op);
+		}
+
+		return pc + 1;
+	}
+
+	void Program::write_path(std::ostream &os, size_t path) const {
+		for (; path != empty_path; path >>= 1)
+			os << op_char((path & 1) ? op_snd : op_fst);
+	}
+
+	void Program::dump(std::ostream &os) const {
+		for (size_t pc = 0; pc < _size; pc++) {
+			const Instruction &i = at(pc);
+			os << pc << '\t' << op_name(i.op);
+
+			switch (i.op) {
+			case op_quote:
+				os << ' ' << _literals[i.arg].text;
+				break;
+			case op_path:
+				os << ' ';
+				write_path(os, i.arg);
+				break;
+			case op_acc:
+				os << ' ' << i.arg;
+				break;
+			case op_pair:
+			case op_add_pair:
+			case op_sub_pair:
+			case op_mul_pair:
+			case op_eq_pair:
+				os << " <";
+				write_path(os, i.arg);
+				os << ',';
+				write_path(os, i.arg2);
+				os << '>';
+				break;
+			case op_pair_quote:
+			case op_add_quote:
+			case op_sub_quote:
+			case op_mul_quote:
+			case op_eq_quote:
+				os << " <";
+				write_path(os, i.arg);
+				os << ",'" << _literals[i.arg2].text << '>';
+				break;
+			case op_call:
+			case op_fork:
+				os << ' ' << i.arg << ' ' << i.arg2;
+				break;
+			case op_join:
+				os << ' ' << i.arg;
+				break;
+			case op_app:
+			case op_cur:
+			case op_rec:
+			case op_branch:
+			case op_save:
+			case op_jump:
+				os << ' ' << i.arg;
+				break;
+			default:
+				break;
+			}
+
+			os << std::endl;
+		}
+
+		if (_is_typed)
+			os << "typed" << std::endl;
+		else
+			os << "not typed: " << _type_error << std::endl;
+	}
+
+	std::string Program::to_string(size_t pc) const {
+		std::ostringstream ossteam;
+		write(ossteam, pc);
+		return ossteam.str();
+	}
+
+	void Continuation::resolve() {
+		for (;;) {
+			if (_pc == _stop && _frames.empty()) {
+				_is_empty = true;
+				return;
+			}
+
+			const Program::Instruction &i = _program.at(_pc);
+			if (i.op == Program::op_jump)
+				_pc = i.arg;
+			else if (i.op == Program::op_ret) {
+				if (_frames.empty()) {
+					_is_empty = true;
+					return;
+				}
+
+				_pc = _frames.back();
+				_frames.pop_back();
+			}
+			else
+				return;
+		}
+	}
+
+	std::string Continuation::to_string() const {
+		std::ostringstream ossteam;
+		if (_is_empty)
+			return ossteam.str();
+
+		_program.write(ossteam, _pc);
+		for (auto it = _frames.rbegin(); it != _frames.rend(); ++it)
+			_program.write(ossteam, *it);
+
+		return ossteam.str();
+	}
+}
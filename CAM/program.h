@@ -0,0 +1,355 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include <stdexcept>
+#include <memory>
+
+#include "code.h"
+#include "gmpxx.h"
+
+namespace CAM
+{
+	class MappedFile;
+
+	// Flat representation of the parsed code. All blocks (main code and bodies of
+	// '\', 'Y' and 'b') live in one contiguous instruction vector and refer to
+	// each other by offset, so closures and branches never copy code.
+	//
+	// A compiled program may be saved to an image file and loaded back without
+	// the parser, see image.cpp. The instructions of a loaded image are used
+	// in place in the mapped file when their layout is the native one.
+	class Program
+	{
+	public:
+		// Dense opcodes of the compiled code. The order is shared by the
+		// dispatch tables of the machine.
+		enum op_t
+		{
+			op_fst,		// F
+			op_snd,		// S
+			op_push,	// <
+			op_swap,	// ,
+			op_cons,	// >
+			op_app,		// e
+			op_cur,		// \ (closure)
+			op_quote,	// '
+			op_branch,	// b
+			op_rec,		// Y
+			op_add,		// +
+			op_sub,		// -
+			op_mul,		// *
+			op_eq,		// =
+			// superinstructions of the optimizer, see optimize
+			op_path,		// chain of F and S
+			op_acc,			// F...FS, nth variable of the environment
+			op_pair,		// <P,P>
+			op_pair_quote,	// <P,'n>
+			op_add_quote,	// <P,'n>+
+			op_sub_quote,	// <P,'n>-
+			op_mul_quote,	// <P,'n>*
+			op_eq_quote,	// <P,'n>=
+			op_add_pair,	// <P,P>+
+			op_sub_pair,	// <P,P>-
+			op_mul_pair,	// <P,P>*
+			op_eq_pair,		// <P,P>=
+			op_save,		// <\(...), of a direct application
+			op_call,		// >e of a direct application
+			// parallel '<' and ',' of <A,B>, see fork
+			op_fork,
+			op_join,
+			// stores the result of a memoized application, see Memo
+			op_memo,
+			op_jump,
+			op_ret,
+			op_count
+		};
+
+		struct Instruction
+		{
+			op_t op;
+			// '\', 'Y', save: entry of the body; 'b': offset of the else block;
+			// '\'': index of the literal; 'e', call: return address; jump: target;
+			// path, pair: path of the first component; acc: number of the variable;
+			// fork: offset of its join; join: offset of its '>'
+			size_t arg;
+			// pair: path of the second component; quote: index of the literal;
+			// call: entry of the body; '\', 'Y': capture of the environment;
+			// fork: offset of its '>'
+			size_t arg2;
+
+			Instruction(op_t op, size_t arg = 0, size_t arg2 = 0) : op(op), arg(arg), arg2(arg2) {}
+		};
+
+		// Path of F and S as bits, the first step is the lowest bit (1 - S) and
+		// the highest set bit marks the end
+		static const size_t empty_path = 1;
+		static const size_t max_path = sizeof(size_t) * 8 - 2;
+
+		// Path of the nth variable: n times F, then S
+		static size_t variable_path(size_t n) { return static_cast<size_t>(3) << n; }
+
+		typedef std::vector<Instruction> code_t;
+
+		// Argument of '\'' decoded at compile time
+		struct Literal
+		{
+			std::string text;
+			bool is_fixnum;
+			int64_t fixnum;
+			mpz_class number;
+
+			Literal(const std::string &text);
+
+			// Decoded already, the number is set by the caller
+			Literal(const std::string &text, bool is_fixnum, int64_t fixnum) : text(text), is_fixnum(is_fixnum), fixnum(fixnum) {}
+		};
+
+		// Part of the environment a closure keeps: the paths its body may read,
+		// as a tree of F and S. Components off the tree are replaced by (), a
+		// node marked whole keeps everything below it.
+		struct Capture
+		{
+			struct Node
+			{
+				static const int none = -1;
+
+				int first;
+				int second;
+				bool is_whole;
+			};
+
+			std::vector<Node> nodes;
+			// none: the body never reads the environment
+			int root;
+			// pairs to allocate for the trimmed environment
+			size_t pairs;
+
+			Capture() : root(Node::none), pairs(0) {}
+
+			bool is_all() const { return root != Node::none && nodes[root].is_whole; }
+		};
+
+		static const size_t no_capture = static_cast<size_t>(-1);
+
+		static const size_t no_memo = static_cast<size_t>(-1);
+
+		// Estimated cost of an application in fork, a body runs an unknown
+		// number of steps
+		static const size_t call_cost = 100;
+
+		// The code is optimized by default. With is_trim, closures capture
+		// only what their bodies read, which changes how closures in the
+		// result are printed. With a fork cost, <A,B> where both A and B cost at
+		// least that much are marked for the parallel evaluation. A memoized
+		// program ends with the block its applications return to when their
+		// results are cached.
+		Program(const CodeTerm::code_t &code, bool is_optimize = true, bool is_trim = false, size_t fork_cost = 0, bool is_memo = false);
+
+		// Program of the image file, the source it was compiled from is
+		// stored to source if it is not nullptr. Throws CAMException if the
+		// file is not an image of this version.
+		static std::shared_ptr<const Program> load(const std::string &path, std::string *source = nullptr);
+
+		// Same for the image of size bytes at offset, a multiple of 8, in the
+		// mapped file of path
+		static std::shared_ptr<const Program> load(const std::shared_ptr<MappedFile> &file, size_t offset, size_t size,
+			const std::string &path, std::string *source = nullptr);
+
+		// Writes the image of the program compiled from source to the file
+		void save(const std::string &path, const std::string &source) const;
+
+		// Same to the stream, its length is a multiple of 8
+		void save(std::ostream &os, const std::string &source) const;
+
+		// Source character of the opcode, 0 for the superinstructions
+		static char op_char(op_t op) { return _op_chars[op]; }
+
+		// Name of the opcode in the listing
+		static const char* op_name(op_t op) { return _op_names[op]; }
+
+		const Instruction& at(size_t pc) const { return _instructions[pc]; }
+		size_t size() const { return _size; }
+
+		const Literal& literal(size_t i) const { return _literals[i]; }
+
+		const Capture& capture(size_t i) const { return _captures[i]; }
+
+		// Number of the <A,B> marked for the parallel evaluation
+		size_t forks() const { return _forks; }
+
+		// Offset of the memo block, no_memo if the program is not memoized
+		size_t memo() const { return _memo; }
+
+		// Compiled with superinstructions
+		bool optimized() const { return _is_optimized; }
+
+		// The instructions never meet a term of the wrong shape or an empty
+		// stack when the program starts on (), see check.cpp, so they may run
+		// without their checks
+		bool typed() const { return _is_typed; }
+
+		// Why the program is not typed, empty if it is
+		const std::string& type_error() const { return _type_error; }
+
+		// Skips jumps starting from pc
+		size_t follow(size_t pc) const;
+
+		// Application with nothing left to do in its block after return
+		bool is_tail_call(size_t pc) const { return _instructions[_instructions[pc].arg].op == op_ret; }
+
+		// Writes the code executed starting at pc up to the end of its block
+		void write(std::ostream &os, size_t pc) const;
+
+		std::string to_string(size_t pc) const;
+
+		// Listing of the instructions with their operands
+		void dump(std::ostream &os) const;
+
+	private:
+		static const char _op_chars[op_count];
+		static const char *_op_names[op_count];
+
+		code_t _code;
+		// _code, or the instructions in the mapped image
+		const Instruction *_instructions;
+		size_t _size;
+		std::shared_ptr<MappedFile> _image;
+		std::vector<Literal> _literals;
+		std::vector<Capture> _captures;
+		size_t _forks;
+		size_t _memo;
+		bool _is_optimized;
+		bool _is_typed;
+		std::string _type_error;
+
+		// Empty program, filled by load
+		Program();
+
+		Program(const Program&);
+		Program& operator=(const Program&);
+
+		void compile(const CodeTerm::code_t &code, std::vector<std::pair<size_t, const CodeTerm::code_t*> > &bodies);
+
+		static op_t opcode(char c);
+
+		// Throws InvalidCodeException if the code of a loaded image could not
+		// run, see image.cpp
+		void validate(const std::string &path) const;
+
+		// Finds the captures of '\' and 'Y', see capture.cpp
+		void analyze();
+
+		// Infers the types of the terms and of the stack, see check.cpp
+		void check();
+
+		// Replaces '<' and ',' of the costly <A,B> by fork and join
+		void fork(size_t cost);
+
+		// Estimated steps of the code from begin to end
+		size_t cost(size_t begin, size_t end) const;
+
+		// Replaces the common sequences of instructions by superinstructions
+		void optimize();
+
+		// Reads a chain of F and S at pc into path, returns its end
+		size_t read_path(size_t pc, size_t &path) const;
+
+		// Matching '>' of the '<' at pc, npos if there is none
+		size_t match(size_t pc) const;
+
+		// ',' and '>' of <A,B> at pc where A and B leave the stack as they
+		// find it; '>' is npos if the '<' does not start such a pair
+		size_t split(size_t pc, size_t &swap) const;
+
+		// The code from begin to end never takes more from the stack than it
+		// pushes and leaves it as it was
+		bool is_balanced(size_t begin, size_t end) const;
+
+		static bool is_operation(op_t op) { return op >= op_add && op <= op_eq; }
+
+		void write_path(std::ostream &os, size_t path) const;
+
+		void write_range(std::ostream &os, size_t begin, size_t end) const;
+
+		size_t write_instruction(std::ostream &os, size_t pc) const;
+	};
+
+	// Code which is left to execute: position in the program and the return
+	// stack of the applications in progress. Tail applications do not push a
+	// frame, so tail recursive loops run in constant space.
+	class Continuation
+	{
+	public:
+		typedef std::vector<size_t> frames_t;
+
+	private:
+		static const size_t npos = static_cast<size_t>(-1);
+
+		const Program &_program;
+		size_t _pc;
+		// the code ends at this offset when no frames are left
+		size_t _stop;
+		frames_t _frames;
+		size_t _max_depth;
+		bool _is_empty;
+
+	public:
+		Continuation(const Program &program) : _program(program), _pc(0), _stop(npos), _max_depth(0), _is_empty(false) { resolve(); }
+
+		// Code from pc up to stop in the same block, the right side of a fork
+		Continuation(const Program &program, size_t pc, size_t stop) :
+			_program(program), _pc(pc), _stop(stop), _max_depth(0), _is_empty(false) { resolve(); }
+
+		// Code of a saved run of the whole program, see Machine::save_state
+		Continuation(const Program &program, size_t pc, const frames_t &frames, size_t max_depth) :
+			_program(program), _pc(pc), _stop(npos), _frames(frames), _max_depth(max_depth), _is_empty(false) { resolve(); }
+
+		const Program& program() const { return _program; }
+
+		size_t pc() const { return _pc; }
+
+		const Program::Instruction& current() const { return _program.at(_pc); }
+
+		bool empty() const { return _is_empty; }
+
+		void next() { ++_pc; resolve(); }
+
+		void jump(size_t pc) { _pc = pc; resolve(); }
+
+		// Applies the body at entry from the current 'e'
+		void call(size_t entry) {
+			if (!_program.is_tail_call(_pc))
+				push_frame(_program.at(_pc).arg);
+			jump(entry);
+		}
+
+		// Applies the body at entry from the current 'e', the body returns to
+		// ret first, then ret returns from the application
+		void call(size_t entry, size_t ret) {
+			if (!_program.is_tail_call(_pc))
+				push_frame(_program.at(_pc).arg);
+			push_frame(ret);
+			jump(entry);
+		}
+
+		size_t depth() const { return _frames.size(); }
+		size_t max_depth() const { return _max_depth; }
+		const frames_t& frames() const { return _frames; }
+
+		// Runs the whole program, not the side of a fork
+		bool is_main() const { return _stop == npos; }
+
+		std::string to_string() const;
+
+	private:
+		void push_frame(size_t pc) {
+			_frames.push_back(pc);
+			if (_frames.size() > _max_depth)
+				_max_depth = _frames.size();
+		}
+
+		void resolve();
+	};
+}
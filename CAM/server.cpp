@@ -0,0 +1,312 @@
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <signal.h>
+#include <cerrno>
+#endif
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <thread>
+#include <chrono>
+#include <cstring>
+
+#include "server.h"
+#include "parser.h"
+
+namespace CAM
+{
+	namespace
+	{
+#ifndef _WIN32
+		// Connected socket of the path, -1 and errno if there is none
+		int open_socket(const std::string &path, sockaddr_un &address) {
+			if (path.length() >= sizeof(address.sun_path)) {
+				errno = ENAMETOOLONG;
+				return -1;
+			}
+
+			memset(&address, 0, sizeof(address));
+			address.sun_family = AF_UNIX;
+			memcpy(address.sun_path, path.c_str(), path.length() + 1);
+			return socket(AF_UNIX, SOCK_STREAM, 0);
+		}
+
+		bool write_all(int fd, const std::string &s) {
+			size_t pos = 0;
+			while (pos < s.length()) {
+				ssize_t n = write(fd, s.data() + pos, s.length() - pos);
+				if (n < 0 && errno == EINTR)
+					continue;
+				if (n <= 0)
+					return false;
+				pos += static_cast<size_t>(n);
+			}
+			return true;
+		}
+
+		// Calls f for every complete line read from fd until the end of the
+		// input or until f returns false
+		template <class function_t>
+		void read_lines(int fd, function_t f) {
+			std::string buffer;
+			char chunk[1 << 16];
+
+			for (;;) {
+				ssize_t n = read(fd, chunk, sizeof(chunk));
+				if (n < 0 && errno == EINTR)
+					continue;
+				if (n <= 0)
+					return;
+				buffer.append(chunk, static_cast<size_t>(n));
+
+				size_t begin = 0;
+				for (size_t end; (end = buffer.find('\n', begin)) != std::string::npos; begin = end + 1) {
+					size_t last = end;
+					if (last > begin && buffer[last - 1] == '\r')
+						--last;
+					if (!f(buffer.substr(begin, last - begin), begin + (end + 1 - begin) == buffer.length()))
+						return;
+				}
+				buffer.erase(0, begin);
+			}
+		}
+#endif
+
+		bool starts_with(const std::string &s, size_t pos, const char *prefix) {
+			return s.compare(pos, strlen(prefix), prefix) == 0;
+		}
+	}
+
+	Server::Server(const CAM &cam, const std::string &path, size_t cache_size) :
+		_cam(cam), _path(path), _cache_size(cache_size ? cache_size : 1) {}
+
+	std::string Server::hash(const std::string &code) {
+		// FNV-1a
+		uint64_t h = 14695981039346656037ULL;
+		for (auto it = code.begin(); it != code.end(); ++it) {
+			h ^= static_cast<unsigned char>(*it);
+			h *= 1099511628211ULL;
+		}
+
+		std::ostringstream os;
+		os << std::hex << std::setw(16) << std::setfill('0') << h;
+		return os.str();
+	}
+
+#ifndef _WIN32
+	void Server::run() {
+		sockaddr_un address;
+		int fd = open_socket(_path, address);
+		if (fd < 0)
+			throw CAMException("Cannot make socket: " + _path + ": " + strerror(errno));
+
+		// a server which was stopped leaves its socket file
+		unlink(_path.c_str());
+		if (bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0) {
+			std::string error = strerror(errno);
+			close(fd);
+			throw CAMException("Cannot listen on socket: " + _path + ": " + error);
+		}
+
+		// a client which goes away fails the write instead of the process
+		signal(SIGPIPE, SIG_IGN);
+		std::cerr << "listening on " << _path << std::endl;
+
+		for (;;) {
+			int client = accept(fd, nullptr, nullptr);
+			if (client < 0) {
+				if (errno == EINTR || errno == ECONNABORTED)
+					continue;
+				std::string error = strerror(errno);
+				close(fd);
+				throw CAMException("Cannot accept on socket: " + _path + ": " + error);
+			}
+
+			std::thread(&Server::serve, this, client).detach();
+		}
+	}
+
+	void Server::serve(int client) {
+		// The machine and its heap are reused by all requests of the client
+		Machine machine;
+		machine.set_heap_size(_cam.heap_size());
+		machine.set_limits(_cam.limits());
+		machine.set_unchecked(_cam.unchecked());
+
+		// The results of the requests which came together are sent together
+		std::string results;
+		read_lines(client, [&](const std::string &request, bool is_last) {
+			if (request.find_first_not_of(" \t") != std::string::npos)
+				results += evaluate(request, machine);
+			if (!is_last)
+				return true;
+
+			bool is_sent = write_all(client, results);
+			results.clear();
+			return is_sent;
+		});
+
+		machine.clear();
+		close(client);
+	}
+
+	bool Server::client(const std::string &path, std::istream &is, std::ostream &os) {
+		sockaddr_un address;
+		int fd = open_socket(path, address);
+		if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+			std::string error = strerror(errno);
+			if (fd >= 0)
+				close(fd);
+			throw CAMException("Cannot connect to socket: " + path + ": " + error);
+		}
+
+		signal(SIGPIPE, SIG_IGN);
+
+		// Requests are sent without waiting for the results
+		std::thread sender([fd, &is] {
+			std::string line;
+			while (std::getline(is, line) && write_all(fd, line + '\n'))
+				;
+			shutdown(fd, SHUT_WR);
+		});
+
+		bool is_ok = true;
+		read_lines(fd, [&](const std::string &result, bool is_last) {
+			os << result << '\n';
+			if (starts_with(result, 0, "error\t"))
+				is_ok = false;
+			if (is_last)
+				os.flush();
+			return true;
+		});
+
+		sender.join();
+		close(fd);
+		return is_ok;
+	}
+#else
+	void Server::run() {
+		throw CAMException("Unix domain sockets are not supported");
+	}
+
+	void Server::serve(int client) {}
+
+	bool Server::client(const std::string &path, std::istream &is, std::ostream &os) {
+		throw CAMException("Unix domain sockets are not supported");
+	}
+#endif
+
+	std::string Server::evaluate(const std::string &request, Machine &machine) {
+		Options options;
+		options.dispatch = _cam.dispatch();
+		options.is_optimize = _cam.optimize();
+		options.is_trim = _cam.trim();
+		options.is_flat_env = _cam.flat_env();
+
+		// options up to the code
+		size_t pos = request.find_first_not_of(" \t");
+		for (;;) {
+			size_t end = std::min(request.find_first_of(" \t", pos), request.length());
+			std::string option = request.substr(pos, end - pos);
+			size_t next = request.find_first_not_of(" \t", end);
+			if (next == std::string::npos)
+				break;
+
+			if (option == "--no-optimize")
+				options.is_optimize = false;
+			else if (option == "--trim-env")
+				options.is_trim = true;
+			else if (option == "--pair-env")
+				options.is_flat_env = false;
+			else if (option == "-d" && (starts_with(request, next, "table") || starts_with(request, next, "switch") ||
+				starts_with(request, next, "threaded"))) {
+				options.dispatch = starts_with(request, next, "table") ? Machine::dispatch_table :
+					starts_with(request, next, "switch") ? Machine::dispatch_switch : Machine::dispatch_threaded;
+				next = request.find_first_not_of(" \t", request.find_first_of(" \t", next));
+				if (next == std::string::npos)
+					break;
+			}
+			else
+				break;
+			pos = next;
+		}
+
+		std::string code = request.substr(pos, request.find_last_not_of(" \t") + 1 - pos);
+		bool is_hash = code[0] == '#';
+		std::string h = is_hash ? code.substr(1) : hash(code);
+
+		std::ostringstream os;
+		size_t steps = 0;
+		double time = 0;
+		try {
+			std::shared_ptr<const Program> p = program(is_hash ? std::string() : code, h, options);
+			if (!p)
+				throw CAMException("Unknown program: " + h);
+
+			machine.clear();
+			machine.set_dispatch(options.dispatch);
+			machine.set_flat_env(options.is_flat_env);
+			machine.load(p);
+
+			time_point_t begin = std::chrono::steady_clock::now();
+			try {
+				machine.execute();
+			}
+			catch (CAMException &) {
+				time = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+				steps = machine.steps();
+				throw;
+			}
+			time = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+			steps = machine.steps();
+
+			os << "ok\t" << h << '\t' << steps << '\t' << time << '\t';
+			_cam.printer().print(os, machine.term(), machine.program().get());
+			os << '\n';
+		}
+		catch (CAMException &e) {
+			os << "error\t" << h << '\t' << steps << '\t' << time << '\t' << e.what() << '\n';
+		}
+		return os.str();
+	}
+
+	std::shared_ptr<const Program> Server::program(const std::string &code, const std::string &hash, const Options &options) {
+		std::string key = hash + (options.is_optimize ? "o" : "-") + (options.is_trim ? "t" : "-");
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			auto it = _entries.find(key);
+			if (it != _entries.end() && (code.empty() || it->second->second.code == code)) {
+				_lru.splice(_lru.begin(), _lru, it->second);
+				return it->second->second.program;
+			}
+		}
+
+		if (code.empty())
+			return nullptr;
+
+		// compiled outside of the lock, another thread may compile it too
+		Entry entry;
+		entry.code = code;
+		entry.program = std::make_shared<const Program>(Parser(code).parse(), options.is_optimize, options.is_trim);
+		_cam.check(*entry.program);
+
+		std::lock_guard<std::mutex> lock(_mutex);
+		auto it = _entries.find(key);
+		if (it != _entries.end()) {
+			_lru.erase(it->second);
+			_entries.erase(it);
+		}
+
+		_lru.push_front(std::make_pair(key, entry));
+		_entries[key] = _lru.begin();
+		if (_entries.size() > _cache_size) {
+			_entries.erase(_lru.back().first);
+			_lru.pop_back();
+		}
+		return entry.program;
+	}
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <istream>
+#include <ostream>
+
+#include "CAM.h"
+
+namespace CAM
+{
+	// Evaluates programs for the clients of a Unix domain socket, so a call
+	// does not pay for the start of a process and for the parser. A client
+	// sends requests one per line and may send the next ones before the
+	// results come back; the results come back in order, one per request:
+	//   [-d dispatch] [--no-optimize] [--trim-env] [--pair-env] code
+	//   [-d dispatch] [--no-optimize] [--trim-env] [--pair-env] #hash
+	// and
+	//   ok<TAB>hash<TAB>steps<TAB>seconds<TAB>term
+	//   error<TAB>hash<TAB>steps<TAB>seconds<TAB>message
+	// where hash names the code, later requests may send it instead. The
+	// compiled programs are kept in a cache, the least recently used are
+	// dropped. Every connection is served by its own thread and machine.
+	// Empty lines are skipped.
+	class Server
+	{
+	public:
+		static const size_t default_cache_size = 1024;
+
+		// The options of cam are the defaults of the requests
+		Server(const CAM &cam, const std::string &path, size_t cache_size = default_cache_size);
+
+		// Serves the clients until the process is stopped. Throws
+		// CAMException if the socket cannot be made.
+		void run();
+
+		// Sends the lines of is to the server and writes the results to os.
+		// Returns false if some request failed.
+		static bool client(const std::string &path, std::istream &is, std::ostream &os);
+
+		// Name of the code in the requests
+		static std::string hash(const std::string &code);
+
+	private:
+		struct Options
+		{
+			Machine::dispatch_t dispatch;
+			bool is_optimize;
+			bool is_trim;
+			bool is_flat_env;
+		};
+
+		struct Entry
+		{
+			// the hash of a request may not name its code
+			std::string code;
+			std::shared_ptr<const Program> program;
+		};
+
+		// key and entry, the most recently used first
+		typedef std::list<std::pair<std::string, Entry> > lru_t;
+
+		const CAM &_cam;
+		std::string _path;
+		size_t _cache_size;
+
+		std::mutex _mutex;
+		lru_t _lru;
+		std::unordered_map<std::string, lru_t::iterator> _entries;
+
+		void serve(int client);
+
+		// Result line of the request
+		std::string evaluate(const std::string &request, Machine &machine);
+
+		// Compiled program of the code or of the hash, nullptr if the hash
+		// is not in the cache
+		std::shared_ptr<const Program> program(const std::string &code, const std::string &hash, const Options &options);
+	};
+}
@@ -0,0 +1,483 @@
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+
+#include "snapshot.h"
+#include "mapped.h"
+#include "CAM.h"
+
+namespace CAM
+{
+	// Snapshot in the byte order and with the cell layout of the machine that
+	// wrote it. Every section is a multiple of 8 bytes:
+	//   SnapshotHeader
+	//   image						of the program, see image.cpp
+	//   SnapshotState, frames		written by Machine::save_state
+	//   SnapshotHeap				written by Heap::save
+	//   SnapshotCell, payload		for every cell in the order of the space
+	//   SnapshotValue[]			of the roots, then for every vector of roots
+	//   uint64_t, SnapshotValue[]	its length and values
+	// The values of the cells refer to the cells by their offsets in the
+	// space, so the shared cells and the cycles of 'Y' are written once and
+	// the restored space has the same offsets.
+	namespace
+	{
+		const char magic[8] = { 'C', 'A', 'M', 'S', 'N', 'A', 'P', 'S' };
+		const uint32_t version = 1;
+		const uint32_t byte_order = 0x01020304;
+
+		struct SnapshotHeader
+		{
+			char magic[8];
+			uint32_t version;
+			uint32_t byte_order;
+			uint64_t image;
+			uint64_t state;
+		};
+
+		struct SnapshotState
+		{
+			uint64_t steps;
+			uint64_t pc;
+			uint64_t max_depth;
+			uint64_t frames;
+			// forks of the run which run sequentially
+			uint64_t forks;
+			uint32_t is_flat_env;
+			// the cells are restored at the same offsets
+			uint32_t value_size;
+			uint32_t pair_size;
+			uint32_t number_size;
+			uint32_t closure_size;
+			uint32_t reserved;
+		};
+
+		struct SnapshotHeap
+		{
+			// bytes of the cells in the space
+			uint64_t used;
+			// bytes of the section of the cells
+			uint64_t cells;
+			uint64_t roots;
+			uint64_t root_vectors;
+		};
+
+		struct SnapshotCell
+		{
+			uint32_t kind;
+			// kind_env: the values, kind_bignum: 1 for a negative number
+			uint32_t length;
+			// kind_closure, kind_rec: the entry, kind_bignum: the 64 bit limbs
+			uint64_t entry;
+		};
+
+		struct SnapshotValue
+		{
+			uint32_t kind;
+			uint32_t offset;
+			// fixnum or offset of the cell
+			int64_t data;
+		};
+
+		template <class T>
+		void append(std::string &out, const T &t) { out.append(reinterpret_cast<const char*>(&t), sizeof(T)); }
+
+		// Sections of the snapshot, checked against its end
+		class Reader
+		{
+			const char *_data;
+			size_t _size;
+			size_t _pos;
+
+		public:
+			Reader(const char *data, size_t size) : _data(data), _size(size), _pos(0) {}
+
+			const char* read(size_t size) {
+				if (size > _size - _pos)
+					return nullptr;
+				const char *p = _data + _pos;
+				_pos += size;
+				return p;
+			}
+
+			template <class T>
+			bool read(T *t) {
+				const char *p = read(sizeof(T));
+				if (p)
+					memcpy(t, p, sizeof(T));
+				return p != nullptr;
+			}
+
+			bool is_end() const { return _pos == _size; }
+		};
+	}
+
+	volatile std::sig_atomic_t Snapshot::_is_requested = 0;
+
+	Snapshot::Snapshot(const std::string &path, size_t every) :
+		_path(path), _every(every), _next(every ? every : npos), _is_writing(false), _count(0) {}
+
+	Snapshot::~Snapshot() {
+		if (_writer.joinable())
+			_writer.join();
+	}
+
+	void Snapshot::begin(const Program &program, const std::string &source) {
+		std::ostringstream os;
+		program.save(os, source);
+		_image = os.str();
+		_next = _every ? _every : npos;
+	}
+
+	void Snapshot::take(Machine &machine) {
+		size_t steps = machine.steps();
+		if (steps >= _next)
+			_next = (steps / _every + 1) * _every;
+		if (_is_writing)
+			return;
+
+		std::string buffer;
+		SnapshotHeader h = {};
+		append(buffer, h);
+		buffer += _image;
+		if (!machine.save_state(buffer))
+			return;
+
+		memcpy(h.magic, magic, sizeof(magic));
+		h.version = version;
+		h.byte_order = byte_order;
+		h.image = _image.length();
+		h.state = buffer.length() - sizeof(h) - _image.length();
+		memcpy(&buffer[0], &h, sizeof(h));
+
+		if (_writer.joinable())
+			_writer.join();
+		_is_requested = 0;
+		_is_writing = true;
+		_writer = std::thread(&Snapshot::write, this, std::move(buffer));
+	}
+
+	void Snapshot::wait() {
+		if (_writer.joinable())
+			_writer.join();
+
+		if (!_error.empty()) {
+			std::string error;
+			std::swap(error, _error);
+			throw CAMException(error);
+		}
+	}
+
+	void Snapshot::write(const std::string &buffer) {
+		std::string temp = _path + ".tmp";
+		std::ofstream os(temp.c_str(), std::ios::binary | std::ios::trunc);
+		os.write(buffer.data(), buffer.length());
+		os.close();
+
+#ifdef _WIN32
+		// rename does not replace a file here
+		std::remove(_path.c_str());
+#endif
+		if (!os || std::rename(temp.c_str(), _path.c_str()) != 0)
+			_error = "Cannot write snapshot: " + _path;
+		else
+			++_count;
+		_is_writing = false;
+	}
+
+	std::shared_ptr<const Program> Snapshot::load(const std::string &path, Machine &machine, std::string *source) {
+		std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>(path);
+
+		SnapshotHeader h;
+		Reader reader(file->data(), file->size());
+		if (!reader.read(&h) || memcmp(h.magic, magic, sizeof(magic)) || h.version != version || h.byte_order != byte_order ||
+			h.image > file->size() - sizeof(h) || h.state != file->size() - sizeof(h) - h.image)
+			throw CAMException("Invalid snapshot: " + path);
+
+		std::shared_ptr<const Program> program = Program::load(file, sizeof(h), static_cast<size_t>(h.image), path, source);
+		if (!machine.restore_state(program, file->data() + sizeof(h) + h.image, static_cast<size_t>(h.state)))
+			throw CAMException("Invalid snapshot: " + path);
+		return program;
+	}
+
+	bool Machine::save_state(std::string &out) {
+		if (!_code || _code->empty() || !_code->is_main() || (_memo && _program->memo() != Program::no_memo))
+			return false;
+		for (auto it = _forks.begin(); it != _forks.end(); ++it) {
+			if (*it)
+				return false;
+		}
+
+		SnapshotState s = {};
+		s.steps = _steps;
+		s.pc = _code->pc();
+		s.max_depth = _code->max_depth();
+		s.frames = _code->depth();
+		s.forks = _forks.size();
+		s.is_flat_env = _heap.flat_env();
+		s.value_size = sizeof(Value);
+		s.pair_size = Heap::pair_size;
+		s.number_size = Heap::number_size;
+		s.closure_size = Heap::closure_size;
+		append(out, s);
+
+		const Continuation::frames_t &frames = _code->frames();
+		out.reserve(out.length() + frames.size() * sizeof(uint64_t));
+		for (auto it = frames.begin(); it != frames.end(); ++it)
+			append(out, static_cast<uint64_t>(*it));
+
+		_heap.save(out);
+		return true;
+	}
+
+	bool Machine::restore_state(const std::shared_ptr<const Program> &program, const char *data, size_t size) {
+		clear();
+
+		Reader reader(data, size);
+		SnapshotState s;
+		bool is_valid = reader.read(&s) && s.value_size == sizeof(Value) && s.pair_size == Heap::pair_size &&
+			s.number_size == Heap::number_size && s.closure_size == Heap::closure_size &&
+			s.pc < program->size() && s.frames <= s.max_depth && s.frames <= size / sizeof(uint64_t);
+
+		Continuation::frames_t frames;
+		for (uint64_t i = 0; is_valid && i < s.frames; i++) {
+			uint64_t pc;
+			is_valid = reader.read(&pc) && pc < program->size();
+			if (is_valid)
+				frames.push_back(static_cast<size_t>(pc));
+		}
+
+		if (is_valid) {
+			size_t offset = sizeof(s) + frames.size() * sizeof(uint64_t);
+			_heap.set_flat_env(s.is_flat_env != 0);
+			try {
+				is_valid = _heap.restore(data + offset, size - offset, program->size());
+			}
+			catch (Heap::LimitReached &) {
+				limit_reached(limit_memory);
+			}
+		}
+		if (!is_valid)
+			return false;
+
+		_program = program;
+		_code.reset(new Continuation(*_program, static_cast<size_t>(s.pc), frames, static_cast<size_t>(s.max_depth)));
+		_steps = static_cast<size_t>(s.steps);
+		_forks.resize(static_cast<size_t>(s.forks));
+		_start = std::chrono::steady_clock::now();
+		// the cells of the file are not known to have the types of the program
+		_is_checked = true;
+
+		if (_memo)
+			_memo->clear();
+		return true;
+	}
+
+	void Heap::save(std::string &out) {
+		collect(0);
+
+		// a cell takes at most 8 bytes more than in the space
+		size_t values = _roots.size();
+		for (auto it = _root_vectors.begin(); it != _root_vectors.end(); ++it)
+			values += (*it)->size() + 1;
+		out.reserve(out.length() + sizeof(SnapshotHeap) + used() + used() / number_size * 8 + values * sizeof(SnapshotValue));
+
+		SnapshotHeap h = {};
+		size_t header = out.length();
+		append(out, h);
+
+		size_t cells = out.length();
+		for (char *scan = _space; scan < _top; scan += size_of(reinterpret_cast<Cell*>(scan))) {
+			Cell *c = reinterpret_cast<Cell*>(scan);
+			SnapshotCell r = {};
+			r.kind = c->kind;
+
+			switch (c->kind) {
+			case Value::kind_pair:
+				append(out, r);
+				save(static_cast<PairCell*>(c)->first, out);
+				save(static_cast<PairCell*>(c)->second, out);
+				break;
+			case Value::kind_bignum: {
+				mpz_srcptr number = static_cast<NumberCell*>(c)->number;
+				std::vector<uint64_t> limbs((mpz_sizeinbase(number, 2) + 63) / 64);
+				size_t count = 0;
+				mpz_export(limbs.data(), &count, -1, sizeof(uint64_t), 0, 0, number);
+				r.length = mpz_sgn(number) < 0;
+				r.entry = count;
+				append(out, r);
+				out.append(reinterpret_cast<const char*>(limbs.data()), count * sizeof(uint64_t));
+				break;
+			}
+			case Value::kind_closure:
+			case Value::kind_rec:
+				r.entry = static_cast<ClosureCell*>(c)->entry;
+				append(out, r);
+				save(static_cast<ClosureCell*>(c)->env, out);
+				break;
+			case Value::kind_env: {
+				r.length = c->length;
+				append(out, r);
+				Value *values = static_cast<EnvCell*>(c)->values();
+				for (uint32_t i = 0; i < c->length; i++)
+					save(values[i], out);
+				break;
+			}
+			default:
+				break;
+			}
+		}
+		h.cells = out.length() - cells;
+
+		for (auto it = _roots.begin(); it != _roots.end(); ++it)
+			save(**it, out);
+		for (auto it = _root_vectors.begin(); it != _root_vectors.end(); ++it) {
+			append(out, static_cast<uint64_t>((*it)->size()));
+			for (auto v = (*it)->begin(); v != (*it)->end(); ++v)
+				save(*v, out);
+		}
+
+		h.used = used();
+		h.roots = _roots.size();
+		h.root_vectors = _root_vectors.size();
+		memcpy(&out[header], &h, sizeof(h));
+	}
+
+	void Heap::save(const Value &v, std::string &out) const {
+		SnapshotValue r;
+		r.kind = v._kind;
+		r.offset = v._offset;
+		r.data = v.is_boxed() ? reinterpret_cast<char*>(v._cell) - _space : v._fixnum;
+		append(out, r);
+	}
+
+	Value Heap::restore(const char *data) const {
+		SnapshotValue r;
+		memcpy(&r, data, sizeof(r));
+
+		Value v;
+		v._kind = static_cast<Value::kind_t>(r.kind);
+		v._offset = r.offset;
+		if (!v.is_boxed())
+			v._fixnum = r.data;
+		else if (static_cast<uint64_t>(r.data) < _size)
+			v._cell = reinterpret_cast<Cell*>(_space + static_cast<size_t>(r.data));
+		else {
+			// outside of the space, is_valid rejects it
+			v._kind = Value::kind_unit;
+			v._offset = 1;
+		}
+		return v;
+	}
+
+	// The cells are rebuilt in the order of the space, so the offsets of the
+	// values hold once all of them are there
+	bool Heap::restore(const char *data, size_t size, size_t entries) {
+		clear();
+		for (auto it = _roots.begin(); it != _roots.end(); ++it)
+			**it = Value::make();
+		for (auto it = _root_vectors.begin(); it != _root_vectors.end(); ++it)
+			(*it)->clear();
+
+		Reader reader(data, size);
+		SnapshotHeap h;
+		if (!reader.read(&h) || h.cells > size || h.used > h.cells || h.roots != _roots.size() || h.root_vectors != _root_vectors.size())
+			return false;
+
+		reserve(static_cast<size_t>(h.used));
+		std::vector<bool> starts(static_cast<size_t>(h.used / 8));
+
+		bool is_valid = true;
+		Reader cells(reader.read(static_cast<size_t>(h.cells)), static_cast<size_t>(h.cells));
+		while (is_valid && !cells.is_end()) {
+			SnapshotCell r;
+			size_t offset = used();
+			if (!cells.read(&r) || r.kind < Value::kind_pair || r.kind > Value::kind_env || (r.kind == Value::kind_env && r.length < 2)) {
+				is_valid = false;
+				break;
+			}
+
+			Cell header = { static_cast<Value::kind_t>(r.kind), false, r.length };
+			size_t cell_size = r.kind == Value::kind_bignum ? number_size : size_of(&header);
+			size_t count = r.kind == Value::kind_env ? r.length : r.kind == Value::kind_pair ? 2 : r.kind == Value::kind_bignum ? 0 : 1;
+			const char *values = cells.read(count * sizeof(SnapshotValue));
+			if (!values || cell_size > h.used - offset || (r.kind >= Value::kind_closure && r.kind <= Value::kind_rec && r.entry >= entries)) {
+				is_valid = false;
+				break;
+			}
+
+			Cell *c = allocate(cell_size, static_cast<Value::kind_t>(r.kind));
+			c->length = r.kind == Value::kind_env ? r.length : 0;
+			starts[offset / 8] = true;
+
+			if (r.kind == Value::kind_bignum) {
+				const char *limbs = r.entry <= h.cells / sizeof(uint64_t) ? cells.read(static_cast<size_t>(r.entry) * sizeof(uint64_t)) : nullptr;
+				NumberCell *n = static_cast<NumberCell*>(c);
+				mpz_init(n->number);
+				++_bignums;
+				if (!limbs) {
+					is_valid = false;
+					break;
+				}
+				mpz_import(n->number, static_cast<size_t>(r.entry), -1, sizeof(uint64_t), 0, 0, limbs);
+				if (r.length)
+					mpz_neg(n->number, n->number);
+				continue;
+			}
+
+			if (r.kind != Value::kind_pair && r.kind != Value::kind_env)
+				static_cast<ClosureCell*>(c)->entry = static_cast<size_t>(r.entry);
+
+			size_t n;
+			Value *v = values_of(c, n);
+			for (size_t i = 0; i < n; i++)
+				v[i] = restore(values + i * sizeof(SnapshotValue));
+		}
+		is_valid = is_valid && used() == h.used;
+
+		for (char *scan = _space; is_valid && scan < _top; scan += size_of(reinterpret_cast<Cell*>(scan))) {
+			size_t n;
+			Value *v = values_of(reinterpret_cast<Cell*>(scan), n);
+			for (size_t i = 0; is_valid && i < n; i++)
+				is_valid = is_valid && this->is_valid(v[i], starts);
+		}
+
+		for (auto it = _roots.begin(); is_valid && it != _roots.end(); ++it) {
+			const char *value = reader.read(sizeof(SnapshotValue));
+			is_valid = value && this->is_valid(**it = restore(value), starts);
+		}
+		for (auto it = _root_vectors.begin(); is_valid && it != _root_vectors.end(); ++it) {
+			uint64_t length = 0;
+			is_valid = reader.read(&length) && length <= size / sizeof(SnapshotValue);
+			for (uint64_t i = 0; is_valid && i < length; i++) {
+				const char *value = reader.read(sizeof(SnapshotValue));
+				is_valid = value != nullptr;
+				if (is_valid) {
+					(*it)->push_back(restore(value));
+					is_valid = this->is_valid((*it)->back(), starts);
+				}
+			}
+		}
+		is_valid = is_valid && reader.is_end();
+
+		if (!is_valid) {
+			for (auto it = _roots.begin(); it != _roots.end(); ++it)
+				**it = Value::make();
+			for (auto it = _root_vectors.begin(); it != _root_vectors.end(); ++it)
+				(*it)->clear();
+			clear();
+		}
+		return is_valid;
+	}
+
+	bool Heap::is_valid(const Value &v, const std::vector<bool> &starts) const {
+		if (!v.is_boxed())
+			return v._kind <= Value::kind_fixnum && v._offset == 0;
+
+		size_t offset = reinterpret_cast<char*>(v._cell) - _space;
+		if (v._kind > Value::kind_env || offset % 8 || offset >= used() || !starts[offset / 8] || v._cell->kind != v._kind)
+			return false;
+		return v._kind == Value::kind_env ? v._offset + 2 <= v._cell->length : v._offset == 0;
+	}
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <csignal>
+
+#include "program.h"
+#include "machine.h"
+
+namespace CAM
+{
+	// Snapshots of a run from which it continues as if it had not stopped:
+	// the image of the program, the counters, the continuation, the stack
+	// and the live cells of the heap, see snapshot.cpp. A snapshot is taken
+	// every some steps or when it is requested, e.g. by a signal. The run
+	// stops only to collect its heap and to copy the cells to a buffer,
+	// the buffer is written to the file by a thread of its own. The file is
+	// replaced when the write is complete, so a crash keeps the last one.
+	class Snapshot
+	{
+	public:
+		static const size_t npos = static_cast<size_t>(-1);
+
+		// every: steps between the snapshots, 0: only when requested
+		Snapshot(const std::string &path, size_t every = 0);
+
+		// Waits for the write in progress
+		~Snapshot();
+
+		// Program of the next runs and the source it was compiled from
+		void begin(const Program &program, const std::string &source);
+
+		// Step of the next periodic snapshot, npos if there is none
+		size_t next() const { return _next; }
+
+		bool is_due(size_t steps) const { return steps >= _next || _is_requested; }
+
+		// Saves the state of the machine and starts to write it. The snapshot
+		// is skipped if the last one is still being written or the machine
+		// cannot be saved now; a requested one is then taken later.
+		void take(Machine &machine);
+
+		// Waits for the write in progress. Throws CAMException if a write
+		// failed.
+		void wait();
+
+		// Snapshots written so far
+		size_t count() const { return _count; }
+
+		// Asks the runs for a snapshot at their next check, may be called by
+		// a signal handler
+		static void request() { _is_requested = 1; }
+
+		// Restores the run of the snapshot file to the machine and returns
+		// its program, the source is stored to source if it is not nullptr.
+		// Throws CAMException if the file is not a snapshot of this version.
+		static std::shared_ptr<const Program> load(const std::string &path, Machine &machine, std::string *source = nullptr);
+
+	private:
+		std::string _path;
+		size_t _every;
+		size_t _next;
+		// image of the program
+		std::string _image;
+		std::thread _writer;
+		std::atomic<bool> _is_writing;
+		std::string _error;
+		size_t _count;
+
+		static volatile std::sig_atomic_t _is_requested;
+
+		Snapshot(const Snapshot&);
+		Snapshot& operator=(const Snapshot&);
+
+		void write(const std::string &buffer);
+	};
+}
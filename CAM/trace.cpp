@@ -0,0 +1,132 @@
+#include <iostream>
+#include <sstream>
+
+#include "trace.h"
+#include "history.h"
+#include "parser.h"
+#include "program.h"
+#include "value.h"
+#include "CAM.h"
+
+namespace CAM
+{
+	const char Trace::magic[8] = { 'C', 'A', 'M', 'T', 'R', 'A', 'C', 'E' };
+
+	Trace::Trace(const std::string &path, size_t last, size_t every) :
+		_path(path), _last(last), _every(every ? every : 1), _events(last ? last : chunk), _count(0), _next_id(1) {}
+
+	void Trace::begin(const std::string &code, bool is_optimized) {
+		_os.close();
+		_os.open(_path.c_str(), std::ios::binary | std::ios::trunc);
+		if (!_os)
+			throw CAMException("Cannot write trace: " + _path);
+
+		uint32_t v = version;
+		uint32_t flags = is_optimized ? flag_optimized : 0;
+		uint64_t length = code.length();
+		_os.write(magic, sizeof(magic));
+		_os.write(reinterpret_cast<const char*>(&v), sizeof(v));
+		_os.write(reinterpret_cast<const char*>(&flags), sizeof(flags));
+		_os.write(reinterpret_cast<const char*>(&length), sizeof(length));
+		_os.write(code.data(), code.length());
+
+		_count = 0;
+		_ids.clear();
+		_next_id = 1;
+	}
+
+	int64_t Trace::id(const Value &term) {
+		auto inserted = _ids.insert(std::make_pair(term.id(), _next_id));
+		if (inserted.second)
+			++_next_id;
+		return inserted.first->second;
+	}
+
+	void Trace::moved(const Cell *from, const Cell *to) {
+		auto it = _ids.find(reinterpret_cast<intptr_t>(from));
+		if (it != _ids.end())
+			_moved[reinterpret_cast<intptr_t>(to)] = it->second;
+	}
+
+	void Trace::evacuated() {
+		_ids.swap(_moved);
+		_moved.clear();
+	}
+
+	void Trace::end() {
+		flush();
+		_os.close();
+	}
+
+	void Trace::flush() {
+		if (!_last) {
+			_os.write(reinterpret_cast<const char*>(&_events[0]), _count * sizeof(Event));
+			_count = 0;
+			return;
+		}
+
+		// The ring holds the last events, the oldest one is at _count
+		size_t n = _count < _last ? _count : _last;
+		size_t first = _count < _last ? 0 : _count % _last;
+		for (size_t i = 0; i < n; i++)
+			_os.write(reinterpret_cast<const char*>(&_events[(first + i) % _last]), sizeof(Event));
+		_count = 0;
+	}
+
+	void Trace::print(const std::string &path) {
+		std::ifstream is(path.c_str(), std::ios::binary);
+
+		char m[sizeof(magic)];
+		uint32_t v;
+		uint32_t flags;
+		uint64_t length;
+		is.read(m, sizeof(m));
+		is.read(reinterpret_cast<char*>(&v), sizeof(v));
+		is.read(reinterpret_cast<char*>(&flags), sizeof(flags));
+		is.read(reinterpret_cast<char*>(&length), sizeof(length));
+		if (!is || std::string(m, sizeof(m)) != std::string(magic, sizeof(magic)) || v != version)
+			throw CAMException("Invalid trace: " + path);
+
+		std::string code(static_cast<size_t>(length), '\0');
+		is.read(&code[0], code.length());
+
+		// pcs of the events refer to the program compiled the same way
+		Program program(Parser(code).parse(), (flags & flag_optimized) != 0);
+		History history;
+
+		Event e;
+		while (is.read(reinterpret_cast<char*>(&e), sizeof(e))) {
+			std::ostringstream term;
+			switch (e.kind) {
+			case Value::kind_unit:
+				term << "()";
+				break;
+			case Value::kind_fixnum:
+				term << e.term;
+				break;
+			case Value::kind_pair:
+				term << "pair@" << e.term;
+				break;
+			case Value::kind_bignum:
+				term << "bignum@" << e.term;
+				break;
+			case Value::kind_closure:
+				term << "closure@" << e.term;
+				break;
+			case Value::kind_env:
+				term << "env@" << e.term;
+				break;
+			default:
+				term << "rec@" << e.term;
+				break;
+			}
+
+			std::ostringstream stack;
+			stack << "depth " << e.stack << ", frames " << e.frames;
+
+			history.add(static_cast<size_t>(e.step), term.str(), program.to_string(e.pc), stack.str());
+		}
+
+		history.print();
+	}
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <unordered_map>
+
+#include "heap.h"
+
+namespace CAM
+{
+	// Compact binary trace of the execution. Instead of the strings kept by
+	// History, every traced step is a fixed size event. The events are either
+	// streamed to the file or kept in a ring buffer of the last steps which is
+	// written at the end of the run. print renders a trace file in the format
+	// of the History table.
+	//
+	// A cell is named by a number given when the trace first meets it. The
+	// trace observes the collector, so the number stays with the cell when
+	// it moves and the term can be followed across collections.
+	class Trace : public Heap::Observer
+	{
+	public:
+		struct Event
+		{
+			uint64_t step;
+			// fixnum value or number of the cell
+			int64_t term;
+			uint32_t pc;
+			uint32_t stack;
+			uint32_t frames;
+			uint8_t op;
+			uint8_t kind;
+			uint16_t reserved;
+		};
+
+		// last: keep only the last steps (0 - stream all of them to the file),
+		// every: trace every Kth step
+		Trace(const std::string &path, size_t last = 0, size_t every = 1);
+
+		void begin(const std::string &code, bool is_optimized);
+
+		void add(uint64_t step, uint32_t pc, uint8_t op, const Value &term, size_t stack, size_t frames) {
+			if (step % _every)
+				return;
+
+			Event &e = _events[_count++ % _events.size()];
+			e.step = step;
+			e.term = term.is_boxed() ? id(term) : term.id();
+			e.pc = pc;
+			e.stack = static_cast<uint32_t>(stack);
+			e.frames = static_cast<uint32_t>(frames);
+			e.op = op;
+			e.kind = term.kind();
+			e.reserved = 0;
+
+			if (!_last && _count == _events.size())
+				flush();
+		}
+
+		void end();
+
+		virtual void moved(const Cell *from, const Cell *to);
+		virtual void evacuated();
+
+		// Prints the trace file as the History table
+		static void print(const std::string &path);
+
+	private:
+		static const char magic[8];
+		static const uint32_t version = 3;
+		static const uint32_t flag_optimized = 1;
+		static const size_t chunk = 4096;
+
+		std::string _path;
+		std::ofstream _os;
+		size_t _last;
+		size_t _every;
+		std::vector<Event> _events;
+		size_t _count;
+
+		// numbers of the cells by address, Value::id, and of the cells moved
+		// by the evacuation in progress
+		std::unordered_map<int64_t, int64_t> _ids;
+		std::unordered_map<int64_t, int64_t> _moved;
+		int64_t _next_id;
+
+		// Number of the cell of term
+		int64_t id(const Value &term);
+
+		void flush();
+	};
+}
@@ -0,0 +1,945 @@
+#include "translator.h"
+#include "program.h"
+#include "CAM.h"
+
+namespace CAM
+{
+	namespace
+	{
+		// Runtime of the translated program, written at the start of every
+		// unit. Split into pieces, a string literal may not be longer than
+		// 16k characters for MSVC.
+		const char *const runtime[] = {
+R"runtime(#include <cstdint>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+#include <utility>
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+
+#include <gmpxx.h>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <process.h>
+#else
+#include <pthread.h>
+#endif
+
+namespace cam
+{
+	class Error : public std::runtime_error
+	{
+	public:
+		Error(const std::string &what) : std::runtime_error(what) {}
+	};
+
+	class Value;
+	struct Body;
+
+	// Runs a body on its environment. A tail application sets next to its
+	// body and returns its environment, the caller runs it.
+	typedef Value (*function_t)(Value term, const Body *&next);
+
+	struct Body
+	{
+		function_t function;
+		// code of the body as the interpreter prints it
+		const char *text;
+	};
+
+	struct Cell
+	{
+		size_t refs;
+	};
+
+	// Reference counted value. Values never change once they are made and
+	// the environment of a recursive closure is made when it is applied, so
+	// there are no cycles.
+	class Value
+	{
+	public:
+		enum kind_t
+		{
+			kind_unit,
+			kind_fixnum,
+			kind_pair,
+			kind_bignum,
+			kind_closure,
+			kind_rec
+		};
+
+	private:
+		kind_t _kind;
+		union
+		{
+			int64_t _fixnum;
+			Cell *_cell;
+		};
+
+		static void release(kind_t kind, Cell *cell);
+
+	public:
+		Value() : _kind(kind_unit), _fixnum(0) {}
+		explicit Value(int64_t fixnum) : _kind(kind_fixnum), _fixnum(fixnum) {}
+		// takes the reference of a new cell
+		Value(kind_t kind, Cell *cell) : _kind(kind), _cell(cell) {}
+
+		Value(const Value &v) : _kind(v._kind), _fixnum(v._fixnum) {
+			if (is_boxed())
+				++_cell->refs;
+		}
+
+		Value(Value &&v) : _kind(v._kind), _fixnum(v._fixnum) { v._kind = kind_unit; }
+
+		~Value() {
+			if (is_boxed() && --_cell->refs == 0)
+				release(_kind, _cell);
+		}
+
+		Value& operator=(const Value &v) { Value(v).swap(*this); return *this; }
+		Value& operator=(Value &&v) { Value(std::move(v)).swap(*this); return *this; }
+
+		void swap(Value &v) {
+			std::swap(_kind, v._kind);
+			std::swap(_fixnum, v._fixnum);
+		}
+
+		kind_t kind() const { return _kind; }
+
+		bool is_boxed() const { return _kind >= kind_pair; }
+		bool is_fixnum() const { return _kind == kind_fixnum; }
+		bool is_number() const { return _kind == kind_fixnum || _kind == kind_bignum; }
+		bool is_pair() const { return _kind == kind_pair; }
+		bool is_closure() const { return _kind == kind_closure || _kind == kind_rec; }
+
+		// no other value refers to the cell
+		bool is_unique() const { return _cell->refs == 1; }
+
+		int64_t fixnum() const { return _fixnum; }
+
+		inline struct Pair* pair() const;
+		inline struct Number* number() const;
+		inline struct Closure* closure() const;
+	};
+
+	struct Pair : Cell
+	{
+		Value first;
+		Value second;
+
+		Pair(Value &&first, Value &&second) : first(std::move(first)), second(std::move(second)) { refs = 1; }
+	};
+
+	struct Number : Cell
+	{
+		mpz_class number;
+
+		Number(const mpz_class &number) : number(number) { refs = 1; }
+	};
+
+	struct Closure : Cell
+	{
+		const Body *body;
+		// without the closure itself for Y
+		Value env;
+
+		Closure(const Body *body, Value &&env) : body(body), env(std::move(env)) { refs = 1; }
+	};
+
+	Pair* Value::pair() const { return static_cast<Pair*>(_cell); }
+	Number* Value::number() const { return static_cast<Number*>(_cell); }
+	Closure* Value::closure() const { return static_cast<Closure*>(_cell); }
+
+	// Pairs and closures share a free list of slots
+	class Slots
+	{
+		union Slot
+		{
+			Slot *next;
+			char cell[sizeof(Pair) > sizeof(Closure) ? sizeof(Pair) : sizeof(Closure)];
+			int64_t align;
+		};
+
+		static Slot *_free;
+
+	public:
+		static void* allocate() {
+			if (!_free)
+				grow();
+
+			Slot *s = _free;
+			_free = s->next;
+			return s;
+		}
+
+		static void free(void *p) {
+			Slot *s = static_cast<Slot*>(p);
+			s->next = _free;
+			_free = s;
+		}
+
+	private:
+		static void grow() {
+			const size_t count = 1024;
+			Slot *block = static_cast<Slot*>(std::malloc(count * sizeof(Slot)));
+			if (!block)
+				throw std::bad_alloc();
+
+			for (size_t i = 0; i < count; i++) {
+				block[i].next = _free;
+				_free = &block[i];
+			}
+		}
+	};
+
+	Slots::Slot *Slots::_free = nullptr;
+
+	// The cells of a long list are freed in a loop instead of nested
+	// destructors. Cells wait in a list linked through their counts, the
+	// kind is kept in the low bits of the link.
+	void Value::release(kind_t kind, Cell *cell) {
+		static Cell *dead = nullptr;
+		static bool is_releasing = false;
+
+		cell->refs = reinterpret_cast<size_t>(dead) | kind;
+		dead = cell;
+		if (is_releasing)
+			return;
+
+		is_releasing = true;
+		while (dead) {
+			Cell *c = dead;
+			dead = reinterpret_cast<Cell*>(c->refs & ~static_cast<size_t>(7));
+
+			switch (static_cast<kind_t>(c->refs & 7)) {
+			case kind_pair:
+				static_cast<Pair*>(c)->~Pair();
+				Slots::free(c);
+				break;
+			case kind_bignum:
+				delete static_cast<Number*>(c);
+				break;
+			default:
+				static_cast<Closure*>(c)->~Closure();
+				Slots::free(c);
+				break;
+			}
+		}
+		is_releasing = false;
+	}
+)runtime",
+R"runtime(
+	inline bool add_overflow(int64_t a, int64_t b, int64_t &r) {
+#if defined(__GNUC__)
+		return __builtin_add_overflow(a, b, &r);
+#else
+		if ((b > 0 && a > INT64_MAX - b) || (b < 0 && a < INT64_MIN - b))
+			return true;
+		r = a + b;
+		return false;
+#endif
+	}
+
+	inline bool sub_overflow(int64_t a, int64_t b, int64_t &r) {
+#if defined(__GNUC__)
+		return __builtin_sub_overflow(a, b, &r);
+#else
+		if ((b < 0 && a > INT64_MAX + b) || (b > 0 && a < INT64_MIN + b))
+			return true;
+		r = a - b;
+		return false;
+#endif
+	}
+
+	inline bool mul_overflow(int64_t a, int64_t b, int64_t &r) {
+#if defined(__GNUC__)
+		return __builtin_mul_overflow(a, b, &r);
+#else
+		if (a > 0) {
+			if ((b > 0 && a > INT64_MAX / b) || (b < 0 && b < INT64_MIN / a))
+				return true;
+		}
+		else if (a < 0) {
+			if ((b > 0 && a < INT64_MIN / b) || (b < 0 && a < INT64_MAX / b))
+				return true;
+		}
+		r = a * b;
+		return false;
+#endif
+	}
+
+	// long is 32 bits wide on Windows, so values are split into halves there
+	mpz_class to_mpz(int64_t v) {
+		if (v >= LONG_MIN && v <= LONG_MAX)
+			return mpz_class(static_cast<long>(v));
+
+		mpz_class r(static_cast<long>(v >> 32));
+		r <<= 32;
+		r += static_cast<unsigned long>(v & 0xffffffff);
+		return r;
+	}
+
+	bool to_int64(const mpz_class &v, int64_t &r) {
+		if (v.fits_slong_p()) {
+			r = v.get_si();
+			return true;
+		}
+
+		if (sizeof(long) >= sizeof(int64_t) || mpz_sizeinbase(v.get_mpz_t(), 2) > 63)
+			return false;
+
+		mpz_class a = abs(v);
+		mpz_class hi = a >> 32;
+		mpz_class lo = a - (hi << 32);
+		int64_t u = static_cast<int64_t>((static_cast<uint64_t>(hi.get_ui()) << 32) | lo.get_ui());
+		r = sgn(v) < 0 ? -u : u;
+		return true;
+	}
+
+	// Numbers which fit into int64_t are fixnums
+	Value make_number(const mpz_class &number) {
+		int64_t fixnum;
+		if (to_int64(number, fixnum))
+			return Value(fixnum);
+		return Value(Value::kind_bignum, new Number(number));
+	}
+
+	Value make_number(const char *text) { return make_number(mpz_class(text)); }
+
+	mpz_class number(const Value &v) {
+		if (v.is_fixnum())
+			return to_mpz(v.fixnum());
+		return v.number()->number;
+	}
+
+	inline Value make_pair(Value first, Value second) {
+		return Value(Value::kind_pair, new (Slots::allocate()) Pair(std::move(first), std::move(second)));
+	}
+
+	inline Value make_closure(const Body *body, Value env) {
+		return Value(Value::kind_closure, new (Slots::allocate()) Closure(body, std::move(env)));
+	}
+
+	inline Value make_rec(const Body *body, Value env) {
+		return Value(Value::kind_rec, new (Slots::allocate()) Closure(body, std::move(env)));
+	}
+
+	// Printed as by the interpreter, in a loop for long lists
+	std::string to_string(const Value &v) {
+		std::string s;
+		// value, or the text if the value is nullptr
+		std::vector<std::pair<const Value*, const char*> > todo;
+		todo.push_back(std::make_pair(&v, static_cast<const char*>(nullptr)));
+
+		while (!todo.empty()) {
+			std::pair<const Value*, const char*> t = todo.back();
+			todo.pop_back();
+			if (!t.first) {
+				s += t.second;
+				continue;
+			}
+
+			const Value &x = *t.first;
+			switch (x.kind()) {
+			case Value::kind_unit:
+				s += "()";
+				break;
+			case Value::kind_fixnum:
+				s += std::to_string(x.fixnum());
+				break;
+			case Value::kind_bignum:
+				s += x.number()->number.get_str();
+				break;
+			case Value::kind_pair:
+				s += '(';
+				todo.push_back(std::make_pair(static_cast<const Value*>(nullptr), ")"));
+				todo.push_back(std::make_pair(&x.pair()->second, static_cast<const char*>(nullptr)));
+				todo.push_back(std::make_pair(static_cast<const Value*>(nullptr), ", "));
+				todo.push_back(std::make_pair(&x.pair()->first, static_cast<const char*>(nullptr)));
+				break;
+			case Value::kind_closure:
+				s += x.closure()->body->text;
+				s += ": ";
+				todo.push_back(std::make_pair(&x.closure()->env, static_cast<const char*>(nullptr)));
+				break;
+			case Value::kind_rec:
+				s += x.closure()->body->text;
+				s += ": (";
+				todo.push_back(std::make_pair(static_cast<const Value*>(nullptr), ", rec)"));
+				todo.push_back(std::make_pair(&x.closure()->env, static_cast<const char*>(nullptr)));
+				break;
+			}
+		}
+		return s;
+	}
+
+	[[noreturn]] void invalid_term(const Value &term, const char *expected) {
+		throw Error("Invalid term: " + to_string(term) + " (expected: " + expected + ")");
+	}
+
+	inline const Value& fst(const Value &term) {
+		if (!term.is_pair())
+			invalid_term(term, "(s, t)");
+		return term.pair()->first;
+	}
+
+	inline const Value& snd(const Value &term) {
+		if (!term.is_pair())
+			invalid_term(term, "(s, t)");
+		return term.pair()->second;
+	}
+
+	inline bool condition(const Value &term) {
+		if (term.is_fixnum())
+			return term.fixnum() != 0;
+		if (!term.is_number())
+			invalid_term(term, "numeric constant");
+		return sgn(term.number()->number) != 0;
+	}
+)runtime",
+R"runtime(
+	struct Add
+	{
+		static bool apply(int64_t a, int64_t b, int64_t &r) { return add_overflow(a, b, r); }
+		static mpz_class apply(const mpz_class &a, const mpz_class &b) { return a + b; }
+	};
+
+	struct Sub
+	{
+		static bool apply(int64_t a, int64_t b, int64_t &r) { return sub_overflow(a, b, r); }
+		static mpz_class apply(const mpz_class &a, const mpz_class &b) { return a - b; }
+	};
+
+	struct Mul
+	{
+		static bool apply(int64_t a, int64_t b, int64_t &r) { return mul_overflow(a, b, r); }
+		static mpz_class apply(const mpz_class &a, const mpz_class &b) { return a * b; }
+	};
+
+	struct Eq
+	{
+		static bool apply(int64_t a, int64_t b, int64_t &r) { r = a == b; return false; }
+		static mpz_class apply(const mpz_class &a, const mpz_class &b) { return mpz_class(a == b ? 1 : 0); }
+	};
+
+	template <class operation_t>
+	Value number_operation(const Value &a, const Value &b) {
+		if (!a.is_number() || !b.is_number())
+			invalid_term(make_pair(a, b), "(s,t) where s and t - numeric constants");
+		return make_number(operation_t::apply(number(a), number(b)));
+	}
+
+	template <class operation_t>
+	inline Value operation(const Value &a, const Value &b) {
+		int64_t r;
+		if (a.is_fixnum() && b.is_fixnum() && !operation_t::apply(a.fixnum(), b.fixnum(), r))
+			return Value(r);
+		return number_operation<operation_t>(a, b);
+	}
+
+	template <class operation_t>
+	inline Value operation(const Value &term) {
+		if (!term.is_pair())
+			invalid_term(term, "(s,t)");
+		return operation<operation_t>(term.pair()->first, term.pair()->second);
+	}
+
+	inline Value add(const Value &term) { return operation<Add>(term); }
+	inline Value sub(const Value &term) { return operation<Sub>(term); }
+	inline Value mul(const Value &term) { return operation<Mul>(term); }
+	inline Value eq(const Value &term) { return operation<Eq>(term); }
+
+	inline Value add(const Value &a, const Value &b) { return operation<Add>(a, b); }
+	inline Value sub(const Value &a, const Value &b) { return operation<Sub>(a, b); }
+	inline Value mul(const Value &a, const Value &b) { return operation<Mul>(a, b); }
+	inline Value eq(const Value &a, const Value &b) { return operation<Eq>(a, b); }
+
+	// Environment of the body of the closure applied to arg: (env, arg), for
+	// Y ((env, closure), arg)
+	inline Value enter(Value closure, Value arg, const Body *&next) {
+		if (!closure.is_closure())
+			invalid_term(make_pair(std::move(closure), std::move(arg)), "(C: s, t)");
+
+		Closure *c = closure.closure();
+		next = c->body;
+		if (closure.kind() == Value::kind_rec) {
+			Value env = c->env;
+			return make_pair(make_pair(std::move(env), std::move(closure)), std::move(arg));
+		}
+		return make_pair(c->env, std::move(arg));
+	}
+
+	// term is (closure, arg)
+	inline Value enter(Value term, const Body *&next) {
+		if (!term.is_pair() || !term.pair()->first.is_closure())
+			invalid_term(term, "(C: s, t)");
+
+		Pair *p = term.pair();
+		if (term.is_unique())
+			return enter(std::move(p->first), std::move(p->second), next);
+		return enter(p->first, p->second, next);
+	}
+
+	// Runs the body and the bodies of its tail applications
+	Value run(const Body *body, Value term) {
+		for (;;) {
+			const Body *next = nullptr;
+			term = body->function(std::move(term), next);
+			if (!next)
+				return term;
+			body = next;
+		}
+	}
+
+	inline Value apply(Value term) {
+		const Body *body;
+		Value env = enter(std::move(term), body);
+		return run(body, std::move(env));
+	}
+
+	inline Value apply(Value closure, Value arg) {
+		const Body *body;
+		Value env = enter(std::move(closure), std::move(arg), body);
+		return run(body, std::move(env));
+	}
+
+	struct Run
+	{
+		const Body *program;
+		size_t iterations;
+		std::string term;
+		std::string error;
+		double time;
+	};
+
+	void execute(Run &r) {
+		try {
+			Value term;
+			r.time = 0;
+			for (size_t i = 0; i < r.iterations; i++) {
+				std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+				term = run(r.program, Value());
+				r.time += std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+			}
+			r.time /= r.iterations;
+			r.term = to_string(term);
+		}
+		catch (std::exception &e) {
+			r.error = e.what();
+		}
+	}
+
+#ifdef _WIN32
+	unsigned __stdcall start(void *r) {
+		execute(*static_cast<Run*>(r));
+		return 0;
+	}
+#else
+	void* start(void *r) {
+		execute(*static_cast<Run*>(r));
+		return nullptr;
+	}
+#endif
+
+	// Runs on a thread with a stack of the size, the applications which are
+	// not tail calls nest on it
+	void execute(Run &r, size_t stack) {
+#ifdef _WIN32
+		HANDLE thread = reinterpret_cast<HANDLE>(_beginthreadex(nullptr, static_cast<unsigned>(stack), start, &r, STACK_SIZE_PARAM_IS_A_RESERVATION, nullptr));
+		if (thread) {
+			WaitForSingleObject(thread, INFINITE);
+			CloseHandle(thread);
+			return;
+		}
+#else
+		pthread_attr_t attr;
+		pthread_t thread;
+		if (pthread_attr_init(&attr) == 0) {
+			bool is_started = pthread_attr_setstacksize(&attr, stack) == 0 && pthread_create(&thread, &attr, start, &r) == 0;
+			pthread_attr_destroy(&attr);
+			if (is_started) {
+				pthread_join(thread, nullptr);
+				return;
+			}
+		}
+#endif
+		execute(r);
+	}
+
+	bool parse_size(const char *s, size_t &size) {
+		char *end;
+		unsigned long long v = std::strtoull(s, &end, 10);
+		if (end == s)
+			return false;
+
+		switch (*end) {
+		case 'g':
+			v <<= 10;
+		case 'm':
+			v <<= 10;
+		case 'k':
+			v <<= 10;
+			++end;
+			break;
+		}
+
+		if (*end || v == 0)
+			return false;
+
+		size = static_cast<size_t>(v);
+		return true;
+	}
+
+	// Prints the time of a run and the result as the interpreter does with -r
+	int run_program(int argc, char **argv, const Body *program) {
+		Run r;
+		r.program = program;
+		r.iterations = 1;
+		size_t stack = sizeof(void*) >= 8 ? static_cast<size_t>(1) << 30 : static_cast<size_t>(256) << 20;
+
+		for (char **args = &argv[1]; *args; args++) {
+			if (!std::strcmp(*args, "--iterations") && args[1] && parse_size(args[1], r.iterations))
+				++args;
+			else if (!std::strcmp(*args, "--stack-size") && args[1] && parse_size(args[1], stack))
+				++args;
+			else {
+				std::cerr << "Usage: " << *argv << " [--iterations n] [--stack-size size]" << std::endl;
+				return -1;
+			}
+		}
+
+		execute(r, stack);
+		if (!r.error.empty()) {
+			std::cerr << r.error << std::endl;
+			return -1;
+		}
+
+		std::cout << "time: " << r.time << std::endl;
+		std::cout << "term: " << r.term << std::endl;
+		return 0;
+	}
+}
+)runtime"
+		};
+	}
+
+	void Translator::write(std::ostream &os) {
+		_bodies.clear();
+		_bignums.clear();
+
+		// bodies are found while the code which makes them is translated
+		std::vector<std::string> functions;
+		functions.push_back(function("program", _code, false));
+		for (size_t i = 0; i < _bodies.size(); i++)
+			functions.push_back(function("body_" + std::to_string(i), *_bodies[i], true));
+
+		os << "// Translated from CAM code. Build with GMP, for example:" << std::endl;
+		os << "//   g++ -std=c++14 -O2 program.cpp -lgmpxx -lgmp -lpthread" << std::endl;
+		os << "// -DCAM_NO_MAIN leaves out main, cam_evaluate() then runs the program." << std::endl << std::endl;
+		for (size_t i = 0; i < sizeof(runtime) / sizeof(*runtime); i++)
+			os << runtime[i];
+
+		os << std::endl << "namespace" << std::endl << '{' << std::endl;
+		os << "\tcam::Value program(cam::Value term, const cam::Body *&next);" << std::endl;
+		for (size_t i = 0; i < _bodies.size(); i++)
+			os << "\tcam::Value body_" << i << "(cam::Value term, const cam::Body *&next);" << std::endl;
+		os << std::endl;
+
+		os << "\tconst cam::Body program_body = { program, \"\" };" << std::endl;
+		if (!_bodies.empty()) {
+			os << "\tconst cam::Body bodies[] = {" << std::endl;
+			for (size_t i = 0; i < _bodies.size(); i++) {
+				os << "\t\t{ body_" << i << ", \"" << escape(CodeTerm::to_string(*_bodies[i])) << "\" }"
+					<< (i + 1 < _bodies.size() ? "," : "") << std::endl;
+			}
+			os << "\t};" << std::endl;
+		}
+		for (size_t i = 0; i < _bignums.size(); i++)
+			os << "\tconst cam::Value literal_" << i << " = cam::make_number(\"" << _bignums[i] << "\");" << std::endl;
+
+		for (auto it = functions.begin(); it != functions.end(); ++it)
+			os << std::endl << *it;
+		os << '}' << std::endl << std::endl;
+
+		os << "// Result of the program as the interpreter prints it, throws cam::Error" << std::endl;
+		os << "std::string cam_evaluate() { return cam::to_string(cam::run(&program_body, cam::Value())); }" << std::endl << std::endl;
+		os << "#ifndef CAM_NO_MAIN" << std::endl;
+		os << "int main(int argc, char **argv) { return cam::run_program(argc, argv, &program_body); }" << std::endl;
+		os << "#endif" << std::endl;
+	}
+
+	std::string Translator::function(const std::string &name, const CodeTerm::code_t &code, bool is_body) {
+		_os.str("");
+		_max_depth = 0;
+		_is_body = is_body;
+
+		size_t depth = block(code, 0, true, 2);
+		if (depth != npos)
+			end(depth, 2);
+
+		std::ostringstream os;
+		os << "\tcam::Value " << name << "(cam::Value term, const cam::Body *&next) {" << std::endl;
+		if (_max_depth) {
+			os << "\t\tcam::Value";
+			for (size_t i = 0; i < _max_depth; i++)
+				os << (i ? ", " : " ") << local(i);
+			os << ';' << std::endl;
+		}
+		os << _os.str() << "\t}" << std::endl;
+		return os.str();
+	}
+
+	size_t Translator::block(const CodeTerm::code_t &code, size_t depth, bool is_tail, size_t indent) {
+		for (size_t pc = 0; pc < code.size(); pc++) {
+			char op = code[pc]->op();
+			bool is_last = pc + 1 == code.size();
+
+			switch (op) {
+			case 'F':
+			case 'S': {
+				size_t end = pc;
+				while (end < code.size() && (code[end]->op() == 'F' || code[end]->op() == 'S'))
+					++end;
+
+				line(indent, "term = " + atom(code, pc, end) + ";");
+				pc = end - 1;
+				break;
+			}
+			case '<': {
+				// <A,B> of atoms makes no pair if an operation or 'e' follows
+				std::string first, second;
+				size_t cons = atoms(code, pc, first, second);
+				if (cons == npos) {
+					size_t end = pc + 1;
+					std::string condition;
+					if (pc + 1 < code.size() && code[pc + 1]->op() == '<' && (end = atoms(code, pc + 1, first, second)) != npos &&
+						end + 2 < code.size() && is_operation(code[end + 1]->op()) && code[end + 2]->op() == 'b') {
+						// <<A,B>op b(...) keeps the term, only the condition is computed
+						depth = branch(code, end + 2, "cam::condition(" + operation(code[end + 1]->op(), first, second) + ")", "", depth, is_tail, indent);
+						if (depth == npos)
+							return npos;
+						pc = end + 2;
+						break;
+					}
+
+					end = atom_end(code, pc + 1);
+					if (end < code.size() && code[end]->op() == ',') {
+						// <A, pushes A and keeps the term
+						line(indent, local(depth) + " = " + atom(code, pc + 1, end) + ";");
+						pc = end;
+					}
+					else
+						line(indent, local(depth) + " = term;");
+					_max_depth = std::max(_max_depth, ++depth);
+					break;
+				}
+
+				char next = cons + 1 < code.size() ? code[cons + 1]->op() : 0;
+				std::string args = "(" + first + ", " + second;
+				if (is_operation(next)) {
+					line(indent, "term = " + operation(next, first, second) + ";");
+					pc = cons + 1;
+				}
+				else if (next == 'e' && is_tail && cons + 2 == code.size()) {
+					leave(depth);
+					line(indent, "return cam::enter" + args + ", next);");
+					return npos;
+				}
+				else if (next == 'e') {
+					line(indent, "term = cam::apply" + args + ");");
+					pc = cons + 1;
+				}
+				else {
+					line(indent, "term = cam::make_pair" + args + ");");
+					pc = cons;
+				}
+				break;
+			}
+			case ',':
+				take(depth);
+				line(indent, "term.swap(" + local(depth - 1) + ");");
+				break;
+			case '>': {
+				take(depth);
+				std::string args = "(std::move(" + local(--depth) + "), std::move(term)";
+				if (!is_last && is_operation(code[pc + 1]->op())) {
+					// the operation reads the pair it would make
+					line(indent, "term = " + operation(code[pc + 1]->op(), local(depth), "term") + ";");
+					++pc;
+				}
+				else if (is_last || code[pc + 1]->op() != 'e')
+					line(indent, "term = cam::make_pair" + args + ");");
+				else if (is_tail && pc + 2 == code.size()) {
+					leave(depth);
+					line(indent, "return cam::enter" + args + ", next);");
+					return npos;
+				}
+				else {
+					line(indent, "term = cam::apply" + args + ");");
+					++pc;
+				}
+				break;
+			}
+			case 'e':
+				if (is_tail && is_last) {
+					leave(depth);
+					line(indent, "return cam::enter(std::move(term), next);");
+					return npos;
+				}
+				line(indent, "term = cam::apply(std::move(term));");
+				break;
+			case '\\':
+			case 'Y': {
+				auto c = std::dynamic_pointer_cast<CodeTermWithArgs>(code[pc]);
+				_bodies.push_back(&c->get_arg(0));
+				line(indent, std::string("term = cam::") + (op == 'Y' ? "make_rec" : "make_closure") +
+					"(&bodies[" + std::to_string(_bodies.size() - 1) + "], std::move(term));");
+				break;
+			}
+			case '\'':
+				line(indent, "term = " + atom(code, pc, pc + 1) + ";");
+				break;
+			case 'b':
+				take(depth);
+				--depth;
+				depth = branch(code, pc, "cam::condition(term)", "term = std::move(" + local(depth) + ");", depth, is_tail, indent);
+				if (depth == npos)
+					return npos;
+				break;
+			case '+':
+			case '-':
+			case '*':
+			case '=':
+				line(indent, "term = " + operation(op, "term") + ";");
+				break;
+			default:
+				throw InvalidCodeException(std::string(1, op));
+			}
+		}
+		return depth;
+	}
+
+	size_t Translator::branch(const CodeTerm::code_t &code, size_t pc, const std::string &condition, const std::string &restore, size_t depth, bool is_tail, size_t indent) {
+		auto c = std::dynamic_pointer_cast<CodeTermWithArgs>(code[pc]);
+		// the arms of the last 'b' of a tail block return themselves
+		bool is_tail_branch = is_tail && pc + 1 == code.size();
+		size_t ends[2];
+
+		for (size_t i = 0; i < 2; i++) {
+			line(indent, i ? "else {" : "if (" + condition + ") {");
+			if (!restore.empty())
+				line(indent + 1, restore);
+			ends[i] = block(c->get_arg(i), depth, is_tail_branch, indent + 1);
+			if (is_tail_branch && ends[i] != npos)
+				end(ends[i], indent + 1);
+			line(indent, "}");
+		}
+
+		if (is_tail_branch)
+			return npos;
+		if (ends[0] != ends[1])
+			fail("the arms of b leave different numbers of values on the stack");
+		return ends[0];
+	}
+
+	void Translator::end(size_t depth, size_t indent) {
+		leave(depth);
+		line(indent, "return term;");
+	}
+
+	void Translator::leave(size_t depth) const {
+		if (_is_body && depth != 0)
+			fail("a body leaves values on the stack");
+	}
+
+	void Translator::take(size_t depth) {
+		if (depth == 0)
+			fail("the code takes more from the stack than it pushes");
+	}
+
+	size_t Translator::atoms(const CodeTerm::code_t &code, size_t pc, std::string &first, std::string &second) {
+		size_t bounds[3] = { pc };
+		const char ends[2] = { ',', '>' };
+
+		for (size_t i = 0; i < 2; i++) {
+			size_t end = atom_end(code, bounds[i] + 1);
+			if (end >= code.size() || code[end]->op() != ends[i])
+				return npos;
+			bounds[i + 1] = end;
+		}
+
+		first = atom(code, bounds[0] + 1, bounds[1]);
+		second = atom(code, bounds[1] + 1, bounds[2]);
+		return bounds[2];
+	}
+
+	size_t Translator::atom_end(const CodeTerm::code_t &code, size_t pc) {
+		if (pc < code.size() && code[pc]->op() == '\'')
+			return pc + 1;
+
+		while (pc < code.size() && (code[pc]->op() == 'F' || code[pc]->op() == 'S'))
+			++pc;
+		return pc;
+	}
+
+	std::string Translator::atom(const CodeTerm::code_t &code, size_t pc, size_t end) {
+		if (pc < end && code[pc]->op() == '\'')
+			return literal(std::dynamic_pointer_cast<QuoteCodeTerm>(code[pc])->get_arg());
+
+		std::string s = "term";
+		for (; pc < end; pc++)
+			s = std::string(code[pc]->op() == 'F' ? "cam::fst(" : "cam::snd(") + s + ")";
+		return s;
+	}
+
+	std::string Translator::operation(char op, const std::string &first, const std::string &second) {
+		const char *names[] = { "add", "sub", "mul", "eq" };
+		return "cam::" + std::string(names[std::string("+-*=").find(op)]) + "(" + first + (second.empty() ? "" : ", " + second) + ")";
+	}
+
+	std::string Translator::literal(const std::string &text) {
+		Program::Literal l(text);
+		if (!l.is_fixnum) {
+			std::string number = l.number.get_str();
+			size_t i = std::find(_bignums.begin(), _bignums.end(), number) - _bignums.begin();
+			if (i == _bignums.size())
+				_bignums.push_back(number);
+			return "literal_" + std::to_string(i);
+		}
+
+		if (l.fixnum == INT64_MIN)
+			return "cam::Value(INT64_MIN)";
+		return "cam::Value(" + std::to_string(l.fixnum) + "LL)";
+	}
+
+	void Translator::line(size_t indent, const std::string &s) {
+		_os << std::string(indent, '\t') << s << std::endl;
+	}
+
+	void Translator::fail(const std::string &what) {
+		throw CAMException("Cannot translate: " + what);
+	}
+
+	std::string Translator::escape(const std::string &s) {
+		std::ostringstream os;
+		for (auto it = s.begin(); it != s.end(); ++it) {
+			unsigned char c = static_cast<unsigned char>(*it);
+			if (c == '\\' || c == '"' || c == '?')
+				os << '\\' << c;
+			else if (c < ' ' || c >= 0x7f) {
+				const char digits[] = "01234567";
+				os << '\\' << digits[c >> 6] << digits[(c >> 3) & 7] << digits[c & 7];
+			}
+			else
+				os << c;
+		}
+		return os.str();
+	}
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include <sstream>
+
+#include "code.h"
+
+namespace CAM
+{
+	// Ahead-of-time translation of the parsed code to a self-contained C++
+	// translation unit, which needs only GMP besides the standard library.
+	// Every body of '\' and 'Y' becomes a function, the stack of the machine
+	// becomes its locals and the term its argument. Applications in tail
+	// position return the body to run next instead of calling it, so tail
+	// recursive loops run in constant space; the other applications nest on
+	// the native stack.
+	//
+	// The stack use of every block must be known at translation: a body
+	// leaves the stack as it finds it and never takes more from it than it
+	// pushes, both arms of 'b' leave the same number of values. Closures
+	// keep their whole environment, as without --trim-env. The program prints
+	// the time and the term as the interpreter does with -r; after an error
+	// only the message.
+	class Translator
+	{
+		const CodeTerm::code_t &_code;
+		// bodies of '\' and 'Y' in the order they are found
+		std::vector<const CodeTerm::code_t*> _bodies;
+		// decimal text of every literal which is not a fixnum
+		std::vector<std::string> _bignums;
+
+		// state of the function being translated
+		std::ostringstream _os;
+		size_t _max_depth;
+		bool _is_body;
+
+	public:
+		Translator(const CodeTerm::code_t &code) : _code(code), _max_depth(0), _is_body(false) {}
+
+		// Writes the translation unit. Throws CAMException if the stack use
+		// of a block is not static.
+		void write(std::ostream &os);
+
+	private:
+		static const size_t npos = static_cast<size_t>(-1);
+
+		// Definition of the function of the block
+		std::string function(const std::string &name, const CodeTerm::code_t &code, bool is_body);
+
+		// Translates the code with depth values on the stack, returns the
+		// depth at its end, npos if the block returns from the function
+		size_t block(const CodeTerm::code_t &code, size_t depth, bool is_tail, size_t indent);
+
+		// Translates the arms of the 'b' at pc. The condition is evaluated
+		// first, then restore before both arms.
+		size_t branch(const CodeTerm::code_t &code, size_t pc, const std::string &condition, const std::string &restore, size_t depth, bool is_tail, size_t indent);
+
+		// Returns the term at the end of a tail block
+		void end(size_t depth, size_t indent);
+
+		// Checks that a body leaves the stack as it finds it when it returns
+		void leave(size_t depth) const;
+
+		// Checks that an instruction at the depth may take from the stack
+		static void take(size_t depth);
+
+		// Expression of <A,B> when A and B only read the term, returns the
+		// offset of its '>', npos if it is not such a pair
+		size_t atoms(const CodeTerm::code_t &code, size_t pc, std::string &first, std::string &second);
+
+		// End of the chain of F and S or of the quote at pc
+		static size_t atom_end(const CodeTerm::code_t &code, size_t pc);
+
+		// Expression of a chain of F and S or of a quote from pc to end
+		std::string atom(const CodeTerm::code_t &code, size_t pc, size_t end);
+
+		// Expression of the operation on the pair (first, second), or on the
+		// pair first if second is empty
+		static std::string operation(char op, const std::string &first, const std::string &second = "");
+
+		static bool is_operation(char op) { return op == '+' || op == '-' || op == '*' || op == '='; }
+
+		// Expression of the literal, bignums are constants of the unit
+		std::string literal(const std::string &text);
+
+		std::string local(size_t n) const { return "s" + std::to_string(n); }
+
+		void line(size_t indent, const std::string &s);
+
+		static void fail(const std::string &what);
+
+		static std::string escape(const std::string &s);
+	};
+}
@@ -0,0 +1,9 @@
+#include "value.h"
+#include "printer.h"
+
+namespace CAM
+{
+	std::string Value::to_string(const Program *program) const {
+		return Printer().to_string(*this, program);
+	}
+}
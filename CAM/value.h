@@ -0,0 +1,186 @@
+#pragma once
+
+#include <cstdint>
+
+#include "gmpxx.h"
+#include "number.h"
+#include "program.h"
+#include "term.h"
+
+namespace CAM
+{
+	struct Cell;
+	class Heap;
+
+	// Runtime term of the machine: a kind tag and either an inline fixnum or a
+	// pointer to a cell in the heap of the machine. Type checks compare the tag.
+	// Values are plain data, cells are reclaimed by the collector of the heap.
+	// Values are printed by Printer.
+	//
+	// An environment of a body, (env, arg), may be stored flat: one cell holds
+	// arg, the components of env along F and the innermost env at the end. The
+	// value is a view from an offset into the cell and behaves exactly as the
+	// nested pairs it replaces: F moves the offset, S reads the value at it.
+	// The environment of a closure spans at most two cells, an application
+	// puts the argument in a cell of its own in front of it.
+	class Value
+	{
+	public:
+		enum kind_t : unsigned char
+		{
+			kind_unit,
+			kind_fixnum,
+			// kinds below point to a cell
+			kind_pair,
+			kind_bignum,
+			kind_closure,
+			kind_rec,
+			kind_env
+		};
+
+	private:
+		friend class Heap;
+
+		kind_t _kind;
+		// kind_env: position of the view in the cell
+		uint32_t _offset;
+		union
+		{
+			Cell *_cell;
+			int64_t _fixnum;
+		};
+
+		Value(kind_t kind, Cell *cell, uint32_t offset = 0) : _kind(kind), _offset(offset), _cell(cell) {}
+
+	public:
+		Value() : _kind(kind_unit), _offset(0), _fixnum(0) {}
+
+		kind_t kind() const { return _kind; }
+
+		bool is_unit() const { return _kind == kind_unit; }
+		// kind_pair or kind_env
+		bool is_pair() const { return _kind == kind_pair || _kind == kind_env; }
+		bool is_fixnum() const { return _kind == kind_fixnum; }
+		bool is_number() const { return _kind == kind_fixnum || _kind == kind_bignum; }
+		bool is_closure() const { return _kind == kind_closure || _kind == kind_rec; }
+		bool is_rec() const { return _kind == kind_rec; }
+		bool is_boxed() const { return _kind >= kind_pair; }
+
+		// Fixnum or address of the cell, identifies the value in traces
+		int64_t id() const { return _fixnum; }
+
+		// kind_env: position of the view in the cell
+		uint32_t offset() const { return _offset; }
+
+		// kind_pair, kind_env
+		inline Value first() const;
+		inline Value second() const;
+
+		// kind_env: the nth variable, F...FS with n F, if flat cells hold it;
+		// nullptr otherwise
+		inline const Value* variable(size_t n) const;
+
+		// kind_fixnum
+		int64_t fixnum() const { return _fixnum; }
+
+		// kind_fixnum, kind_bignum
+		inline mpz_class number() const;
+		inline bool is_zero() const;
+
+		// kind_closure, kind_rec; the environment of kind_rec already contains
+		// the closure itself: (env, closure)
+		inline size_t entry() const;
+		inline const Value& env() const;
+
+		static Value make() { return Value(); }
+		static Value make_fixnum(int64_t number) { Value v; v._kind = kind_fixnum; v._fixnum = number; return v; }
+
+		// Closures are printed with the code of the program they belong to
+		std::string to_string(const Program *program) const;
+	};
+
+	// Header of the objects in the heap. A forwarded cell keeps its kind, so
+	// the collector can still walk the space it was copied from; the new
+	// address is stored over the payload.
+	struct alignas(8) Cell
+	{
+		Value::kind_t kind;
+		bool is_forwarded;
+		// kind_env: number of the values
+		uint32_t length;
+	};
+
+	struct PairCell : public Cell
+	{
+		Value first;
+		Value second;
+	};
+
+	struct NumberCell : public Cell
+	{
+		// mpz_t does not point into itself, so the cell can be moved bitwise
+		mpz_t number;
+	};
+
+	struct ClosureCell : public Cell
+	{
+		size_t entry;
+		Value env;
+	};
+
+	// Values of an environment follow the header, the last one is the innermost
+	// env which is not flat
+	struct EnvCell : public Cell
+	{
+		Value* values() { return reinterpret_cast<Value*>(this + 1); }
+	};
+
+	Value Value::first() const {
+		if (_kind == kind_pair)
+			return static_cast<PairCell*>(_cell)->first;
+
+		EnvCell *c = static_cast<EnvCell*>(_cell);
+		if (_offset + 2 == c->length)
+			return c->values()[_offset + 1];
+		return Value(kind_env, _cell, _offset + 1);
+	}
+
+	Value Value::second() const {
+		if (_kind == kind_pair)
+			return static_cast<PairCell*>(_cell)->second;
+		return static_cast<EnvCell*>(_cell)->values()[_offset];
+	}
+
+	const Value* Value::variable(size_t n) const {
+		if (_kind != kind_env)
+			return nullptr;
+
+		EnvCell *c = static_cast<EnvCell*>(_cell);
+		size_t offset = _offset;
+		// the last value of a cell continues the environment
+		while (offset + n + 1 >= c->length) {
+			const Value &next = c->values()[c->length - 1];
+			if (next._kind != kind_env)
+				return nullptr;
+			n -= c->length - 1 - offset;
+			c = static_cast<EnvCell*>(next._cell);
+			offset = next._offset;
+		}
+		return &c->values()[offset + n];
+	}
+
+	mpz_class Value::number() const {
+		if (_kind == kind_fixnum)
+			return Number::to_mpz(_fixnum);
+		return mpz_class(static_cast<NumberCell*>(_cell)->number);
+	}
+
+	bool Value::is_zero() const {
+		if (_kind == kind_fixnum)
+			return _fixnum == 0;
+		return mpz_sgn(static_cast<NumberCell*>(_cell)->number) == 0;
+	}
+
+	size_t Value::entry() const { return static_cast<ClosureCell*>(_cell)->entry; }
+	const Value& Value::env() const { return static_cast<ClosureCell*>(_cell)->env; }
+}
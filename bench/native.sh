@@ -0,0 +1,32 @@
+#!/bin/sh
+# Run times of the corpus programs in the interpreter and translated to C++
+# with --emit-cpp, the results of both are compared.
+# Run with: bench/native.sh cam [corpus] [iterations]
+# CXX and CXXFLAGS select the compiler of the translated programs.
+
+cam=${1:?usage: $0 cam [corpus] [iterations]}
+corpus=${2:-$(dirname "$0")/corpus.txt}
+iterations=${3:-10}
+cxx=${CXX:-g++}
+cxxflags=${CXXFLAGS:--std=c++14 -O2}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+"$cam" --bench "$corpus" --iterations "$iterations" > "$dir/bench.csv" || exit 1
+
+echo "name,interpreter_run_s,native_run_s,speedup,result"
+grep -v '^[[:space:]]*\(#\|$\)' "$corpus" | while read -r name code; do
+	interpreter=$(grep "^$name," "$dir/bench.csv" | cut -d, -f5)
+	if ! "$cam" --emit-cpp "$dir/$name.cpp" "$code" ||
+		! $cxx $cxxflags -o "$dir/$name" "$dir/$name.cpp" -lgmpxx -lgmp -lpthread; then
+		echo "$name,$interpreter,,,failed"
+		continue
+	fi
+
+	"$dir/$name" --iterations "$iterations" > "$dir/$name.out" < /dev/null
+	native=$(sed -n 's/^time: //p' "$dir/$name.out")
+	expected=$("$cam" -r "$code" < /dev/null | grep '^term:')
+	if [ "$expected" = "$(grep '^term:' "$dir/$name.out")" ]; then result=same; else result=different; fi
+	speedup=$(awk -v a="$interpreter" -v b="$native" 'BEGIN { if (b > 0) printf "%.2f", a / b }')
+	echo "$name,$interpreter,$native,$speedup,$result"
+done
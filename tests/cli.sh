@@ -0,0 +1,42 @@
+#!/bin/sh
+# Cases of the command line: every case runs the interpreter with its options
+# and expects a line of the output to start with the given text. A run which
+# does not end within the timeout fails.
+# Run with: tests/cli.sh cam [timeout]
+
+cam=${1:?usage: $0 cam [timeout]}
+seconds=${2:-10}
+failed=0
+
+# check name expected arguments...
+check() {
+	name=$1
+	expected=$2
+	shift 2
+	output=$(timeout "$seconds" "$cam" "$@" < /dev/null 2>&1)
+	if [ $? -eq 124 ]; then
+		echo "$name: no end within $seconds s"
+		failed=$((failed + 1))
+	elif ! printf '%s\n' "$output" | prefix="$expected" awk 'index($0, ENVIRON["prefix"]) == 1 { found = 1 } END { exit !found }'; then
+		echo "$name: no line starts with: $expected"
+		printf '%s\n' "$output" | sed 's/^/	/'
+		failed=$((failed + 1))
+	else
+		echo "$name: ok"
+	fi
+}
+
+loop="<Y(<FS,S>e),'(1)>e"
+
+# a fork takes the steps left to the run
+check parallel_max_steps_right "Limit reached: steps" -r --parallel --fork-cost 1 --max-steps 1000000 "<<'(1),'(2)>+,$loop>"
+check parallel_max_steps_left "Limit reached: steps" -r --parallel --fork-cost 1 --max-steps 1000000 "<$loop,<'(1),'(2)>+>"
+check parallel_max_steps_nested "Limit reached: steps" -r --parallel --fork-cost 1 --max-steps 1000000 "<<'(1),'(2)>+,<'(3),<'(4),$loop>>>"
+
+# the depth counts the second of a pair as the first one
+list="<Y(<<S,'(0)>=b(('(0)),(<S,<FS,<S,'(1)>->e>))),'(1000)>e"
+check print_depth_right "term: (1000, (999, (998, (997, ...))))" -r --print-depth 4 "$list"
+check print_depth_left "term: ((((..., 3), 4), 5), 6)" -r --print-depth 4 "<<<<<'(1),'(2)>,'(3)>,'(4)>,'(5)>,'(6)>"
+check print_depth_width "term: (1000, (999, ...))" -r --print-depth 4 --print-width 2 "$list"
+
+[ $failed -eq 0 ]